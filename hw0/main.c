@@ -10,6 +10,39 @@
 #define EFFCHECK NO     // YES/NO, efficiency check: big-O (max depth), min/avg depth, etc.
 
 #define SEARCH HASH
+
+#define CHARS 1           // Single printable characters (List)
+#define WORDS 2           // Words, i.e. maximal runs of [A-Za-z0-9_] (WordList)
+#define NGRAMS 3          // Byte n-grams over printable characters (WordList)
+
+#ifndef COUNT
+    #define COUNT CHARS   // what to count, e.g. gcc -DCOUNT=WORDS main.c
+#endif
+#ifndef NGRAMLEN
+    #define NGRAMLEN 3    // n for COUNT == NGRAMS
+#endif
+
+#ifndef SKETCH
+    #define SKETCH NO     // YES/NO, approximate WORDS/NGRAMS counting in bounded memory
+#endif
+#if SKETCH == YES && COUNT == CHARS
+    #error "SKETCH is for WORDS and NGRAMS, CHARS already fits the 256-slot table"
+#endif
+#ifndef TOPK
+    #define TOPK 20       // number of heavy hitters reported when SKETCH == YES
+#endif
+#ifndef MONITOR
+    #define MONITOR 2000  // number of keys monitored by Space-Saving, at least TOPK
+#endif
+#ifndef EPSILON
+    #define EPSILON 0.0001 // count-min error: estimate <= true count + EPSILON * total
+#endif
+#ifndef DELTA
+    #define DELTA 0.001   // probability that the EPSILON bound does not hold, e.g. -DDELTA=0.01
+#endif
+#if MONITOR < TOPK
+    #error "MONITOR must be at least TOPK"
+#endif
 /*******************************************************************************
    Algorithm                           Time complexity comparison
 1: linear search                         O(n)
@@ -35,6 +68,25 @@ Description:
    Unlimited set of characters.
    Additional memory overhead for tree structure.
    Not implemented in this code.
+
+   Counting mode                       Structure
+CHARS:  single characters              List, using the SEARCH algorithm above
+WORDS:  words                          WordList (growable open-addressing hash)
+NGRAMS: n-grams, n = NGRAMLEN          WordList (growable open-addressing hash)
+
+Description:
+1. CHARS is the original character count of HW#0.
+2. WORDS and NGRAMS need arbitrary keys, which do not fit the 256-slot table.
+   Keys are copied once into a growable arena, and the hash table only holds
+   4-byte indices, so memory is at most about 64 bytes per distinct key plus
+   the key bytes, independent of the number of tokens read.
+   NGRAMS only looks at printable characters, so NGRAMLEN 1 gives the same
+   result as CHARS.
+3. With SKETCH == YES, WORDS and NGRAMS are counted approximately by a Sketch,
+   a count-min sketch plus a Space-Saving table of MONITOR keys.
+   Memory is fixed by EPSILON, DELTA and MONITOR, whatever the number of
+   distinct keys, and only the TOPK heavy hitters are reported, by count,
+   each with the range that its true count is guaranteed to lie in.
 *******************************************************************************/
 
 #include <stdio.h>
@@ -92,6 +144,20 @@ struct Node {
     #endif
 };
 
+#define NODEBLOCK 64      // number of nodes in the first block of the node pool
+
+typedef struct Block Block;
+
+// Nodes are not malloc'd one by one, they are taken from blocks owned by the List.
+// Each block is twice as large as the previous one,
+// so a list of n nodes costs O(log n) malloc/free calls
+// and consecutive nodes are next to each other in memory.
+struct Block {
+    Block* next;   // previously allocated block
+    int size;      // number of nodes in this block
+    Node nodes[];
+};
+
 // Note:
 // Linked-List is necessary for recording the order of appearance.
 // BST and AVL are used to enhance search performance.
@@ -102,6 +168,8 @@ struct List {
     Node* head;
     Node* tail;
     List* (*addch)(struct List* lst, char ch);
+    Block* blocks; // node pool, the most recent block first
+    int used;      // number of nodes used in the most recent block
 
     #if SEARCH == HASH
         Node* hash[256];
@@ -117,9 +185,30 @@ struct List {
         int mindepth; // minimum traversal depth
         int searches; // number of searches, for average traversal depth calculation
         int totaldepth; // total traversal depth, for average traversal depth calculation
+        int nblocks; // number of blocks in the node pool
     #endif
 };
 
+// take a node from the node pool of the list
+Node* new_node(List* lst) {
+    if (lst->blocks == NULL || lst->used == lst->blocks->size) {
+        int size = lst->blocks == NULL ? NODEBLOCK : lst->blocks->size * 2;
+        Block* block = (Block*)malloc(sizeof(Block) + sizeof(Node) * size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = lst->blocks;
+        block->size = size;
+        lst->blocks = block;
+        lst->used = 0;
+
+        #if EFFCHECK == YES
+            lst->nblocks++;
+        #endif
+    }
+    return &lst->blocks->nodes[lst->used++];
+}
+
 #if SEARCH == LINEARSEARCH
 // add up character count in a linked-list using linear search
 List* addch(List* lst, char ch) {
@@ -129,7 +218,7 @@ List* addch(List* lst, char ch) {
     #endif
 
     if (lst->head == NULL) {
-        lst->head = (Node*)malloc(sizeof(Node));
+        lst->head = new_node(lst);
         lst->head->ch = ch;
         lst->head->count = 1;
         lst->head->next = NULL;
@@ -163,7 +252,7 @@ List* addch(List* lst, char ch) {
             }
             cur = cur->next;
         }
-        lst->tail->next = (Node*)malloc(sizeof(Node));
+        lst->tail->next = new_node(lst);
         lst->tail->next->ch = ch;
         lst->tail->next->count = 1;
         lst->tail->next->next = NULL;
@@ -195,7 +284,7 @@ List* addch(List* lst, char ch) {
     #endif
 
     if (lst->hash[ch] == NULL) {
-        lst->hash[ch] = (Node*)malloc(sizeof(Node));
+        lst->hash[ch] = new_node(lst);
         lst->hash[ch]->ch = ch;
         lst->hash[ch]->count = 1;
         lst->hash[ch]->next = NULL;
@@ -243,7 +332,7 @@ List* addch(List* lst, char ch) {
     #endif
 
     if (lst->head == NULL) {
-        lst->head = (Node*)malloc(sizeof(Node));
+        lst->head = new_node(lst);
         lst->head->ch = ch;
         lst->head->count = 1;
         lst->head->left = NULL;
@@ -286,7 +375,7 @@ List* addch(List* lst, char ch) {
                 cur = cur->right;
             }
         }
-        Node* newnode = (Node*)malloc(sizeof(Node));
+        Node* newnode = new_node(lst);
         newnode->ch = ch;
         newnode->count = 1;
         newnode->left = NULL;
@@ -327,7 +416,7 @@ List* addch(List* lst, char ch) {
     #endif
 
     if (lst->head == NULL) {
-        lst->head = (Node*)malloc(sizeof(Node));
+        lst->head = new_node(lst);
         lst->head->ch = ch;
         lst->head->count = 1;
         lst->head->left = NULL;  // for tree
@@ -378,7 +467,7 @@ List* addch(List* lst, char ch) {
         // and then we need to insert a new node,
         // which is a bit more complicated than BST
 
-        Node* newnode = (Node*)malloc(sizeof(Node));
+        Node* newnode = new_node(lst);
         newnode->parent = parent; // parent node of the new node
         newnode->ch = ch; // key value
         newnode->count = 1; // new character, must be 1
@@ -435,6 +524,8 @@ List* new_list() {
     lst->head = NULL;
     lst->tail = NULL;
     lst->addch = addch;
+    lst->blocks = NULL;
+    lst->used = 0;
 
     #if SEARCH == HASH
         for (int i = 0; i < 256; i++) {
@@ -448,6 +539,7 @@ List* new_list() {
         lst->mindepth = INT_MAX;
         lst->searches = 0;
         lst->totaldepth = 0;
+        lst->nblocks = 0;
     #endif
     
     return lst;
@@ -455,10 +547,10 @@ List* new_list() {
 
 // List destructor
 void free_list(List* lst) {
-    Node* cur = lst->head;
-    while (cur != NULL) {
-        Node* tmp = cur;
-        cur = cur->next;
+    Block* block = lst->blocks; // one free() per block, the nodes are not visited
+    while (block != NULL) {
+        Block* tmp = block;
+        block = block->next;
         free(tmp);
     }
 
@@ -471,13 +563,617 @@ void free_list(List* lst) {
     free(lst);
 }
 
-int main() {
+#if COUNT == WORDS || COUNT == NGRAMS
+#define READSIZE 65536    // bytes per fread() block
+#define MINSLOTS 1024     // initial number of hash slots, must be a power of 2
+#define MINARENA 65536    // initial size of the key arena in bytes
+
+typedef struct Word Word;
+typedef struct WordList WordList;
+
+struct Word {
+    unsigned int hash; // cached hash value, so that growing never rehashes the keys
+    unsigned int len;  // key length in bytes
+    size_t key;        // offset of the key in the arena (the arena may be moved by realloc)
+    long long count;
+};
+
+// Note:
+// Words are kept in a dense array in the order of appearance,
+// which plays the role of the linked-list in List.
+// The hash table only stores indices into that array (index + 1, 0 for empty),
+// so the table can be doubled without moving any Word.
+
+struct WordList {
+    Word* words;         // distinct keys in the order of appearance
+    unsigned int n;      // number of distinct keys
+    unsigned int cap;    // capacity of words
+    unsigned int* slots; // open addressing with linear probing
+    unsigned int mask;   // number of slots - 1
+    char* arena;         // key storage
+    size_t used;         // bytes used in the arena
+    size_t size;         // bytes allocated for the arena
+    WordList* (*addword)(WordList* wl, const char* key, unsigned int len);
+
+    #if EFFCHECK == YES
+        long long searches; // number of searches
+        long long probes;   // total number of probed slots
+        int depth;          // maximum probe length
+        int grows;          // number of times the hash table was doubled
+    #endif
+};
+
+// FNV-1a, 32-bit
+unsigned int hashkey(const char* key, unsigned int len) {
+    unsigned int h = 2166136261u;
+    for (unsigned int i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// double the hash table, keeping the load factor at or below 1/2
+int grow_slots(WordList* wl) {
+    unsigned int nslots = (wl->mask + 1) * 2;
+    unsigned int* slots = (unsigned int*)calloc(nslots, sizeof(unsigned int));
+    if (slots == NULL) {
+        return 1;
+    }
+    for (unsigned int i = 0; i < wl->n; i++) { // re-insert the indices only, keys are not touched
+        unsigned int s = wl->words[i].hash & (nslots - 1);
+        while (slots[s] != 0) {
+            s = (s + 1) & (nslots - 1);
+        }
+        slots[s] = i + 1;
+    }
+    free(wl->slots);
+    wl->slots = slots;
+    wl->mask = nslots - 1;
+
+    #if EFFCHECK == YES
+        wl->grows++;
+    #endif
+
+    return 0;
+}
+
+// add up the count of a key (a word or an n-gram)
+// returns NULL if memory allocation failed
+WordList* addword(WordList* wl, const char* key, unsigned int len) {
+    unsigned int h = hashkey(key, len);
+    unsigned int s = h & wl->mask;
+
+    #if EFFCHECK == YES
+        int trav = 1;
+        wl->searches++;
+    #endif
+
+    while (wl->slots[s] != 0) {
+        Word* w = &wl->words[wl->slots[s] - 1];
+        if (w->hash == h && w->len == len && memcmp(wl->arena + w->key, key, len) == 0) {
+            w->count++;
+
+            #if EFFCHECK == YES
+                wl->probes += trav;
+                if (trav > wl->depth) {
+                    wl->depth = trav;
+                }
+            #endif
+
+            return wl;
+        }
+        s = (s + 1) & wl->mask;
+
+        #if EFFCHECK == YES
+            trav++;
+        #endif
+    }
+
+    #if EFFCHECK == YES
+        wl->probes += trav;
+        if (trav > wl->depth) {
+            wl->depth = trav;
+        }
+    #endif
+
+    // new key: make room in the word array and in the arena
+    if (wl->n == wl->cap) {
+        Word* words = (Word*)realloc(wl->words, sizeof(Word) * wl->cap * 2);
+        if (words == NULL) {
+            return NULL;
+        }
+        wl->words = words;
+        wl->cap *= 2;
+    }
+    if (wl->used + len > wl->size) {
+        size_t size = wl->size * 2;
+        while (wl->used + len > size) {
+            size *= 2;
+        }
+        char* arena = (char*)realloc(wl->arena, size);
+        if (arena == NULL) {
+            return NULL;
+        }
+        wl->arena = arena;
+        wl->size = size;
+    }
+    memcpy(wl->arena + wl->used, key, len);
+
+    Word* w = &wl->words[wl->n];
+    w->hash = h;
+    w->len = len;
+    w->key = wl->used;
+    w->count = 1;
+    wl->used += len;
+    wl->slots[s] = ++wl->n;
+
+    if (wl->n * 2 > wl->mask + 1) { // keep the load factor at or below 1/2
+        if (grow_slots(wl) != 0) {
+            return NULL;
+        }
+    }
+    return wl;
+}
+
+// WordList constructor
+WordList* new_wordlist() {
+    WordList* wl = (WordList*)malloc(sizeof(WordList));
+    if (wl == NULL) {
+        return NULL;
+    }
+    wl->n = 0;
+    wl->cap = MINSLOTS / 2;
+    wl->words = (Word*)malloc(sizeof(Word) * wl->cap);
+    wl->mask = MINSLOTS - 1;
+    wl->slots = (unsigned int*)calloc(MINSLOTS, sizeof(unsigned int));
+    wl->used = 0;
+    wl->size = MINARENA;
+    wl->arena = (char*)malloc(wl->size);
+    wl->addword = addword;
+    if (wl->words == NULL || wl->slots == NULL || wl->arena == NULL) {
+        free(wl->words);
+        free(wl->slots);
+        free(wl->arena);
+        free(wl);
+        return NULL;
+    }
+
+    #if EFFCHECK == YES
+        wl->searches = 0;
+        wl->probes = 0;
+        wl->depth = 0;
+        wl->grows = 0;
+    #endif
+
+    return wl;
+}
+
+// WordList destructor
+void free_wordlist(WordList* wl) {
+    free(wl->words);
+    free(wl->slots);
+    free(wl->arena);
+    free(wl);
+}
+
+#if SKETCH == YES
+#define EULER 2.718281828459045
+#define SKSLOTS (MONITOR * 4) // slots of the Space-Saving index, kept sparse for short probes
+
+typedef struct Monitored Monitored;
+typedef struct Sketch Sketch;
+
+struct Monitored {
+    unsigned long long hash;
+    char* key;         // owned copy of the key, reused when the entry is evicted
+    unsigned int len;  // key length in bytes
+    unsigned int cap;  // bytes allocated for key
+    long long count;   // Space-Saving count, never below the true count
+    long long err;     // overestimation, count - err is never above the true count
+    long long est;     // min(count, count-min estimate), filled in for reporting
+    int pos;           // position in the heap
+};
+
+// Note:
+// The count-min sketch answers "how often was this key seen" for any key,
+// the Space-Saving table decides which keys are worth remembering at all.
+// Space-Saving keeps MONITOR keys in a min-heap by count; an unmonitored key
+// replaces the minimum and inherits its count as the error.
+// Both structures are allocated once, in new_sketch().
+
+struct Sketch {
+    unsigned long long* cms; // depth x width counters
+    int width;               // ceil(e / EPSILON)
+    int depth;               // ceil(ln(1 / DELTA))
+    long long total;         // number of keys read
+
+    Monitored mon[MONITOR];
+    int heap[MONITOR];          // indices into mon, min-heap by count
+    int n;                   // number of monitored keys
+    int slots[SKSLOTS];      // open addressing from key to mon index + 1, 0 for empty
+    Sketch* (*addword)(Sketch* sk, const char* key, unsigned int len);
+
+    #if EFFCHECK == YES
+        long long hits;      // keys found in the Space-Saving table
+        long long evictions; // keys which replaced the minimum
+    #endif
+};
+
+// FNV-1a, 64-bit
+unsigned long long hashkey64(const char* key, unsigned int len) {
+    unsigned long long h = 14695981039346656037ull;
+    for (unsigned int i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// count-min column of row i, by double hashing (only one hash per key)
+int cms_col(Sketch* sk, unsigned long long h, int i) {
+    unsigned int h1 = (unsigned int)h;
+    unsigned int h2 = (unsigned int)(h >> 32) | 1;
+    return (int)((h1 + (unsigned int)i * h2) % (unsigned int)sk->width);
+}
+
+unsigned long long cms_estimate(Sketch* sk, unsigned long long h) {
+    unsigned long long est = sk->cms[cms_col(sk, h, 0)];
+    for (int i = 1; i < sk->depth; i++) {
+        unsigned long long v = sk->cms[(size_t)i * sk->width + cms_col(sk, h, i)];
+        if (v < est) {
+            est = v;
+        }
+    }
+    return est;
+}
+
+void heap_swap(Sketch* sk, int a, int b) {
+    int t = sk->heap[a];
+    sk->heap[a] = sk->heap[b];
+    sk->heap[b] = t;
+    sk->mon[sk->heap[a]].pos = a;
+    sk->mon[sk->heap[b]].pos = b;
+}
+
+// restore the heap after the count at position i has grown
+void heap_down(Sketch* sk, int i) {
+    while (1) {
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int min = i;
+        if (l < sk->n && sk->mon[sk->heap[l]].count < sk->mon[sk->heap[min]].count) min = l;
+        if (r < sk->n && sk->mon[sk->heap[r]].count < sk->mon[sk->heap[min]].count) min = r;
+        if (min == i) {
+            return;
+        }
+        heap_swap(sk, i, min);
+        i = min;
+    }
+}
+
+// find the slot of a monitored key, or the empty slot where it would go
+int find_slot(Sketch* sk, unsigned long long h, const char* key, unsigned int len) {
+    int s = (int)(h % SKSLOTS);
+    while (sk->slots[s] != 0) {
+        Monitored* m = &sk->mon[sk->slots[s] - 1];
+        if (m->hash == h && m->len == len && memcmp(m->key, key, len) == 0) {
+            return s;
+        }
+        s = (s + 1) % SKSLOTS;
+    }
+    return s;
+}
+
+// remove a slot, shifting back the entries of its probe sequence (no tombstones)
+void remove_slot(Sketch* sk, int s) {
+    int next = (s + 1) % SKSLOTS;
+    sk->slots[s] = 0;
+    while (sk->slots[next] != 0) {
+        int home = (int)(sk->mon[sk->slots[next] - 1].hash % SKSLOTS);
+        // move the entry back if its home is not in the cyclic range (s, next]
+        if ((s <= next) ? (home <= s || home > next) : (home <= s && home > next)) {
+            sk->slots[s] = sk->slots[next];
+            sk->slots[next] = 0;
+            s = next;
+        }
+        next = (next + 1) % SKSLOTS;
+    }
+}
+
+// copy a key into a monitored entry
+// returns 1 if memory allocation failed
+int set_key(Monitored* m, unsigned long long h, const char* key, unsigned int len) {
+    if (len > m->cap) {
+        char* tmp = (char*)realloc(m->key, len);
+        if (tmp == NULL) {
+            return 1;
+        }
+        m->key = tmp;
+        m->cap = len;
+    }
+    memcpy(m->key, key, len);
+    m->len = len;
+    m->hash = h;
+    return 0;
+}
+
+// add up the approximate count of a key
+// returns NULL if memory allocation failed
+Sketch* addsketch(Sketch* sk, const char* key, unsigned int len) {
+    unsigned long long h = hashkey64(key, len);
+    sk->total++;
+
+    // count-min with conservative update: only the minimal counters grow
+    unsigned long long est = cms_estimate(sk, h) + 1;
+    for (int i = 0; i < sk->depth; i++) {
+        unsigned long long* v = &sk->cms[(size_t)i * sk->width + cms_col(sk, h, i)];
+        if (*v < est) {
+            *v = est;
+        }
+    }
+
+    // Space-Saving
+    int s = find_slot(sk, h, key, len);
+    if (sk->slots[s] != 0) {
+        Monitored* m = &sk->mon[sk->slots[s] - 1];
+        m->count++;
+        heap_down(sk, m->pos);
+
+        #if EFFCHECK == YES
+            sk->hits++;
+        #endif
+    } else if (sk->n < MONITOR) { // count 1 is a minimum, so it can go to the end of the heap
+        Monitored* m = &sk->mon[sk->n];
+        if (set_key(m, h, key, len) != 0) {
+            return NULL;
+        }
+        m->count = 1;
+        m->err = 0;
+        m->pos = sk->n;
+        sk->heap[sk->n] = sk->n;
+        sk->slots[s] = ++sk->n;
+        for (int i = m->pos; i > 0 && sk->mon[sk->heap[(i - 1) / 2]].count > 1; i = (i - 1) / 2) {
+            heap_swap(sk, i, (i - 1) / 2);
+        }
+    } else { // replace the key with the minimal count
+        int victim = sk->heap[0];
+        Monitored* m = &sk->mon[victim];
+        remove_slot(sk, find_slot(sk, m->hash, m->key, m->len));
+        if (set_key(m, h, key, len) != 0) {
+            return NULL;
+        }
+        m->err = m->count;
+        m->count++;
+        sk->slots[find_slot(sk, h, key, len)] = victim + 1;
+        heap_down(sk, 0);
+
+        #if EFFCHECK == YES
+            sk->evictions++;
+        #endif
+    }
+    return sk;
+}
+
+// Sketch constructor
+Sketch* new_sketch() {
+    Sketch* sk = (Sketch*)malloc(sizeof(Sketch));
+    if (sk == NULL) {
+        return NULL;
+    }
+    sk->width = (int)(EULER / EPSILON) + 1;
+    sk->depth = 0;
+    for (double p = 1.0; p > DELTA; p /= EULER) { // smallest depth with e^-depth <= DELTA
+        sk->depth++;
+    }
+    sk->cms = (unsigned long long*)calloc((size_t)sk->width * sk->depth, sizeof(unsigned long long));
+    if (sk->cms == NULL) {
+        free(sk);
+        return NULL;
+    }
+    sk->total = 0;
+    sk->n = 0;
+    for (int i = 0; i < MONITOR; i++) {
+        sk->mon[i].key = NULL;
+        sk->mon[i].cap = 0;
+    }
+    for (int i = 0; i < SKSLOTS; i++) {
+        sk->slots[i] = 0;
+    }
+    sk->addword = addsketch;
+
+    #if EFFCHECK == YES
+        sk->hits = 0;
+        sk->evictions = 0;
+    #endif
+
+    return sk;
+}
+
+// Sketch destructor
+void free_sketch(Sketch* sk) {
+    for (int i = 0; i < MONITOR; i++) {
+        free(sk->mon[i].key);
+    }
+    free(sk->cms);
+    free(sk);
+}
+
+// for qsort(), larger estimates first
+int cmp_monitored(const void* a, const void* b) {
+    long long ca = (*(Monitored* const*)a)->est;
+    long long cb = (*(Monitored* const*)b)->est;
+    return (ca < cb) - (ca > cb);
+}
+
+typedef Sketch Counter;
+#else
+typedef WordList Counter;
+#endif
+
+int in_word(unsigned char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+// Count the words or n-grams of a file, exactly (WordList) or approximately (Sketch).
+// The file is read in blocks of READSIZE bytes, only an unfinished word
+// (or the last n-1 characters for n-grams) is carried over to the next block,
+// so the input is never held in memory.
+int count_words(FILE* file, Counter* wl) {
+    size_t cap = READSIZE * 2;
+    char* buf = (char*)malloc(cap);
+    if (buf == NULL) {
+        return 1;
+    }
+    size_t carry = 0; // bytes carried over from the previous block
+    size_t got;
+    do {
+        if (cap - carry < READSIZE) { // a very long word is being carried over
+            char* tmp = (char*)realloc(buf, cap * 2);
+            if (tmp == NULL) {
+                free(buf);
+                return 1;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+        got = fread(buf + carry, 1, READSIZE, file);
+        size_t end = carry + got;
+
+        #if COUNT == WORDS
+            size_t i = 0;
+            while (i < end) {
+                while (i < end && !in_word(buf[i])) {
+                    i++;
+                }
+                size_t start = i;
+                while (i < end && in_word(buf[i])) {
+                    i++;
+                }
+                if (i == end && got != 0) { // the word may continue in the next block
+                    carry = end - start;
+                    memmove(buf, buf + start, carry);
+                    break;
+                }
+                if (i > start && wl->addword(wl, buf + start, i - start) == NULL) {
+                    free(buf);
+                    return 1;
+                }
+                carry = 0;
+            }
+        #else
+            // drop the non-printable characters of the new block
+            size_t m = carry;
+            for (size_t i = carry; i < end; i++) {
+                if (buf[i] >= 32 && buf[i] <= 126) {
+                    buf[m++] = buf[i];
+                }
+            }
+            for (size_t i = 0; i + NGRAMLEN <= m; i++) {
+                if (wl->addword(wl, buf + i, NGRAMLEN) == NULL) {
+                    free(buf);
+                    return 1;
+                }
+            }
+            carry = m < NGRAMLEN ? m : NGRAMLEN - 1;
+            memmove(buf, buf + m - carry, carry);
+        #endif
+    } while (got != 0);
+
+    free(buf);
+    return 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    const char* filename = argc >= 2 ? argv[1] : "main.c";
+
+    #if COUNT == WORDS || COUNT == NGRAMS
+        FILE* wfile = fopen(filename, "rb");
+        if (wfile == NULL) {
+            printf("File not found.\n");
+            return 1;
+        }
+        #if SKETCH == YES
+            Sketch* sk = new_sketch();
+            if (sk == NULL || count_words(wfile, sk) != 0) {
+                printf("Error: memory allocation failed\n");
+                if (sk != NULL) {
+                    free_sketch(sk);
+                }
+                fclose(wfile);
+                return 1;
+            }
+            fclose(wfile);
+
+            // print the heavy hitters by count, with the range of the true count:
+            // count - err <= true count <= min(count, count-min estimate)
+            // Note: the count-min bound holds with probability 1 - DELTA.
+            Monitored* top[MONITOR];
+            for (int i = 0; i < sk->n; i++) {
+                top[i] = &sk->mon[i];
+                top[i]->est = (long long)cms_estimate(sk, top[i]->hash);
+                if (top[i]->count < top[i]->est) {
+                    top[i]->est = top[i]->count;
+                }
+            }
+            qsort(top, sk->n, sizeof(Monitored*), cmp_monitored);
+            for (int i = 0; i < sk->n && i < TOPK; i++) {
+                printf("%.*s : %lld (%lld..%lld)\n", (int)top[i]->len, top[i]->key,
+                       top[i]->est, top[i]->count - top[i]->err, top[i]->est);
+            }
+            printf("Total: %lld, error bound: %.0f (%d x %d counters)\n",
+                   sk->total, EPSILON * sk->total, sk->depth, sk->width);
+
+            #if EFFCHECK == YES
+                printf("Statistics:\n");
+                printf("  Number of keys: %lld\n", sk->total);
+                printf("  Space-Saving hits: %lld\n", sk->hits);
+                printf("  Space-Saving evictions: %lld\n", sk->evictions);
+                printf("  Count-min memory: %zu bytes\n", (size_t)sk->width * sk->depth * sizeof(unsigned long long));
+            #endif
+
+            free_sketch(sk);
+            return 0;
+        #else
+            WordList* wl = new_wordlist();
+            if (wl == NULL || count_words(wfile, wl) != 0) {
+                printf("Error: memory allocation failed\n");
+                if (wl != NULL) {
+                    free_wordlist(wl);
+                }
+                fclose(wfile);
+                return 1;
+            }
+            fclose(wfile);
+
+            // print word or n-gram count in the order of appearance
+            for (unsigned int i = 0; i < wl->n; i++) {
+                printf("%.*s : %lld\n", (int)wl->words[i].len, wl->arena + wl->words[i].key, wl->words[i].count);
+            }
+
+            #if EFFCHECK == YES
+                printf("Statistics:\n");
+                printf("  Number of distinct keys: %u\n", wl->n);
+                printf("  Number of searches: %lld\n", wl->searches);
+                printf("  Aggregated probe length: %lld\n", wl->probes);
+                printf("  Average probe length: %.2f\n", wl->searches ? (double)wl->probes / wl->searches : 0.0);
+                printf("  Maximum probe length: %d\n", wl->depth);
+                printf("  Hash table slots: %u (doubled %d times)\n", wl->mask + 1, wl->grows);
+                printf("  Key arena: %zu of %zu bytes used\n", wl->used, wl->size);
+            #endif
+
+            free_wordlist(wl);
+            return 0;
+        #endif
+    #endif
+
     #if EFFCHECK == YES
         int totalprintablechars = 0;
     #endif
 
     // read from file
-    FILE* file = fopen("main.c", "r");
+    FILE* file = fopen(filename, "r");
     if (file == NULL) {
         printf("File not found.\n");
         return 1;
@@ -514,6 +1210,7 @@ int main() {
         printf("  Minimum traversal depth: %d\n", lst->mindepth);
         printf("  Average traversal depth: %.2f\n", (float)lst->totaldepth / lst->searches);
         printf("  Maximum traversal depth: %d\n", lst->depth);
+        printf("  Node pool blocks: %d\n", lst->nblocks);
         #if SEARCH == AVL
             // AVL tree height estimation
             // https://stackoverflow.com/questions/30769383
@@ -3,24 +3,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*===========================*/
-// Global Variables for HW#1 //
+// Macros for HW#1          //
 /*===========================*/
 #define BUFFERSIZE 1024 // to store the token
-#define MAXFILENAME 256 // limit the max filename length
 #define EOFF 255        // use 255 to represent EOF (redefine EOF)
 #define ERROR_STATE 99  // error state
 #define MAXTOKEN 256    // max token length
 #define MAXTOKENTYPE 50 // max token type length
+#define MAXTHREADS 64   // max number of scanner threads (option -j)
+#define MINCHUNK 65536  // min number of bytes per scanner thread
+#define SINKBATCH 256   // number of tokens pushed to a TokenSink at once
+#define WRITEBUFSIZE 65536 // output buffer of a Writer
 
-// use global variables to store the file content
-unsigned char c;
-unsigned char buffer[BUFFERSIZE] = {0};
-int len = 0;
+#define YES 1
+#define NO 0
 
-unsigned char* ptr = NULL; // pointer to the file content cache
-size_t loc = 0; // current location in the file content cache
+#ifndef DFASTATS
+    #define DFASTATS NO // YES/NO, instrument the scanner, e.g. gcc -DDFASTATS=YES main.c -lm
+#endif
 
 /*===========================*/
 // Struct & Enum for HW#1    //
@@ -53,6 +68,7 @@ typedef struct Token Token;
 typedef struct Token {
     char value[MAXTOKEN];
     TokenType type;
+    size_t loc;       // offset of the token in the file content, see LineIndex
     Token* next;
 } Token;
 
@@ -62,1095 +78,4196 @@ typedef struct TokenList {
     int size;
 } TokenList;
 
-TokenList tklist = {NULL, NULL, 0}; // initialize the token list
+// A token as pushed to a TokenSink. Nothing is allocated for it:
+// the text is not NUL-terminated and points into the content cache.
+typedef struct TokenRef {
+    TokenType type;
+    int len;                   // length of the text
+    const unsigned char* text; // the token in the content cache
+    size_t loc;                // offset of the token in the content cache
+} TokenRef;
+
+// Instead of building a TokenList, the scanner can push the tokens to a sink,
+// in batches of SINKBATCH tokens (the last batch may be shorter).
+// The batch is only valid during the call of push().
+typedef struct TokenSink {
+    void (*push)(void* ctx, const TokenRef* tokens, int n);
+    void* ctx;                 // passed to push()
+    TokenRef batch[SINKBATCH]; // tokens not pushed yet
+    int n;
+} TokenSink;
+
+// Token and character statistics, collected by the scanner itself
+// so that the input is read only once (see option -s).
+typedef struct Stats {
+    size_t typecount[RIGHTBRACE + 1]; // number of tokens of each type
+    size_t bytecount[256];            // number of occurrences of each byte
+    unsigned char order[256];         // bytes in the order of first appearance
+    int nseen;                        // number of distinct bytes in order
+    unsigned char seen[256];          // 1 if the byte is already in order
+} Stats;
+
+#if DFASTATS == YES
+    // Phases of scanFile() timed by the instrumented build
+    typedef enum Phase {
+        ReadPhase, ScanPhase, PrintPhase, CachePhase, NPHASES
+    } Phase;
+
+    // Counters of the instrumented build (DFASTATS), dumped by printProfile().
+    // In a parallel scan, the counters of the chunks are added up, and each chunk ends in the EOF state.
+    typedef struct Profile {
+        size_t visits[ERROR_STATE + 1];                    // iterations of the scanner in each state
+        size_t transitions[ERROR_STATE + 1][ERROR_STATE + 1]; // [from][to], a state staying the same included
+        size_t tokens[RIGHTBRACE + 1];                     // number of tokens of each type
+        size_t tokenBytes[RIGHTBRACE + 1];                 // their total length
+        size_t lengths[BUFFERSIZE + 1];                    // number of tokens of each length, the last one for longer
+        double phases[NPHASES];                            // seconds spent in each phase
+    } Profile;
+#endif
+
+// A lexical error collected in recovery mode (option -k)
+typedef struct Diagnostic {
+    size_t loc;       // offset of the unexpected character in the content cache
+    int state;        // state in which the scanner failed
+    unsigned char c;  // the unexpected character
+} Diagnostic;
+
+// All the state of the scanner, so that any number of files
+// (or chunks of a file, see option -j) can be scanned at the same time.
+typedef struct Lexer {
+    unsigned char c;                  // current character
+    unsigned char buffer[BUFFERSIZE]; // to store the token
+    int len;                          // length of the token in buffer
+    unsigned char* ptr;               // pointer to the file content cache
+    size_t loc;                       // current location in the file content cache
+    size_t base;                      // offset of ptr in the file content (for a chunk)
+    TokenList tklist;                 // tokens found so far
+    TokenSink* sink;                  // if not NULL, tokens go to the sink instead of tklist
+    int stop;                         // set by a sink to end the scan at the next token
+    int useStats;                     // collect byte statistics in mygetc()
+    Stats stats;
+    int errState;                     // state in which the scanner failed
+    unsigned char errChar;            // character on which the scanner failed
+    size_t errLoc;                    // offset of errChar in the file content
+    int recover;                      // go on after a lexical error, collecting it in diags
+    Diagnostic* diags;                // the lexical errors found so far in recovery mode
+    int ndiags, diagCap;
+    #if DFASTATS == YES
+        Profile prof;
+    #endif
+} Lexer;
+
+// Lexer constructor, for a content cache terminated by EOFF
+void initLexer(Lexer* lx, unsigned char* content, int useStats) {
+    memset(lx, 0, sizeof(Lexer));
+    lx->ptr = content;
+    lx->useStats = useStats;
+}
 
 /*===========================*/
 // Functions for HW#1        //
 /*===========================*/
 
+// a string with its length, for copying without strlen()
+typedef struct Name {
+    const char* str;
+    int len;
+} Name;
+#define NAME(s) {s, sizeof(s) - 1}
+
+const Name tokenNames[RIGHTBRACE + 1] = {
+    [TYPE]         = NAME("TYPE_TOKEN"),
+    [MAIN]         = NAME("MAIN_TOKEN"),
+    [IF]           = NAME("IF_TOKEN"),
+    [ELSE]         = NAME("ELSE_TOKEN"),
+    [WHILE]        = NAME("WHILE_TOKEN"),
+    [ID]           = NAME("ID_TOKEN"),
+    [LITERAL]      = NAME("LITERAL_TOKEN"),
+    [ASSIGN]       = NAME("ASSIGN_TOKEN"),
+    [SEMICOLON]    = NAME("SEMICOLON_TOKEN"),
+    [EQUAL]        = NAME("EQUAL_TOKEN"),
+    [GREATEREQUAL] = NAME("GREATEREQUAL_TOKEN"),
+    [LESSEQUAL]    = NAME("LESSEQUAL_TOKEN"),
+    [GREATER]      = NAME("GREATER_TOKEN"),
+    [LESS]         = NAME("LESS_TOKEN"),
+    [PLUS]         = NAME("PLUS_TOKEN"),
+    [MINUS]        = NAME("MINUS_TOKEN"),
+    [LEFTPAREN]    = NAME("LEFTPAREN_TOKEN"),
+    [RIGHTPAREN]   = NAME("RIGHTPAREN_TOKEN"),
+    [LEFTBRACE]    = NAME("LEFTBRACE_TOKEN"),
+    [RIGHTBRACE]   = NAME("RIGHTBRACE_TOKEN"),
+};
+
 // Generate a string for the token type, for displaying purposes.
 // Note that the variable for output must be long enough.
 // No check will be made.
 void genTokenType(TokenType no, char* typeName) {
-    switch (no) {
-        case TYPE:             strcpy(typeName, "TYPE_TOKEN");          break;
-        case MAIN:             strcpy(typeName, "MAIN_TOKEN");          break;
-        case IF:               strcpy(typeName, "IF_TOKEN");            break;
-        case ELSE:             strcpy(typeName, "ELSE_TOKEN");          break;
-        case WHILE:            strcpy(typeName, "WHILE_TOKEN");         break;
-        case ID:               strcpy(typeName, "ID_TOKEN");            break;
-        case LITERAL:          strcpy(typeName, "LITERAL_TOKEN");       break;
-        case ASSIGN:           strcpy(typeName, "ASSIGN_TOKEN");        break;
-        case SEMICOLON:        strcpy(typeName, "SEMICOLON_TOKEN");     break;
-        case EQUAL:            strcpy(typeName, "EQUAL_TOKEN");         break;
-        case GREATEREQUAL:     strcpy(typeName, "GREATEREQUAL_TOKEN");  break;
-        case LESSEQUAL:        strcpy(typeName, "LESSEQUAL_TOKEN");     break;
-        case GREATER:          strcpy(typeName, "GREATER_TOKEN");       break;
-        case LESS:             strcpy(typeName, "LESS_TOKEN");          break;
-        case PLUS:             strcpy(typeName, "PLUS_TOKEN");          break;
-        case MINUS:            strcpy(typeName, "MINUS_TOKEN");         break;
-        case LEFTPAREN:        strcpy(typeName, "LEFTPAREN_TOKEN");     break;
-        case RIGHTPAREN:       strcpy(typeName, "RIGHTPAREN_TOKEN");    break;
-        case LEFTBRACE:        strcpy(typeName, "LEFTBRACE_TOKEN");     break;
-        case RIGHTBRACE:       strcpy(typeName, "RIGHTBRACE_TOKEN");    break;
-        default:
-            strcpy(typeName, "UNKNOWN_TOKEN");
-            break;
+    if (no >= TYPE && no <= RIGHTBRACE) {
+        strcpy(typeName, tokenNames[no].str);
+    } else {
+        strcpy(typeName, "UNKNOWN_TOKEN");
     }
 }
 
 // Add a new token to the list
-void appendToken(const char* value, TokenType type) {
+void appendToken(Lexer* lx, const char* value, TokenType type) {
+    lx->stats.typecount[type]++;
+    #if DFASTATS == YES
+        lx->prof.tokens[type]++;
+        lx->prof.tokenBytes[type] += lx->len;
+        lx->prof.lengths[lx->len < BUFFERSIZE ? lx->len : BUFFERSIZE]++;
+    #endif
+    if (lx->sink != NULL) {
+        TokenSink* sink = lx->sink;
+        TokenRef* ref = &sink->batch[sink->n++];
+        ref->type = type;
+        ref->len = lx->len; // the buffer holds exactly the bytes before lx->loc
+        ref->loc = lx->loc - lx->len;
+        ref->text = lx->ptr + ref->loc;
+        if (sink->n == SINKBATCH) {
+            sink->push(sink->ctx, sink->batch, sink->n);
+            sink->n = 0;
+        }
+        return;
+    }
     Token* newToken = (Token*)malloc(sizeof(Token));
     strcpy(newToken->value, value);
     newToken->type = type;
+    newToken->loc = lx->base + lx->loc - lx->len;
     newToken->next = NULL;
 
-    if (tklist.head == NULL) {
-        tklist.head = newToken;
-        tklist.tail = newToken;
+    if (lx->tklist.head == NULL) {
+        lx->tklist.head = newToken;
+        lx->tklist.tail = newToken;
     } else {
-        tklist.tail->next = newToken;
-        tklist.tail = newToken;
+        lx->tklist.tail->next = newToken;
+        lx->tklist.tail = newToken;
     }
-    tklist.size++;
+    lx->tklist.size++;
 }
 
-void freeTokenList() {
-    Token* current = tklist.head;
+void freeTokenList(TokenList* list) {
+    Token* current = list->head;
     while (current != NULL) {
         Token* next = current->next;
         free(current);
         current = next;
     }
-    tklist.head = NULL;
-    tklist.tail = NULL;
-    tklist.size = 0;
-}
-
-void printTokenList() {
-    Token* current = tklist.head;
-    char typeName[MAXTOKENTYPE]; // buffer for token type name
-    while (current != NULL) {
-        genTokenType(current->type, typeName);
-        printf("%s: %s\n", current->value, typeName);
-        current = current->next;
-    }
-}
-
-int in_s() {
-    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == EOFF || \
-           c == '{' || c == '}' || c == '(' || c == ')' || c == ';';
+    list->head = NULL;
+    list->tail = NULL;
+    list->size = 0;
 }
 
-int in_n() {
-    return c >= '0' && c <= '9';
-}
-
-int in_r() {
-    return c == '+' || c == '-' || c == '>' || c == '<' || c == '=';
-}
-
-int in_a() {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
-}
-
-int in_a1() {
-    return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') && \
-            (c != 'e' && c!= 'i' && c != 'm' && c != 'w');
-}
-
-int in_s1() {
-    return c == '{' || c == '}' || c == '(' || c == ')' || c == ';';
-}
+/*===========================*/
+// Line index                //
+/*===========================*/
 
-// in_a2() can not be implemented directly
-//         because it falls into the "else" branch in the if statement.
+// The offsets of the first byte of each line of a file content, to turn
+// the offset kept in a token or a diagnostic into a line and a column.
+// Nothing is tracked while scanning: the index is built on the first
+// lookup, so only a run that prints positions pays for it.
+typedef struct LineIndex {
+    const unsigned char* text;
+    size_t size;
+    size_t* starts;   // starts[i] is the offset of line i + 1, NULL until built
+    size_t n, cap;
+} LineIndex;
 
-void mygetc() { // no EOF check here, it is left for the switch statement
-    c = ptr[loc++];
-    buffer[len++] = c;
+void initLineIndex(LineIndex* li, const unsigned char* text, size_t size) {
+    li->text = text;
+    li->size = size;
+    li->starts = NULL;
+    li->n = 0;
+    li->cap = 0;
 }
 
-void myungetc() {
-    loc--;
-    len--;
-    buffer[len] = '\0'; // reset the buffer to empty
+void freeLineIndex(LineIndex* li) {
+    free(li->starts);
+    li->starts = NULL;
+    li->n = 0;
+    li->cap = 0;
 }
 
-void resetBuffer() { // note: buffer is to store the token, not file content
-    len = 0;
-    buffer[len] = '\0'; // reset the buffer to empty
+// returns 0, or -1 if out of memory
+int addLineStart(LineIndex* li, size_t start) {
+    if (li->n == li->cap) {
+        size_t cap = li->cap == 0 ? 1024 : li->cap * 2;
+        size_t* tmp = (size_t*)realloc(li->starts, sizeof(size_t) * cap);
+        if (tmp == NULL) {
+            return -1;
+        }
+        li->starts = tmp;
+        li->cap = cap;
+    }
+    li->starts[li->n++] = start;
+    return 0;
 }
 
-/*===========================*/
-// Macros for HW#0           //
-/*===========================*/
-
-#define LINEARSEARCH 1    // Linear Search
-#define HASH 2            // Hash Table (Direct Access)
-#define BST 3             // Binary Search Tree
-// #define AVL 4          // AVL (Balanced Binary Search Tree), not implemented
-
-#define YES 1
-#define NO 0
-
-#define EFFCHECK NO     // YES/NO, efficiency check: big-O (max depth), min/avg depth, etc.
-
-#define SEARCH HASH
-/*******************************************************************************
-   Algorithm                           Time complexity comparison
-1: linear search                         O(n)
-2: hash table (direct access)            O(1)
-3. BST (binary search tree)              O(n)
-4: AVL (balanced binary search tree)     O(log n), not implemented
-
-Description:
-1. Linear search is O(n) time complexity
-   Unlimited set of characters.
-   The last added character in the linked-list is with O(n) time complexity.
-   No additional memory overhead, simply a linked-list.
-2. Direct access is O(1) time complexity
-   Essentially a hash table with the key being the ASCII value of the character.
-   Specific to a finite set of 256 ASCII characters, but can be extended to Unicode.
-   In this implementation, only printable ASCII characters (32-126) are counted.
-   Finite and few additional memory overhead for the map.
-3. Binary search tree is O(n) time complexity.
-   Unlimited set of characters.
-   Worst case time complexity is O(n) when the tree is unbalanced.
-   Additional memory overhead for tree structure.
-4. AVL, a Balanced binary search tree, is O(log n) time complexity.
-   Unlimited set of characters.
-   Additional memory overhead for tree structure.
-   Not implemented in this code.
-*******************************************************************************/
-
-/*=============================*/
-// Functions & Struct for HW#0 //
-/*=============================*/
-
-#if EFFCHECK == YES
-    #define INT_MAX 0x7fffffff  // initialized for min depth calculation
-    double log2approx(int x) {
-        int n = 0;
-        int temp = x;
-        while (temp > 1) {
-            temp >>= 1;
-            n++;
-        }
-        double x1 = (double)x / (1 << n);
-
-        double xx[] = {1.0, 1.2, 1.4, 1.6, 1.8, 2.0};
-        double y[] = {0, 0.26303, 0.48543, 0.67807, 0.84800, 1};
-        int in = 6; // number of nodes for lagrange interpolation
-        double result = 0;
-        for (int i = 0; i < in; i++) { // Largrange interpolation
-            double term = y[i];
-            for (int j = 0; j < in; j++) {
-                if (j != i) {
-                    term *= (x1 - xx[j]) / (xx[i] - xx[j]);
-                }
+// Find the newlines 16 bytes at a time where SSE2 is available
+// (a compare and a movemask per block, then one bit per newline).
+// Returns 0, or -1 if out of memory.
+int buildLineIndex(LineIndex* li) {
+    const unsigned char* text = li->text;
+    size_t i = 0;
+    if (addLineStart(li, 0) < 0) {
+        return -1;
+    }
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= li->size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(text + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        while (mask != 0) {
+            if (addLineStart(li, i + __builtin_ctz(mask) + 1) < 0) {
+                return -1;
             }
-            result += term;
+            mask &= mask - 1;
         }
-
-        return n + result;
     }
 #endif
-
-typedef struct Node Node;
-typedef struct List List;
-// Reasons why Node Node and List List are used:
-// https://stackoverflow.com/questions/1675351/typedef-struct-vs-struct-definitions
-
-struct Node {
-    char ch;
-    int count;
-    Node* next;
-
-    #if SEARCH == BST || SEARCH == AVL
-        Node* prev; // for doubly linked-list
-        Node* left; // for [balanced] binary search tree
-        Node* right;
-    #endif
-
-    #if SEARCH == AVL
-        int BF; // balance factor, for AVL tree
-        Node* parent; // parent node, for AVL tree
-    #endif
-};
-
-// Note:
-// Linked-List is necessary for recording the order of appearance.
-// BST and AVL are used to enhance search performance.
-// When using BST and AVL, each node hybridizes doubly linked-list structure and binary tree structure.
-// This is to maintain the order of appearance and to enhance search performance.
-
-struct List {
-    Node* head;
-    Node* tail;
-    List* (*addch)(struct List* lst, char ch);
-
-    #if SEARCH == HASH
-        Node* hash[256];
-    #endif
-
-    #if SEARCH == AVL
-        Node* root; // root node of the AVL tree
-    #endif
-
-    #if EFFCHECK == YES
-        int n; // number of nodes created
-        int depth; // maximum traversal depth
-        int mindepth; // minimum traversal depth
-        int searches; // number of searches, for average traversal depth calculation
-        int totaldepth; // total traversal depth, for average traversal depth calculation
-    #endif
-};
-
-#if SEARCH == LINEARSEARCH
-// add up character count in a linked-list using linear search
-List* addch(List* lst, char ch) {
-    #if EFFCHECK == YES
-        int trav = 0;
-        lst->searches++;
-    #endif
-
-    if (lst->head == NULL) {
-        lst->head = (Node*)malloc(sizeof(Node));
-        lst->head->ch = ch;
-        lst->head->count = 1;
-        lst->head->next = NULL;
-        lst->tail = lst->head;
-
-        #if EFFCHECK == YES
-            lst->n++; // new node created
-            trav++;
-        #endif
-    } else {
-        Node* cur = lst->head;
-        while (cur != NULL) {
-            #if EFFCHECK == YES
-                trav++;
-            #endif
-
-            if (cur->ch == ch) {
-                cur->count++;
-
-                #if EFFCHECK == YES // update depth before returning
-                    lst->totaldepth += trav;
-                    if (trav > lst->depth) {
-                        lst->depth = trav;
-                    }
-                    if (trav < lst->mindepth) {
-                        lst->mindepth = trav;
-                    }
-                #endif
-
-                return lst;
-            }
-            cur = cur->next;
+    for (; i < li->size; i++) {
+        if (text[i] == '\n' && addLineStart(li, i + 1) < 0) {
+            return -1;
         }
-        lst->tail->next = (Node*)malloc(sizeof(Node));
-        lst->tail->next->ch = ch;
-        lst->tail->next->count = 1;
-        lst->tail->next->next = NULL;
-        lst->tail = lst->tail->next;
-
-        #if EFFCHECK == YES
-            lst->n++; // new node created
-        #endif
     }
-
-    #if EFFCHECK == YES // update depth before returning
-        lst->totaldepth += trav;
-        if (trav > lst->depth) {
-            lst->depth = trav;
-        }
-        if (trav < lst->mindepth) {
-            lst->mindepth = trav;
-        }
-    #endif
-
-    return lst;
+    return 0;
 }
-#elif SEARCH == HASH
-// add up character count in a linked-list using hash table
-List* addch(List* lst, char ch) {
-    #if EFFCHECK == YES
-        lst->searches++;
-        int trav = 0;
-    #endif
 
-    if (lst->hash[ch] == NULL) {
-        lst->hash[ch] = (Node*)malloc(sizeof(Node));
-        lst->hash[ch]->ch = ch;
-        lst->hash[ch]->count = 1;
-        lst->hash[ch]->next = NULL;
-
-        #if EFFCHECK == YES
-            lst->n++;
-            trav++;
-        #endif
-
-        if (lst->head == NULL) {
-            lst->head = lst->hash[ch];
-            lst->tail = lst->hash[ch];
+// Turn an offset into a line and a column, both counted from 1 (the column in bytes).
+// Returns 0, or -1 if the index could not be built.
+int lineColumn(LineIndex* li, size_t loc, size_t* line, size_t* column) {
+    if (li->starts == NULL && buildLineIndex(li) < 0) {
+        freeLineIndex(li);
+        return -1;
+    }
+    size_t lo = 0, hi = li->n; // the last start <= loc is in [lo, hi)
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (li->starts[mid] <= loc) {
+            lo = mid;
         } else {
-            lst->tail->next = lst->hash[ch];
-            lst->tail = lst->hash[ch];
+            hi = mid;
         }
-    } else {
-        lst->hash[ch]->count++;
+    }
+    *line = lo + 1;
+    *column = loc - li->starts[lo] + 1;
+    return 0;
+}
 
-        #if EFFCHECK == YES
-            trav++;
-        #endif
+// print "filename:line:column: ", or "filename: offset N: " if there is no index
+void printPosition(LineIndex* li, const char* filename, size_t loc, FILE* out) {
+    size_t line, column;
+    if (lineColumn(li, loc, &line, &column) == 0) {
+        fprintf(out, "%s:%zu:%zu: ", filename, line, column);
+    } else {
+        fprintf(out, "%s: offset %zu: ", filename, loc);
     }
+}
 
-    #if EFFCHECK == YES
-        if (lst->searches > 0) {
-            lst->totaldepth += trav;
-            if (trav > lst->depth) {
-                lst->depth = trav;
-            }
-        }
-        if (lst->mindepth > trav) {
-            lst->mindepth = trav;
-        }
-    #endif
+// An output buffer which is flushed with a single write() (or fwrite() for
+// streams without a file descriptor, like the memory streams of the batch mode).
+// Dumping tokens is much faster this way than with a printf() per token.
+typedef struct Writer {
+    FILE* out;
+    int fd;                  // fileno(out), -1 if none
+    size_t len;              // number of bytes in buf
+    char buf[WRITEBUFSIZE];
+} Writer;
 
-    return lst;
+void initWriter(Writer* w, FILE* out) {
+    fflush(out); // what printf() already buffered goes out first
+    w->out = out;
+    w->fd = fileno(out);
+    w->len = 0;
 }
-#elif SEARCH == BST
-// add up character count in a linked-list using BST
-List* addch(List* lst, char ch) {
-    #if EFFCHECK == YES
-        lst->searches++;
-        int trav = 0;
-    #endif
 
-    if (lst->head == NULL) {
-        lst->head = (Node*)malloc(sizeof(Node));
-        lst->head->ch = ch;
-        lst->head->count = 1;
-        lst->head->left = NULL;
-        lst->head->right = NULL;
-        lst->head->next = NULL;
-        lst->head->prev = NULL;
-        lst->tail = lst->head;
-
-        #if EFFCHECK == YES
-            lst->n++;
-            trav++;
-        #endif
+void flushWriter(Writer* w) {
+    if (w->fd < 0) {
+        fwrite(w->buf, 1, w->len, w->out);
     } else {
-        Node* cur = lst->head; // head is the root node
-        Node* parent = NULL;
-        while (cur != NULL) {
-            #if EFFCHECK == YES
-                trav++;
-            #endif
-
-            if (cur->ch == ch) {
-                cur->count++;
-
-                #if EFFCHECK == YES // update depth before returning
-                    lst->totaldepth += trav;
-                    if (trav > lst->depth) {
-                        lst->depth = trav;
-                    }
-                    if (trav < lst->mindepth) {
-                        lst->mindepth = trav;
-                    }
-                #endif
-
-                return lst;
-            } else if (ch < cur->ch) {
-                parent = cur;
-                cur = cur->left;
-            } else {
-                parent = cur;
-                cur = cur->right;
+        size_t done = 0;
+        while (done < w->len) {
+            ssize_t n = write(w->fd, w->buf + done, w->len - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
             }
+            if (n <= 0) {
+                break; // the output is lost, as with a failed printf()
+            }
+            done += n;
         }
-        Node* newnode = (Node*)malloc(sizeof(Node));
-        newnode->ch = ch;
-        newnode->count = 1;
-        newnode->left = NULL;
-        newnode->right = NULL;
-        newnode->next = NULL;
-        newnode->prev = lst->tail;
-        if (ch < parent->ch) {
-            parent->left = newnode;
-        } else {
-            parent->right = newnode;
-        }
-        lst->tail->next = newnode;
-        lst->tail = newnode;
+    }
+    w->len = 0;
+}
 
-        #if EFFCHECK == YES
-            lst->n++;
-        #endif
+// append "value: TYPE_TOKEN\n"
+void writeToken(Writer* w, const char* value, size_t len, TokenType type) {
+    Name name = type >= TYPE && type <= RIGHTBRACE ? tokenNames[type] : (Name)NAME("UNKNOWN_TOKEN");
+    if (len > MAXTOKEN) {
+        len = MAXTOKEN;
+    }
+    if (w->len + len + name.len + 3 > WRITEBUFSIZE) {
+        flushWriter(w);
     }
+    char* p = w->buf + w->len;
+    memcpy(p, value, len);
+    p += len;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, name.str, name.len);
+    p += name.len;
+    *p++ = '\n';
+    w->len = p - w->buf;
+}
 
-    #if EFFCHECK == YES // update depth before returning
-        lst->totaldepth += trav;
-        if (trav > lst->depth) {
-            lst->depth = trav;
-        }
-        if (trav < lst->mindepth) {
-            lst->mindepth = trav;
-        }
-    #endif
+// append "line:column: "
+void writePosition(Writer* w, size_t line, size_t column) {
+    char tmp[48];
+    int n = 0;
+    tmp[n++] = ' ';
+    tmp[n++] = ':';
+    do {
+        tmp[n++] = '0' + column % 10;
+        column /= 10;
+    } while (column > 0);
+    tmp[n++] = ':';
+    do {
+        tmp[n++] = '0' + line % 10;
+        line /= 10;
+    } while (line > 0);
+    if (w->len + n > WRITEBUFSIZE) {
+        flushWriter(w);
+    }
+    while (n > 0) { // the digits were put in reverse order
+        w->buf[w->len++] = tmp[--n];
+    }
+}
 
-    return lst;
+// With lines, each token is prefixed with its position.
+void printTokenList(const TokenList* list, LineIndex* lines, FILE* out) {
+    Writer w;
+    initWriter(&w, out);
+    for (Token* current = list->head; current != NULL; current = current->next) {
+        size_t line, column;
+        if (lines != NULL && lineColumn(lines, current->loc, &line, &column) == 0) {
+            writePosition(&w, line, column);
+        }
+        writeToken(&w, current->value, strlen(current->value), current->type);
+    }
+    flushWriter(&w);
 }
-#elif SEARCH == AVL
-// add up character count in a linked-list using AVL tree
-List* addch(List* lst, char ch) {
-    #if EFFCHECK == YES
-        lst->searches++;
-        int trav = 0;
-    #endif
 
-    if (lst->head == NULL) {
-        lst->head = (Node*)malloc(sizeof(Node));
-        lst->head->ch = ch;
-        lst->head->count = 1;
-        lst->head->left = NULL;  // for tree
-        lst->head->right = NULL; // for tree
-        lst->head->next = NULL;  // for linked-list
-        lst->head->prev = NULL;  // for linked-list
-        lst->head->BF = 0;       // for AVL tree
-        lst->head->parent = NULL; // for AVL tree
-        lst->root = lst->head;   // for AVL tree
-        lst->tail = lst->head;   // only one node, head is also tail
-
-        #if EFFCHECK == YES
-            lst->n++;
-            trav++;
-        #endif
-    } else {
-        Node* cur = lst->root; // start from the root node
-        Node* parent = NULL; // this stores the parent node of the new node in the AVL tree
-        while (cur != NULL) {
-            #if EFFCHECK == YES
-                trav++;
-            #endif
-
-            // if the character is found, increment the count and return
-            // otherwise, insert a new node later
-            if (cur->ch == ch) {
-                cur->count++;
-
-                #if EFFCHECK == YES // update depth before returning
-                    lst->totaldepth += trav;
-                    if (trav > lst->depth) {
-                        lst->depth = trav;
-                    }
-                    if (trav < lst->mindepth) {
-                        lst->mindepth = trav;
-                    }
-                #endif
+int in_s(const Lexer* lx) {
+    unsigned char c = lx->c;
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == EOFF || \
+           c == '{' || c == '}' || c == '(' || c == ')' || c == ';';
+}
 
-                return lst;
-            } else if (ch < cur->ch) {
-                parent = cur;
-                cur = cur->left;
-            } else {
-                parent = cur;
-                cur = cur->right;
-            }
-        } // while-loop breaks when the character is not found in the AVL tree
-        // and then we need to insert a new node,
-        // which is a bit more complicated than BST
-
-        Node* newnode = (Node*)malloc(sizeof(Node));
-        newnode->parent = parent; // parent node of the new node
-        newnode->ch = ch; // key value
-        newnode->count = 1; // new character, must be 1
-        newnode->left = NULL; // default value, should be updated later
-        newnode->right = NULL; // default value, should be updated later
-        newnode->next = NULL; // must be NULL as it is the last node in the linked-list (newly added)
-        newnode->prev = lst->tail; // must be tailed to the linked-list
-        newnode->BF = 0; // default value, should be updated later
-        lst->tail = newnode; // update the tail of the linked-list
-
-        #if EFFCHECK == YES
-            lst->n++; // new node created
-
-            // below can only be rotation-related operations
-            // so we can update the statstics here
-            lst->totaldepth += trav;
-            if (trav > lst->depth) {
-                lst->depth = trav;
-            }
-            if (trav < lst->mindepth) {
-                lst->mindepth = trav;
-            }
-        #endif
+int in_n(const Lexer* lx) {
+    unsigned char c = lx->c;
+    return c >= '0' && c <= '9';
+}
 
-        // linked-list is updated in above code
-        //
-        // below is to update the AVL tree structure, we need to:
-        // (1) find the correct position to insert the new node
-        // Note: We don't have to redo the search because we already know
-        //       the parent node where the new node to be inserted.
-        // (2) and then update the balance factor (BF) of the nodes in the path
-        // Note: BF is defined as left subtree height - right subtree height
-        // Note: parent->BF will definitely change, but its further ancestors may not
-        // (3) and then rebalance the tree if necessary
-        //
-        // Remark: These to-do's are not separate steps,
-        //         but they may be implemented together.
-
-        if (ch < parent->ch) {
-            parent->left = newnode;
-            parent->BF++;
-        } else {
-            parent->right = newnode;
-            parent->BF--;
-        }
-        
-    }
+int in_r(const Lexer* lx) {
+    unsigned char c = lx->c;
+    return c == '+' || c == '-' || c == '>' || c == '<' || c == '=';
 }
-#endif
 
-// List constructor
-List* new_list() {
-    List* lst = (List*)malloc(sizeof(List));
-    lst->head = NULL;
-    lst->tail = NULL;
-    lst->addch = addch;
+int in_a(const Lexer* lx) {
+    unsigned char c = lx->c;
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
 
-    #if SEARCH == HASH
-        for (int i = 0; i < 256; i++) {
-            lst->hash[i] = NULL;
-        }
-    #endif
+int in_a1(const Lexer* lx) {
+    unsigned char c = lx->c;
+    return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') && \
+            (c != 'e' && c!= 'i' && c != 'm' && c != 'w');
+}
 
-    #if EFFCHECK == YES
-        lst->n = 0;
-        lst->depth = 0;
-        lst->mindepth = INT_MAX;
-        lst->searches = 0;
-        lst->totaldepth = 0;
-    #endif
-    
-    return lst;
+int in_s1(const Lexer* lx) {
+    unsigned char c = lx->c;
+    return c == '{' || c == '}' || c == '(' || c == ')' || c == ';';
 }
 
-// List destructor
-void free_list(List* lst) {
-    Node* cur = lst->head;
-    while (cur != NULL) {
-        Node* tmp = cur;
-        cur = cur->next;
-        free(tmp);
-    }
+// in_a2() can not be implemented directly
+//         because it falls into the "else" branch in the if statement.
 
-    #if SEARCH == HASH // erase hash content
-        for (int i = 0; i < 256; i++) {
-            lst->hash[i] = NULL;
+void mygetc(Lexer* lx) { // no EOF check here, it is left for the switch statement
+    unsigned char c = lx->ptr[lx->loc++];
+    lx->c = c;
+    lx->buffer[lx->len++] = c;
+    if (lx->useStats) {
+        lx->stats.bytecount[c]++;
+        if (!lx->stats.seen[c]) {
+            lx->stats.seen[c] = 1;
+            lx->stats.order[lx->stats.nseen++] = c;
         }
-    #endif
+    }
+}
 
-    free(lst);
+void myungetc(Lexer* lx) {
+    lx->loc--;
+    lx->len--;
+    lx->buffer[lx->len] = '\0'; // reset the buffer to empty
+    if (lx->useStats) {
+        lx->stats.bytecount[lx->ptr[lx->loc]]--; // it will be counted again when it is read again
+    }
 }
 
+void resetBuffer(Lexer* lx) { // note: buffer is to store the token, not file content
+    lx->len = 0;
+    lx->buffer[lx->len] = '\0'; // reset the buffer to empty
+}
 
 /*===========================*/
-// main()                    //
+// Scanner                   //
 /*===========================*/
 
-int main(int argc, char* argv[]) {
-    char filename[MAXFILENAME];
-    size_t fileSize = 0;
-    if (argc == 1) {
-        strcpy(filename, "sample.c"); // '\0' is added automatically via strcpy()
-    } else if (argc >= 2) {
-        strcpy(filename, argv[1]);
-    }
-    
-    // estimate the file size
-    FILE* fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        printf("Error: file %s not found\n", filename);
-        return 1;
+// push the tokens left in the batch of the sink, if any
+void flushSink(Lexer* lx) {
+    if (lx->sink != NULL && lx->sink->n > 0) {
+        lx->sink->push(lx->sink->ctx, lx->sink->batch, lx->sink->n);
+        lx->sink->n = 0;
     }
-    fseek(fp, 0, SEEK_END);
-    fileSize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+}
 
-    // Allocate a memory cache which the entire file content is to read into.
-    unsigned char* content = (unsigned char*)malloc(fileSize + 1);
-    if (content == NULL) {
-        printf("Error: memory allocation failed\n");
-        fclose(fp);
-        return 1;
+// Record a lexical error found in the given state, it is printed by printError().
+// Returns 1 to stop the scanner. In recovery mode (lx->recover), the error is
+// added to lx->diags instead, the rest of the bad token is skipped up to the
+// next delimiter (panic mode), and 0 is returned: the scanner goes on in state 0.
+int lexError(Lexer* lx, int state) {
+    if (lx->recover && lx->ndiags == lx->diagCap) {
+        int cap = lx->diagCap == 0 ? 16 : lx->diagCap * 2;
+        Diagnostic* tmp = (Diagnostic*)realloc(lx->diags, sizeof(Diagnostic) * cap);
+        if (tmp != NULL) {
+            lx->diags = tmp;
+            lx->diagCap = cap;
+        }
     }
-    size_t bytesRead = fread(content, 1, fileSize, fp);
-    if (bytesRead != fileSize) {
-        printf("Error: read %zu bytes, but expected %lu bytes\n", bytesRead, fileSize);
-        free(content);
-        fclose(fp);
+    if (!lx->recover || lx->ndiags == lx->diagCap) { // no room left: stop as without recovery
+        flushSink(lx); // the tokens before the error are delivered, as they are kept in tklist
+        lx->errState = state;
+        lx->errChar = lx->c;
+        lx->errLoc = lx->base + lx->loc - 1;
         return 1;
     }
-    content[fileSize] = EOFF; // add a redefined EOF terminator to the end of the content
+    Diagnostic* d = &lx->diags[lx->ndiags++];
+    d->loc = lx->loc - 1;
+    d->state = state;
+    d->c = lx->c;
+    if (lx->c == EOFF) {
+        lx->loc--; // read again in state 0, where the scan ends
+        return 0;
+    }
+    while (1) {
+        resetBuffer(lx);
+        mygetc(lx);
+        if (in_s(lx) || in_r(lx)) { // the delimiter starts the next token
+            myungetc(lx);
+            return 0;
+        }
+    }
+}
 
-    fclose(fp);
+void printErrorMessage(int state, unsigned char c, FILE* out) {
+    if (state == ERROR_STATE) {
+        fprintf(out, "Error due to invalid token detected.\n");
+        fprintf(out, "Alphabet character should not be followed by a digit\n");
+        fprintf(out, "when the token is to be determined as an integer.\n");
+    } else {
+        fprintf(out, "Error in state %d: found unexpected character with decimal = %u, represented as %c\n", state, c, c);
+    }
+}
+
+void printError(const Lexer* lx, FILE* out) {
+    printErrorMessage(lx->errState, lx->errChar, out);
+}
 
-    // assign the content to the pointer for later use in functions
-    ptr = content;
-    loc = 0; // reset the location to the beginning of the file content
+// print all the lexical errors collected in recovery mode, with their positions
+void printDiagnostics(const Lexer* lx, LineIndex* lines, const char* filename, FILE* out) {
+    for (int i = 0; i < lx->ndiags; i++) {
+        printPosition(lines, filename, lx->diags[i].loc, out);
+        printErrorMessage(lx->diags[i].state, lx->diags[i].c, out);
+    }
+    fprintf(out, "%d lexical error%s\n", lx->ndiags, lx->ndiags == 1 ? "" : "s");
+}
 
+// In the scanner: stop on a lexical error, or go on in state 0 if lexError() recovered from it
+#define LEXERROR(st) { if (lexError(lx, st)) return 1; state = 0; continue; }
+
+// Scan the content cached in lx->ptr, terminated by EOFF, into lx->tklist (or lx->sink).
+// Returns 0 on success, 1 on a lexical error (see printError()).
+// In recovery mode, returns 0 and the lexical errors are in lx->diags.
+int scanner(Lexer* lx) {
+    lx->loc = 0; // reset the location to the beginning of the file content
     int state = 0;
+    #if DFASTATS == YES
+        int prev = -1; // no transition into the first state
+    #endif
     while (1) {
+        #if DFASTATS == YES
+            lx->prof.visits[state]++;
+            if (prev >= 0) {
+                lx->prof.transitions[prev][state]++;
+            }
+            prev = state;
+        #endif
         switch (state) {
             case 0:
-                resetBuffer(); // reset the buffer to empty
-                mygetc();      // read the next character
-                     if (c == '+') state = 1;
-                else if (c == '-') state = 2;
-                else if (c == '=') state = 3;
-                else if (c == '<') state = 6;
-                else if (c == '>') state = 9;
-                else if (in_n()) state = 12;
-                else if (in_s1()) state = 14;
-                else if (in_a1()) state = 37;
-                else if (c == EOFF) state = 39;
-                else if (c == 'e') state = 15;
-                else if (c == 'i') state = 18;
-                else if (c == 'm') state = 20;
-                else if (c == 'w') state = 23;
-                else if (c == ' ') state = 0;
-                else if (c == '\n') state = 0;
-                else if (c == '\t') state = 0;
-                else if (c == '\r') state = 0;
+                if (lx->stop) {
+                    flushSink(lx);
+                    return 0;
+                }
+                resetBuffer(lx); // reset the buffer to empty
+                mygetc(lx);      // read the next character
+                     if (lx->c == '+') state = 1;
+                else if (lx->c == '-') state = 2;
+                else if (lx->c == '=') state = 3;
+                else if (lx->c == '<') state = 6;
+                else if (lx->c == '>') state = 9;
+                else if (in_n(lx)) state = 12;
+                else if (in_s1(lx)) state = 14;
+                else if (in_a1(lx)) state = 37;
+                else if (lx->c == EOFF) state = 39;
+                else if (lx->c == 'e') state = 15;
+                else if (lx->c == 'i') state = 18;
+                else if (lx->c == 'm') state = 20;
+                else if (lx->c == 'w') state = 23;
+                else if (lx->c == ' ') state = 0;
+                else if (lx->c == '\n') state = 0;
+                else if (lx->c == '\t') state = 0;
+                else if (lx->c == '\r') state = 0;
                 else {
-                    printf("Error in state 0: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(0)
                 }
                 break;
             case 1:
                 // printf("+: PLUS_TOKEN\n");
-                appendToken("+", PLUS);
+                appendToken(lx, "+", PLUS);
                 state = 0;
                 break;
             case 2:
                 // printf("-: MINUS_TOKEN\n");
-                appendToken("-", MINUS);
+                appendToken(lx, "-", MINUS);
                 state = 0;
                 break;
             case 3:
-                mygetc();
-                if (c == '=') state = 4;
+                mygetc(lx);
+                if (lx->c == '=') state = 4;
                 else state = 5;
                 break;
             case 4:
                 // printf("==: EQUAL_TOKEN\n");
-                appendToken("==", EQUAL);
+                appendToken(lx, "==", EQUAL);
                 state = 0;
                 break;
             case 5:
-                myungetc();
+                myungetc(lx);
                 // printf("=: ASSIGN_TOKEN\n");
-                appendToken("=", ASSIGN);
+                appendToken(lx, "=", ASSIGN);
                 state = 0;
                 break;
             case 6:
-                mygetc();
-                if (c == '=') state = 7;
+                mygetc(lx);
+                if (lx->c == '=') state = 7;
                 else state = 8;
                 break;
             case 7:
                 // printf("<=: LESSEQUAL_TOKEN\n");
-                appendToken("<=", LESSEQUAL);
+                appendToken(lx, "<=", LESSEQUAL);
                 state = 0;
                 break;
             case 8:
-                myungetc();
+                myungetc(lx);
                 // printf("<: LESS_TOKEN\n");
-                appendToken("<", LESS);
+                appendToken(lx, "<", LESS);
                 state = 0;
                 break;
             case 9:
-                mygetc();
-                if (c == '=') state = 10;
+                mygetc(lx);
+                if (lx->c == '=') state = 10;
                 else state = 11;
                 break;
             case 10:
                 // printf(">=: GREATEREQUAL_TOKEN\n");
-                appendToken(">=", GREATEREQUAL);
+                appendToken(lx, ">=", GREATEREQUAL);
                 state = 0;
                 break;
             case 11:
-                myungetc();
+                myungetc(lx);
                 // printf(">: GREATER_TOKEN\n");
-                appendToken(">", GREATER);
+                appendToken(lx, ">", GREATER);
                 state = 0;
                 break;
             case 12:
-                mygetc();
-                if (in_n()) state = 12;
-                else if (in_s() || in_r()) state = 13;
-                else if (in_a()) state = ERROR_STATE;
+                mygetc(lx);
+                if (in_n(lx)) state = 12;
+                else if (in_s(lx) || in_r(lx)) state = 13;
+                else if (in_a(lx)) state = ERROR_STATE;
                 else {
-                    printf("Error in state 12: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(12)
                 }
                 break;
             case 13:
-                myungetc();
-                buffer[len] = '\0'; // add a null terminator to the buffer
+                myungetc(lx);
+                lx->buffer[lx->len] = '\0'; // add a null terminator to the buffer
                 // printf("%s: LITERAL_TOKEN\n", buffer);
-                appendToken(buffer, LITERAL);
+                appendToken(lx, (char*)lx->buffer, LITERAL);
                 state = 0;
                 break;
             case 14:
-                buffer[len] = '\0';
-                switch (c) {
+                lx->buffer[lx->len] = '\0';
+                switch (lx->c) {
                     // case '(': printf("(: LEFTPAREN_TOKEN\n"); break;
                     // case ')': printf("): RIGHTPAREN_TOKEN\n"); break;
                     // case '{': printf("{: LEFTBRACE_TOKEN\n"); break;
                     // case '}': printf("}: RIGHTBRACE_TOKEN\n"); break;
                     // case ';': printf(";: SEMICOLON_TOKEN\n"); break;
-                    case '(': appendToken("(", LEFTPAREN); break;
-                    case ')': appendToken(")", RIGHTPAREN); break;
-                    case '{': appendToken("{", LEFTBRACE); break;
-                    case '}': appendToken("}", RIGHTBRACE); break;
-                    case ';': appendToken(";", SEMICOLON); break;
+                    case '(': appendToken(lx, "(", LEFTPAREN); break;
+                    case ')': appendToken(lx, ")", RIGHTPAREN); break;
+                    case '{': appendToken(lx, "{", LEFTBRACE); break;
+                    case '}': appendToken(lx, "}", RIGHTBRACE); break;
+                    case ';': appendToken(lx, ";", SEMICOLON); break;
                     default:
-                        printf("Error in state 14: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                        free(content); // free the memory cache
-                        freeTokenList();
-                        return 1;
+                        LEXERROR(14)
                 }
                 state = 0;
                 break;
             case 15:
-                mygetc();
-                if (c == 'l') state = 16;
-                else if (in_n() || in_a()) state = 37; // because c == 'l' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'l') state = 16;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'l' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 15: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(15)
                 }
                 break;
             case 16:
-                mygetc();
-                if (c == 's') state = 17;
-                else if (in_n() || in_a()) state = 37; // because c == 's' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 's') state = 17;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 's' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 16: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(16)
                 }
                 break;
             case 17:
-                mygetc();
-                if (c == 'e') state = 27;
-                else if (in_n() || in_a()) state = 37; // because c == 'e' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'e') state = 27;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'e' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 17: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(17)
                 }
                 break;
             case 18:
-                mygetc();
-                if (c == 'f') state = 28;
-                else if (c == 'n') state = 19;
-                else if (in_n() || in_a()) state = 37; // because c == 'f' and 'n' are used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'f') state = 28;
+                else if (lx->c == 'n') state = 19;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'f' and 'n' are used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 18: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(18)
                 }
                 break;
             case 19:
-                mygetc();
-                if (c == 't') state = 29;
-                else if (in_n() || in_a()) state = 37; // because c == 't' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 't') state = 29;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 't' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 19: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(19)
                 }
                 break;
             case 20:
-                mygetc();
-                if (c == 'a') state = 21;
-                else if (in_n() || in_a()) state = 37; // because c == 'a' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'a') state = 21;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'a' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 20: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(20)
                 }
                 break;
             case 21:
-                mygetc();
-                if (c == 'i') state = 22;
-                else if (in_n() || in_a()) state = 37; // because c == 'i' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'i') state = 22;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'i' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 21: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(21)
                 }
                 break;
             case 22:
-                mygetc();
-                if (c == 'n') state = 30;
-                else if (in_n() || in_a()) state = 37; // because c == 'n' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'n') state = 30;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'n' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 22: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(22)
                 }
                 break;
             case 23:
-                mygetc();
-                if (c == 'h') state = 24;
-                else if (in_n() || in_a()) state = 37; // because c == 'h' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'h') state = 24;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'h' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 23: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(23)
                 }
                 break;
             case 24:
-                mygetc();
-                if (c == 'i') state = 25;
-                else if (in_n() || in_a()) state = 37; // because c == 'i' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'i') state = 25;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'i' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 24: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(24)
                 }
                 break;
             case 25:
-                mygetc();
-                if (c == 'l') state = 26;
-                else if (in_n() || in_a()) state = 37; // because c == 'l' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'l') state = 26;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'l' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 25: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(25)
                 }
                 break;
             case 26:
-                mygetc();
-                if (c == 'e') state = 31;
-                else if (in_n() || in_a()) state = 37; // because c == 'e' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'e') state = 31;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'e' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 26: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(26)
                 }
                 break;
             case 27:
-                mygetc();
-                if (in_s() || in_r()) state = 32;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 32;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 27: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(27)
                 }
                 break;
             case 28:
-                mygetc();
-                if (in_s() || in_r()) state = 33;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 33;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 28: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(28)
                 }
                 break;
             case 29:
-                mygetc();
-                if (in_s() || in_r()) state = 34;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 34;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 29: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(29)
                 }
                 break;
             case 30:
-                mygetc();
-                if (in_s() || in_r()) state = 35;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 35;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 30: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(30)
                 }
                 break;
             case 31:
-                mygetc();
-                if (in_s() || in_r()) state = 36;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 36;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 31: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(31)
                 }
                 break;
             case 32:
-                myungetc();
+                myungetc(lx);
                 // printf("else: ELSE_TOKEN\n");
-                appendToken("else", ELSE);
+                appendToken(lx, "else", ELSE);
                 state = 0;
                 break;
             case 33:
-                myungetc();
+                myungetc(lx);
                 // printf("if: IF_TOKEN\n");
-                appendToken("if", IF);
+                appendToken(lx, "if", IF);
                 state = 0;
                 break;
             case 34:
-                myungetc();
+                myungetc(lx);
                 // printf("int: TYPE_TOKEN\n");
-                appendToken("int", TYPE);
+                appendToken(lx, "int", TYPE);
                 state = 0;
                 break;
             case 35:
-                myungetc();
+                myungetc(lx);
                 // printf("main: MAIN_TOKEN\n");
-                appendToken("main", MAIN);
+                appendToken(lx, "main", MAIN);
                 state = 0;
                 break;
             case 36:
-                myungetc();
+                myungetc(lx);
                 // printf("while: WHILE_TOKEN\n");
-                appendToken("while", WHILE);
+                appendToken(lx, "while", WHILE);
                 state = 0;
                 break;
             case 37:
-                mygetc();
-                if (in_n() || in_a()) state = 37;
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (in_n(lx) || in_a(lx)) state = 37;
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 37: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    freeTokenList();
-                    return 1;
+                    LEXERROR(37)
                 }
                 break;
             case 38:
-                myungetc();
-                buffer[len] = '\0'; // add a null terminator to the buffer
+                myungetc(lx);
+                lx->buffer[lx->len] = '\0'; // add a null terminator to the buffer
                 // printf("%s: ID_TOKEN\n", buffer);
-                appendToken(buffer, ID);
+                appendToken(lx, (char*)lx->buffer, ID);
                 state = 0;
                 break;
             case 39: // End of process
-                printTokenList(); // print the token list
-                free(content);
-                freeTokenList();
+                flushSink(lx);
                 return 0;
             default:
-                printf("Error due to invalid token detected.\n");
-                printf("Alphabet character should not be followed by a digit\n");
-                printf("when the token is to be determined as an integer.\n");
-                free(content);
-                freeTokenList();
-                return 1;
+                LEXERROR(state)
         }
     }
 
-    // free(content); // free the memory cache
-    // freeTokenList(); // free the token list
+}
+
+/*===========================*/
+// Parallel scanner          //
+/*===========================*/
 
-    return 0;
+// Tokens never span whitespace, so the content can be cut at whitespace bytes
+// and the pieces scanned independently. The whitespace byte at the end of each
+// chunk is temporarily replaced by EOFF, which the scanner treats exactly
+// like whitespace, so every chunk is scanned as if it were a whole file.
+typedef struct Chunk {
+    Lexer lx;             // lx.ptr is the first byte of the chunk
+    size_t size;          // number of bytes, lx.ptr[size] is EOFF while scanning
+    unsigned char saved;  // the whitespace byte replaced by EOFF
+    int result;           // return value of scanner()
+    int early;            // 1 if an EOFF byte of the file itself ended the scan
+} Chunk;
 
-    #if EFFCHECK == YES
-        int totalprintablechars = 0;
-    #endif
+int in_ws(unsigned char ch) {
+    return ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r';
+}
 
-    // read from file
-    FILE* file = fopen("main.c", "r");
-    if (file == NULL) {
-        printf("File not found.\n");
-        return 1;
+void* scanChunk(void* arg) {
+    Chunk* chunk = (Chunk*)arg;
+    chunk->result = scanner(&chunk->lx);
+    chunk->early = chunk->result == 0 && chunk->lx.loc - 1 < chunk->size;
+    return NULL;
+}
+
+// add the statistics of a chunk, keeping the order of first appearance
+void mergeStats(Stats* to, const Stats* from) {
+    for (int t = TYPE; t <= RIGHTBRACE; t++) {
+        to->typecount[t] += from->typecount[t];
     }
-    List* lst = new_list();
-    char ch;
-    while ((ch = fgetc(file)) != EOF) {
-        if (ch >= 32 && ch <= 126) { // only printable ASCII characters are counted
-            #if EFFCHECK == YES
-                totalprintablechars++;
-            #endif
-            lst = lst->addch(lst, ch);
-        }
-    }
-    fclose(file);
-
-    // print character count in the order of appearance (Linked-List)
-    // Note: range is 32-126 (printable ASCII characters)
-    // Reference: https://www.ascii-code.com/characters/printable-characters
-    Node* cur = lst->head;
-    while (cur != NULL) {
-        if (cur->ch >= 32 && cur->ch <= 126) {
-            printf("%c : %d\n", cur->ch, cur->count);
-        }
-        cur = cur->next;
-    }
-
-    #if EFFCHECK == YES
-        printf("Statistics:\n");
-        printf("  Number of nodes created: %d\n", lst->n);
-        printf("  Number of searches: %d\n", lst->searches);
-        printf("  Total printable characters: %d\n", totalprintablechars);
-        printf("  Aggregated Traversal Depth: %d\n", lst->totaldepth);
-        printf("  Minimum traversal depth: %d\n", lst->mindepth);
-        printf("  Average traversal depth: %.2f\n", (float)lst->totaldepth / lst->searches);
-        printf("  Maximum traversal depth: %d\n", lst->depth);
-        #if SEARCH == AVL
-            // AVL tree height estimation
-            // https://stackoverflow.com/questions/30769383
-            printf("Minimum possible height of the AVL tree: %d\n", (int)log2approx(lst->n + 1));
-            printf("Maximum possible height of the AVL tree: %d\n", (int)(1.44*log2approx(lst->n + 2)-0.328));
-        #endif
-    #endif
+    for (int i = 0; i < 256; i++) {
+        to->bytecount[i] += from->bytecount[i];
+    }
+    for (int i = 0; i < from->nseen; i++) {
+        unsigned char ch = from->order[i];
+        if (!to->seen[ch]) {
+            to->seen[ch] = 1;
+            to->order[to->nseen++] = ch;
+        }
+    }
+}
 
-    free_list(lst);
-    return 0;
-}
\ No newline at end of file
+#if DFASTATS == YES
+    // add the counters of a chunk
+    void mergeProfile(Profile* to, const Profile* from) {
+        for (int i = 0; i <= ERROR_STATE; i++) {
+            to->visits[i] += from->visits[i];
+            for (int j = 0; j <= ERROR_STATE; j++) {
+                to->transitions[i][j] += from->transitions[i][j];
+            }
+        }
+        for (int t = TYPE; t <= RIGHTBRACE; t++) {
+            to->tokens[t] += from->tokens[t];
+            to->tokenBytes[t] += from->tokenBytes[t];
+        }
+        for (int i = 0; i <= BUFFERSIZE; i++) {
+            to->lengths[i] += from->lengths[i];
+        }
+    }
+#endif
+
+// Scan content[0..fileSize) with up to nthreads threads into lx->tklist (and lx->stats).
+// The result, including which error is reported, is the same as scanner(lx).
+// A sink gets its tokens in order from one thread, so lx->sink is scanned sequentially,
+// and so is a scan in recovery mode, whose errors are collected in order.
+// Returns 0 on success, 1 on a lexical error (see printError()).
+int parallelScanner(Lexer* lx, size_t fileSize, int nthreads) {
+    if (lx->sink != NULL || lx->recover) {
+        return scanner(lx);
+    }
+    unsigned char* content = lx->ptr;
+    Chunk* chunks = (Chunk*)malloc(sizeof(Chunk) * MAXTHREADS);
+    pthread_t threads[MAXTHREADS];
+    int threaded[MAXTHREADS] = {0};
+    int n = 0;
+    if (chunks == NULL) {
+        return scanner(lx);
+    }
+
+    if ((size_t)nthreads > fileSize / MINCHUNK) {
+        nthreads = (int)(fileSize / MINCHUNK);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    // cut at the first whitespace at or after each i * fileSize / nthreads
+    size_t start = 0;
+    for (int i = 1; i <= nthreads; i++) {
+        size_t end = i == nthreads ? fileSize : fileSize / nthreads * i;
+        if (end < start) {
+            end = start;
+        }
+        while (end < fileSize && !in_ws(content[end])) {
+            end++;
+        }
+        initLexer(&chunks[n].lx, content + start, lx->useStats);
+        chunks[n].lx.base = start;
+        chunks[n].size = end - start;
+        chunks[n].saved = content[end];
+        n++;
+        if (end == fileSize) {
+            break;
+        }
+        start = end + 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        chunks[i].lx.ptr[chunks[i].size] = EOFF;
+    }
+    for (int i = 1; i < n; i++) { // the first chunk is scanned by this thread
+        threaded[i] = pthread_create(&threads[i], NULL, scanChunk, &chunks[i]) == 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (threaded[i]) {
+            pthread_join(threads[i], NULL);
+        } else { // also if the thread could not be created
+            scanChunk(&chunks[i]);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        chunks[i].lx.ptr[chunks[i].size] = chunks[i].saved;
+    }
+
+    // concatenate the chunks in order, as far as a sequential scan would go
+    int result = 0;
+    int last = 0;
+    for (; last < n; last++) {
+        Chunk* chunk = &chunks[last];
+        if (chunk->lx.tklist.head != NULL) {
+            if (lx->tklist.head == NULL) {
+                lx->tklist.head = chunk->lx.tklist.head;
+            } else {
+                lx->tklist.tail->next = chunk->lx.tklist.head;
+            }
+            lx->tklist.tail = chunk->lx.tklist.tail;
+            lx->tklist.size += chunk->lx.tklist.size;
+        }
+        if (chunk->result != 0) {
+            lx->errState = chunk->lx.errState;
+            lx->errChar = chunk->lx.errChar;
+            lx->errLoc = chunk->lx.errLoc;
+            result = 1;
+            break;
+        }
+        if (lx->useStats) {
+            mergeStats(&lx->stats, &chunk->lx.stats);
+        }
+        #if DFASTATS == YES
+            mergeProfile(&lx->prof, &chunk->lx.prof);
+        #endif
+        if (chunk->early) { // an EOFF byte in the file ends a sequential scan here
+            break;
+        }
+        if (lx->useStats && last < n - 1) { // the cut was read as EOFF instead of the whitespace
+            lx->stats.bytecount[EOFF]--;
+            lx->stats.bytecount[chunk->saved]++;
+            if (!lx->stats.seen[chunk->saved]) {
+                lx->stats.seen[chunk->saved] = 1;
+                lx->stats.order[lx->stats.nseen++] = chunk->saved;
+            }
+        }
+    }
+    for (int i = last + 1; i < n; i++) { // tokens that a sequential scan would not reach
+        freeTokenList(&chunks[i].lx.tklist);
+    }
+    free(chunks);
+    return result;
+}
+
+/*===========================*/
+// Incremental scanner       //
+/*===========================*/
+
+// An editor changes a few bytes at a time, so the tokens of a buffer are kept
+// and only the tokens around an edit are scanned again (see editTokenBuffer()).
+// A token never spans whitespace and the scanner is in state 0 at the start of
+// every token, so scanning can restart at the last token starting before the edit,
+// and stop as soon as a new token starts where an old token after the edit starts:
+// from there on the text is the same, and so are the tokens.
+
+#define NOERROR ((size_t)-1) // TokenBuffer.errPos without a lexical error
+
+// A token of a TokenBuffer
+typedef struct LexToken {
+    TokenType type;
+    int len;         // length of the token in the text
+    size_t loc;      // see TokenBuffer
+} LexToken;
+
+// The text and the tokens of an edited buffer.
+// The tokens are kept in a gap buffer which is moved to the edit.
+// Tokens before the gap store their offset from the start of the text,
+// tokens after the gap their offset from the end of the text, so the tokens
+// after an edit are shifted without being touched.
+typedef struct TokenBuffer {
+    unsigned char* text;   // text[size] is EOFF
+    size_t size;
+    size_t textCap;
+    LexToken* toks;        // tokens are in [0, gapStart) and [gapEnd, cap)
+    int gapStart;
+    int gapEnd;
+    int cap;
+    size_t errPos;         // the scan stops with an error at text[errPos], NOERROR if none
+    int errState;          // as in Lexer
+    unsigned char errChar;
+    int relexed;           // number of tokens scanned again by the last edit
+} TokenBuffer;
+
+int tbCount(const TokenBuffer* tb) {
+    return tb->gapStart + tb->cap - tb->gapEnd;
+}
+
+// the i-th token, with its offset from the start of the text
+LexToken tbToken(const TokenBuffer* tb, int i) {
+    if (i < tb->gapStart) {
+        return tb->toks[i];
+    }
+    LexToken tok = tb->toks[i + tb->gapEnd - tb->gapStart];
+    tok.loc = tb->size - tok.loc;
+    return tok;
+}
+
+// move the gap so that it starts before the i-th token
+void tbMoveGap(TokenBuffer* tb, int i) {
+    while (tb->gapStart > i) {
+        LexToken* tok = &tb->toks[--tb->gapEnd];
+        *tok = tb->toks[--tb->gapStart];
+        tok->loc = tb->size - tok->loc;
+    }
+    while (tb->gapStart < i) {
+        LexToken* tok = &tb->toks[tb->gapStart++];
+        *tok = tb->toks[tb->gapEnd++];
+        tok->loc = tb->size - tok->loc;
+    }
+}
+
+// make the gap at least one token wide; returns 0 on success
+int tbGrow(TokenBuffer* tb) {
+    if (tb->gapStart < tb->gapEnd) {
+        return 0;
+    }
+    int cap = tb->cap == 0 ? 1024 : tb->cap * 2;
+    LexToken* toks = (LexToken*)realloc(tb->toks, sizeof(LexToken) * cap);
+    if (toks == NULL) {
+        return 1;
+    }
+    int after = tb->cap - tb->gapEnd;
+    memmove(toks + cap - after, toks + tb->gapEnd, sizeof(LexToken) * after);
+    tb->toks = toks;
+    tb->gapEnd = cap - after;
+    tb->cap = cap;
+    return 0;
+}
+
+// state of a rescan, the ctx of relexPush()
+typedef struct Relex {
+    TokenBuffer* tb;
+    Lexer* lx;
+    size_t base;     // offset of lx->ptr in the text
+    int synced;      // 1 once a new token starts where an old one does
+    int failed;      // 1 if memory allocation failed
+} Relex;
+
+// TokenSink callback of editTokenBuffer(): insert the new tokens before the gap,
+// drop the old tokens after the gap which they overlap.
+void relexPush(void* ctx, const TokenRef* tokens, int n) {
+    Relex* rx = (Relex*)ctx;
+    TokenBuffer* tb = rx->tb;
+    for (int i = 0; i < n && !rx->synced && !rx->failed; i++) {
+        size_t loc = rx->base + tokens[i].loc;
+        while (tb->gapEnd < tb->cap && tb->size - tb->toks[tb->gapEnd].loc < loc) {
+            tb->gapEnd++;
+        }
+        if (tb->gapEnd < tb->cap && tb->size - tb->toks[tb->gapEnd].loc == loc) {
+            rx->synced = 1; // the old tokens from here on are still right
+            rx->lx->stop = 1;
+            break;
+        }
+        if (tbGrow(tb) != 0) {
+            rx->failed = 1;
+            rx->lx->stop = 1;
+            break;
+        }
+        tb->toks[tb->gapStart++] = (LexToken){tokens[i].type, tokens[i].len, loc};
+        tb->relexed++;
+    }
+}
+
+// Replace text[off, off + del) by ins[0, insLen) and update the tokens.
+// Returns 0 on success, 1 if the text has a lexical error (see tbPrintError()),
+// -1 if the edit is out of range or memory allocation failed.
+int editTokenBuffer(TokenBuffer* tb, size_t off, size_t del, const unsigned char* ins, size_t insLen) {
+    if (off > tb->size || del > tb->size - off) {
+        return -1;
+    }
+    size_t newSize = tb->size - del + insLen;
+    if (newSize + 1 > tb->textCap) {
+        size_t cap = tb->textCap == 0 ? 4096 : tb->textCap;
+        while (cap < newSize + 1) {
+            cap *= 2;
+        }
+        unsigned char* text = (unsigned char*)realloc(tb->text, cap);
+        if (text == NULL) {
+            return -1;
+        }
+        tb->text = text;
+        tb->textCap = cap;
+    }
+
+    // restart at the last token starting before the edit, and forget the tokens
+    // from there to the end of the deleted text
+    int lo = 0, hi = tbCount(tb); // binary search of the first token starting at or after off
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (tbToken(tb, mid).loc < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int first = lo > 0 ? lo - 1 : 0;
+    size_t restart = lo > 0 ? tbToken(tb, first).loc : 0;
+    tbMoveGap(tb, first);
+    while (tb->gapEnd < tb->cap && tb->size - tb->toks[tb->gapEnd].loc < off + del) {
+        tb->gapEnd++;
+    }
+
+    // edit the text; the offsets of the tokens after the gap stay right
+    memmove(tb->text + off + insLen, tb->text + off + del, tb->size - off - del);
+    memcpy(tb->text + off, ins, insLen);
+    size_t oldSize = tb->size;
+    tb->size = newSize;
+    tb->text[newSize] = EOFF;
+    if (tb->errPos != NOERROR && tb->errPos >= off + del) {
+        tb->errPos = tb->errPos + newSize - oldSize;
+    }
+
+    Lexer* lx = (Lexer*)malloc(sizeof(Lexer));
+    TokenSink* sink = (TokenSink*)malloc(sizeof(TokenSink));
+    if (lx == NULL || sink == NULL) {
+        free(lx);
+        free(sink);
+        return -1;
+    }
+    initLexer(lx, tb->text + restart, 0);
+    Relex rx = {tb, lx, restart, 0, 0};
+    sink->push = relexPush;
+    sink->ctx = &rx;
+    sink->n = 0;
+    lx->sink = sink;
+    tb->relexed = 0;
+    int result = scanner(lx);
+    if (!rx.synced) { // the scan ran to the end (or to an error): no old token is left
+        tb->gapEnd = tb->cap;
+        tb->errPos = result != 0 ? restart + lx->loc - 1 : NOERROR;
+        tb->errState = lx->errState;
+        tb->errChar = lx->errChar;
+    }
+    free(sink);
+    free(lx);
+    if (rx.failed) {
+        return -1;
+    }
+    return tb->errPos != NOERROR;
+}
+
+// Create a token buffer for text[0, size); it is scanned as a single edit.
+// Returns NULL if memory allocation failed.
+TokenBuffer* newTokenBuffer(const unsigned char* text, size_t size) {
+    TokenBuffer* tb = (TokenBuffer*)calloc(1, sizeof(TokenBuffer));
+    if (tb == NULL) {
+        return NULL;
+    }
+    tb->errPos = NOERROR;
+    if (editTokenBuffer(tb, 0, 0, text, size) < 0) {
+        free(tb->text);
+        free(tb->toks);
+        free(tb);
+        return NULL;
+    }
+    return tb;
+}
+
+void freeTokenBuffer(TokenBuffer* tb) {
+    free(tb->text);
+    free(tb->toks);
+    free(tb);
+}
+
+// print the tokens as printTokenList() does
+void tbPrintTokens(const TokenBuffer* tb, FILE* out) {
+    Writer w;
+    initWriter(&w, out);
+    int n = tbCount(tb);
+    for (int i = 0; i < n; i++) {
+        LexToken tok = tbToken(tb, i);
+        writeToken(&w, (const char*)tb->text + tok.loc, tok.len, tok.type);
+    }
+    flushWriter(&w);
+}
+
+void tbPrintError(const TokenBuffer* tb, FILE* out) {
+    Lexer lx; // printError() only needs the error
+    lx.errState = tb->errState;
+    lx.errChar = tb->errChar;
+    printError(&lx, out);
+}
+
+// Print the statistics collected by the scanner.
+// Characters are reported as in HW#0: printable ones only, in the order of appearance.
+void printStats(const Lexer* lx, FILE* out) {
+    const Stats* stats = &lx->stats;
+    char typeName[MAXTOKENTYPE]; // buffer for token type name
+    size_t total = 0; // tklist is empty if the tokens went to a sink
+    for (int t = TYPE; t <= RIGHTBRACE; t++) {
+        total += stats->typecount[t];
+    }
+    fprintf(out, "Token statistics: total %zu tokens\n", total);
+    for (int t = TYPE; t <= RIGHTBRACE; t++) {
+        if (stats->typecount[t] > 0) {
+            genTokenType((TokenType)t, typeName);
+            fprintf(out, "%s : %zu\n", typeName, stats->typecount[t]);
+        }
+    }
+
+    size_t printable = 0;
+    for (int i = 32; i <= 126; i++) {
+        printable += stats->bytecount[i];
+    }
+    fprintf(out, "Character statistics: total %zu printable characters\n", printable);
+    for (int i = 0; i < stats->nseen; i++) {
+        unsigned char ch = stats->order[i];
+        if (ch >= 32 && ch <= 126) {
+            fprintf(out, "%c : %zu\n", ch, stats->bytecount[ch]);
+        }
+    }
+}
+
+/*===========================*/
+// Token cache               //
+/*===========================*/
+
+// With option -c, the tokens of a file are saved next to it in "<file>.tkc",
+// keyed by a hash of the content. When the content has not changed, the
+// cache is mapped with mmap() and printed in place: the scanner is not run.
+// The header also holds a hash of the rest of the cache, so that a corrupt
+// cache is scanned again rather than printed. The offsets of the tokens and
+// the lexical errors are kept as well, for -l and -k; a cache written with -k
+// is only used with -k, and one written without it only without it.
+// Layout, in native byte order, each section starting 4-byte aligned:
+//   TokenCacheHeader
+//   uint64_t locs[ntokens]          the offset of each token in the file
+//   CacheDiagnostic diags[ndiags]   the lexical errors collected with -k
+//   uint8_t  types[ntokens]
+//   uint32_t ids[ntokens]           the value of each token, an index in the intern table
+//   uint32_t offsets[nstrings + 1]  the intern table: start of each string in blob
+//   char     blob[blobSize]         the distinct token values, NUL-terminated
+#define CACHESUFFIX ".tkc"
+#define CACHEMAGIC 0x314b5f54u // "T_K1"
+#define CACHEVERSION 3
+#define ALIGN4(n) (((n) + 3) & ~(uint64_t)3)
+
+typedef struct TokenCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;     // hashContent() of the file
+    uint64_t size;     // size of the file
+    uint64_t bodyHash; // hashContent() of the cache after the header
+    uint32_t ntokens;
+    uint32_t nstrings;
+    uint32_t blobSize;
+    int32_t result;    // return value of the scanner
+    int32_t errState;  // as in Lexer, if result is 1
+    uint32_t errChar;
+    uint64_t errLoc;
+    uint32_t recover;  // 1 if written with -k
+    uint32_t ndiags;
+} TokenCacheHeader;
+
+// a Diagnostic in the cache, without padding
+typedef struct CacheDiagnostic {
+    uint64_t loc;
+    int32_t state;
+    uint32_t c;
+} CacheDiagnostic;
+
+// a cache file mapped by openTokenCache()
+typedef struct TokenCache {
+    void* map;
+    size_t mapSize;
+    const TokenCacheHeader* header;
+    const uint64_t* locs;
+    const CacheDiagnostic* diags;
+    const uint8_t* types;
+    const uint32_t* ids;
+    const uint32_t* offsets;
+    const char* blob;
+} TokenCache;
+
+#define FNVBASIS 14695981039346656037ull
+
+// 64-bit FNV-1a of content, going on from the hash h of the bytes before it
+uint64_t hashMore(uint64_t h, const unsigned char* content, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        h ^= content[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// 64-bit FNV-1a
+uint64_t hashContent(const unsigned char* content, size_t size) {
+    return hashMore(FNVBASIS, content, size);
+}
+
+// "<filename>.tkc", to be freed by the caller
+char* cachePath(const char* filename) {
+    size_t len = strlen(filename);
+    char* path = (char*)malloc(len + sizeof(CACHESUFFIX));
+    if (path != NULL) {
+        memcpy(path, filename, len);
+        memcpy(path + len, CACHESUFFIX, sizeof(CACHESUFFIX));
+    }
+    return path;
+}
+
+// The intern table under construction: an open-addressing hash set of the
+// strings in blob, slots hold the index of a string plus one (0 is empty).
+typedef struct Interner {
+    uint32_t* slots;
+    size_t mask;
+    uint32_t* offsets;
+    uint32_t n, cap;
+    char* blob;
+    size_t blobSize, blobCap;
+} Interner;
+
+int growInterner(Interner* in) {
+    size_t nslots = in->slots == NULL ? 1024 : (in->mask + 1) * 2;
+    uint32_t* slots = (uint32_t*)calloc(nslots, sizeof(uint32_t));
+    if (slots == NULL) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < in->n; i++) { // rehash the strings already in blob
+        const char* s = in->blob + in->offsets[i];
+        size_t k = hashContent((const unsigned char*)s, in->offsets[i + 1] - in->offsets[i] - 1) & (nslots - 1);
+        while (slots[k] != 0) {
+            k = (k + 1) & (nslots - 1);
+        }
+        slots[k] = i + 1;
+    }
+    free(in->slots);
+    in->slots = slots;
+    in->mask = nslots - 1;
+    return 0;
+}
+
+void freeInterner(Interner* in) {
+    free(in->slots);
+    free(in->offsets);
+    free(in->blob);
+    memset(in, 0, sizeof(Interner));
+}
+
+// index of the string in the intern table, added if new; -1 on failure
+int64_t intern(Interner* in, const char* s) {
+    size_t len = strlen(s);
+    if (in->slots == NULL || (size_t)in->n * 2 >= in->mask + 1) {
+        if (growInterner(in) != 0) {
+            return -1;
+        }
+    }
+    size_t k = hashContent((const unsigned char*)s, len) & in->mask;
+    while (in->slots[k] != 0) {
+        uint32_t i = in->slots[k] - 1;
+        if (in->offsets[i + 1] - in->offsets[i] - 1 == len && memcmp(in->blob + in->offsets[i], s, len) == 0) {
+            return i;
+        }
+        k = (k + 1) & in->mask;
+    }
+    if (in->n + 2 > in->cap) { // offsets has n + 1 entries
+        uint32_t cap = in->cap == 0 ? 256 : in->cap * 2;
+        uint32_t* tmp = (uint32_t*)realloc(in->offsets, sizeof(uint32_t) * cap);
+        if (tmp == NULL) {
+            return -1;
+        }
+        in->offsets = tmp;
+        in->offsets[0] = 0;
+        in->cap = cap;
+    }
+    if (in->blobSize + len + 1 > in->blobCap) {
+        size_t cap = in->blobCap == 0 ? 4096 : in->blobCap * 2;
+        while (cap < in->blobSize + len + 1) {
+            cap *= 2;
+        }
+        char* tmp = cap <= UINT32_MAX ? (char*)realloc(in->blob, cap) : NULL;
+        if (tmp == NULL) {
+            return -1;
+        }
+        in->blob = tmp;
+        in->blobCap = cap;
+    }
+    memcpy(in->blob + in->blobSize, s, len + 1);
+    in->blobSize += len + 1;
+    in->offsets[++in->n] = (uint32_t)in->blobSize;
+    in->slots[k] = in->n;
+    return in->n - 1;
+}
+
+// Save the result of scanning filename, whose content has this hash and size.
+// The file is written under a temporary name and renamed, so that a reader
+// never maps a partial cache. Returns 0 on success; a failure only means no cache.
+int writeTokenCache(const char* filename, const Lexer* lx, int result, uint64_t hash, size_t size) {
+    uint32_t n = (uint32_t)lx->tklist.size;
+    uint32_t nd = (uint32_t)lx->ndiags;
+    uint64_t* locs = (uint64_t*)malloc(sizeof(uint64_t) * n + 1);
+    CacheDiagnostic* diags = (CacheDiagnostic*)malloc(sizeof(CacheDiagnostic) * nd + 1);
+    uint8_t* types = (uint8_t*)malloc(ALIGN4(n) + 1);
+    uint32_t* ids = (uint32_t*)malloc(sizeof(uint32_t) * n + 1);
+    Interner in = {0};
+    char* path = cachePath(filename);
+    char* tmp = path != NULL ? (char*)malloc(strlen(path) + 8) : NULL;
+    int failed = locs == NULL || diags == NULL || types == NULL || ids == NULL || tmp == NULL;
+    uint32_t i = 0;
+    for (Token* t = lx->tklist.head; t != NULL && !failed; t = t->next, i++) {
+        int64_t id = intern(&in, t->value);
+        failed = id < 0;
+        locs[i] = t->loc;
+        types[i] = (uint8_t)t->type;
+        ids[i] = (uint32_t)id;
+    }
+    for (i = 0; i < nd && !failed; i++) {
+        diags[i] = (CacheDiagnostic){lx->diags[i].loc, lx->diags[i].state, lx->diags[i].c};
+    }
+    if (!failed && in.offsets == NULL) { // no tokens: the table still has offsets[0]
+        in.offsets = (uint32_t*)calloc(1, sizeof(uint32_t));
+        failed = in.offsets == NULL;
+    }
+
+    FILE* fp = NULL;
+    if (!failed) {
+        memset(types + n, 0, ALIGN4(n) - n); // padding
+        sprintf(tmp, "%s.XXXXXX", path);
+        int fd = mkstemp(tmp);
+        if (fd >= 0) {
+            fchmod(fd, 0644); // mkstemp() creates it private
+        }
+        fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (fp == NULL && fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        failed = fp == NULL;
+    }
+    if (!failed) {
+        uint64_t bodyHash = hashMore(FNVBASIS, (const unsigned char*)locs, sizeof(uint64_t) * n);
+        bodyHash = hashMore(bodyHash, (const unsigned char*)diags, sizeof(CacheDiagnostic) * nd);
+        bodyHash = hashMore(bodyHash, types, ALIGN4(n));
+        bodyHash = hashMore(bodyHash, (const unsigned char*)ids, sizeof(uint32_t) * n);
+        bodyHash = hashMore(bodyHash, (const unsigned char*)in.offsets, sizeof(uint32_t) * (in.n + 1));
+        bodyHash = hashMore(bodyHash, (const unsigned char*)in.blob, in.blobSize);
+        TokenCacheHeader header = {CACHEMAGIC, CACHEVERSION, hash, size, bodyHash, n, in.n, (uint32_t)in.blobSize,
+                                   result, lx->errState, lx->errChar, lx->errLoc, (uint32_t)lx->recover, nd};
+        int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+                 && fwrite(locs, sizeof(uint64_t), n, fp) == n
+                 && fwrite(diags, sizeof(CacheDiagnostic), nd, fp) == nd
+                 && fwrite(types, 1, ALIGN4(n), fp) == ALIGN4(n)
+                 && fwrite(ids, sizeof(uint32_t), n, fp) == n
+                 && fwrite(in.offsets, sizeof(uint32_t), in.n + 1, fp) == in.n + 1
+                 && (in.blobSize == 0 || fwrite(in.blob, 1, in.blobSize, fp) == in.blobSize); // no blob without a token
+        ok = fclose(fp) == 0 && ok;
+        failed = !ok || rename(tmp, path) != 0;
+        if (failed) {
+            unlink(tmp);
+        }
+    }
+
+    freeInterner(&in);
+    free(tmp);
+    free(path);
+    free(ids);
+    free(types);
+    free(diags);
+    free(locs);
+    return failed;
+}
+
+void closeTokenCache(TokenCache* tc) {
+    munmap(tc->map, tc->mapSize);
+}
+
+// Map the cache of filename and check it against the content hash and size,
+// the recovery mode, and the cache itself against its body hash. Every index
+// and offset is checked as well, so that printing from the cache cannot read
+// outside of it. Returns 0 if the cache is valid, 1 otherwise.
+int openTokenCache(TokenCache* tc, const char* filename, uint64_t hash, size_t size, int recover) {
+    char* path = cachePath(filename);
+    int fd = path != NULL ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TokenCacheHeader)) {
+        close(fd);
+        return 1;
+    }
+    tc->mapSize = st.st_size;
+    tc->map = mmap(NULL, tc->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (tc->map == MAP_FAILED) {
+        return 1;
+    }
+
+    const TokenCacheHeader* h = (const TokenCacheHeader*)tc->map;
+    uint64_t n = h->ntokens, ns = h->nstrings, nd = h->ndiags;
+    int valid = h->magic == CACHEMAGIC && h->version == CACHEVERSION && h->hash == hash && h->size == size
+                && (h->result == 0 || h->result == 1) && h->recover == (uint32_t)(recover != 0) && h->errLoc <= size
+                && sizeof(TokenCacheHeader) + 8 * n + sizeof(CacheDiagnostic) * nd
+                   + ALIGN4(n) + 4 * n + 4 * (ns + 1) + h->blobSize == tc->mapSize
+                && hashContent((const unsigned char*)tc->map + sizeof(TokenCacheHeader),
+                               tc->mapSize - sizeof(TokenCacheHeader)) == h->bodyHash;
+    if (valid) {
+        const char* p = (const char*)tc->map + sizeof(TokenCacheHeader);
+        tc->header = h;
+        tc->locs = (const uint64_t*)p;
+        tc->diags = (const CacheDiagnostic*)(tc->locs + n);
+        tc->types = (const uint8_t*)(tc->diags + nd);
+        tc->ids = (const uint32_t*)(tc->types + ALIGN4(n));
+        tc->offsets = tc->ids + n;
+        tc->blob = (const char*)(tc->offsets + ns + 1);
+        valid = tc->offsets[0] == 0 && tc->offsets[ns] == h->blobSize;
+        for (uint64_t i = 0; i < ns && valid; i++) { // strings are non-overlapping and NUL-terminated
+            valid = tc->offsets[i] < tc->offsets[i + 1] && tc->offsets[i + 1] - tc->offsets[i] <= MAXTOKEN
+                    && tc->blob[tc->offsets[i + 1] - 1] == '\0';
+        }
+        for (uint64_t i = 0; i < n && valid; i++) {
+            valid = tc->types[i] <= RIGHTBRACE && tc->ids[i] < ns && tc->locs[i] < size;
+        }
+        for (uint64_t i = 0; i < nd && valid; i++) {
+            valid = tc->diags[i].loc <= size && tc->diags[i].c <= 255;
+        }
+    }
+    if (!valid) {
+        closeTokenCache(tc);
+        return 1;
+    }
+    return 0;
+}
+
+// print the cached tokens as printTokenList() does
+void printTokenCache(const TokenCache* tc, LineIndex* lines, FILE* out) {
+    Writer w;
+    initWriter(&w, out);
+    for (uint32_t i = 0; i < tc->header->ntokens; i++) {
+        uint32_t id = tc->ids[i];
+        size_t line, column;
+        if (lines != NULL && lineColumn(lines, tc->locs[i], &line, &column) == 0) {
+            writePosition(&w, line, column);
+        }
+        writeToken(&w, tc->blob + tc->offsets[id], tc->offsets[id + 1] - tc->offsets[id] - 1, (TokenType)tc->types[i]);
+    }
+    flushWriter(&w);
+}
+
+// print the cached lexical errors as printDiagnostics() does
+void printCacheDiagnostics(const TokenCache* tc, LineIndex* lines, const char* filename, FILE* out) {
+    uint32_t n = tc->header->ndiags;
+    for (uint32_t i = 0; i < n; i++) {
+        printPosition(lines, filename, tc->diags[i].loc, out);
+        printErrorMessage(tc->diags[i].state, (unsigned char)tc->diags[i].c, out);
+    }
+    fprintf(out, "%u lexical error%s\n", n, n == 1 ? "" : "s");
+}
+
+/*===========================*/
+// Names                     //
+/*===========================*/
+
+// How far a file goes through the pipeline of scanFile()
+typedef enum Stage {
+    ScanStage,  // print the tokens
+    NamesStage, // resolve the identifiers to their declarations (resolveNames())
+    IRStage,    // build the SSA IR of the program and print it (compileProgram())
+    OptStage    // the same, once optimized (optimizeIR())
+} Stage;
+
+// A declaration "int name", the symbols are numbered in the order of the text
+typedef struct Symbol {
+    uint32_t name;      // index of the identifier in the intern table
+    int depth;          // nesting of braces of the declaration, 0 outside of them
+    size_t loc;         // offset of the identifier in the file content
+    int64_t shadowed;   // the symbol of the same name that this one hides, -1 if none
+} Symbol;
+
+// The identifiers are interned (an open-addressing hash table), so that the
+// symbol visible under a name is found by indexing bindings with its index.
+// Opening a scope pushes the height of the visible stack; closing it pops the
+// symbols declared since, restoring what they shadowed: each symbol is pushed
+// and popped once, so a whole program is resolved in linear time.
+typedef struct SymbolTable {
+    Interner names;
+    int64_t* bindings;      // bindings[name]: the visible symbol of the name, -1 if none
+    size_t bindingCap;
+    Symbol* symbols;        // all the declarations so far
+    size_t nsymbols, symbolCap;
+    size_t* visible;        // the symbols in scope, the innermost last
+    size_t nvisible, visibleCap;
+    size_t* scopes;         // scopes[d]: nvisible when the scope of depth d + 1 was opened
+    int depth;              // number of open scopes
+    size_t scopeCap;
+} SymbolTable;
+
+void freeSymbolTable(SymbolTable* st) {
+    freeInterner(&st->names);
+    free(st->bindings);
+    free(st->symbols);
+    free(st->visible);
+    free(st->scopes);
+    memset(st, 0, sizeof(SymbolTable));
+}
+
+// Grow an array of n elements of the given size to hold one more. Returns 0, or -1 on failure.
+int reserveOne(void** array, size_t n, size_t* cap, size_t size) {
+    if (n < *cap) {
+        return 0;
+    }
+    size_t newCap = *cap == 0 ? 256 : *cap * 2;
+    void* tmp = realloc(*array, newCap * size);
+    if (tmp == NULL) {
+        return -1;
+    }
+    *array = tmp;
+    *cap = newCap;
+    return 0;
+}
+
+// The index of an identifier, with room for its binding. Returns -1 on failure.
+int64_t internName(SymbolTable* st, const char* name) {
+    int64_t id = intern(&st->names, name);
+    if (id < 0) {
+        return -1;
+    }
+    while ((size_t)id >= st->bindingCap) {
+        size_t old = st->bindingCap;
+        if (reserveOne((void**)&st->bindings, old, &st->bindingCap, sizeof(int64_t)) < 0) {
+            return -1;
+        }
+        for (size_t i = old; i < st->bindingCap; i++) {
+            st->bindings[i] = -1;
+        }
+    }
+    return id;
+}
+
+// Returns 0, or -1 on failure.
+int openScope(SymbolTable* st) {
+    if (reserveOne((void**)&st->scopes, st->depth, &st->scopeCap, sizeof(size_t)) < 0) {
+        return -1;
+    }
+    st->scopes[st->depth++] = st->nvisible;
+    return 0;
+}
+
+// Close the innermost scope; nothing happens at depth 0, which is never opened.
+void closeScope(SymbolTable* st) {
+    if (st->depth == 0) {
+        return;
+    }
+    size_t mark = st->scopes[--st->depth];
+    while (st->nvisible > mark) {
+        Symbol* sym = &st->symbols[st->visible[--st->nvisible]];
+        st->bindings[sym->name] = sym->shadowed;
+    }
+}
+
+// Declare the interned name at loc in the current scope.
+// Returns the new symbol, -2 if the name is already declared in this scope
+// (*previous is then that declaration), or -1 on failure.
+int64_t declare(SymbolTable* st, int64_t name, size_t loc, int64_t* previous) {
+    int64_t prev = st->bindings[name];
+    if (prev >= 0 && st->symbols[prev].depth == st->depth) {
+        *previous = prev;
+        return -2;
+    }
+    if (reserveOne((void**)&st->symbols, st->nsymbols, &st->symbolCap, sizeof(Symbol)) < 0
+        || reserveOne((void**)&st->visible, st->nvisible, &st->visibleCap, sizeof(size_t)) < 0) {
+        return -1;
+    }
+    int64_t id = (int64_t)st->nsymbols++;
+    st->symbols[id] = (Symbol){(uint32_t)name, st->depth, loc, prev};
+    st->bindings[name] = id;
+    st->visible[st->nvisible++] = (size_t)id;
+    return id;
+}
+
+// the visible symbol of the interned name, -1 if it is not declared
+int64_t lookup(const SymbolTable* st, int64_t name) {
+    return st->bindings[name];
+}
+
+void printLineColumn(LineIndex* lines, size_t loc, FILE* out) {
+    size_t line, column;
+    if (lineColumn(lines, loc, &line, &column) == 0) {
+        fprintf(out, "%zu:%zu", line, column);
+    } else {
+        fprintf(out, "offset %zu", loc);
+    }
+}
+
+// Resolve the identifiers of a token list: "{" and "}" open and close a scope,
+// "int" followed by an identifier declares it, any other identifier is a use.
+// Each of them is printed with its position and resolution, the errors with the
+// file name, then a summary. Returns the number of errors, or -1 on failure.
+int resolveNames(const TokenList* list, LineIndex* lines, const char* filename, FILE* out) {
+    SymbolTable st = {0};
+    size_t decls = 0, uses = 0;
+    int undeclared = 0, duplicates = 0, failed = 0;
+    TokenType last = ID; // type of the previous token, anything but TYPE
+    for (Token* t = list->head; t != NULL && !failed; last = t->type, t = t->next) {
+        if (t->type == LEFTBRACE) {
+            failed = openScope(&st) < 0;
+        } else if (t->type == RIGHTBRACE) {
+            closeScope(&st);
+        } else if (t->type == ID) {
+            int64_t name = internName(&st, t->value);
+            if (name < 0) {
+                failed = 1;
+                break;
+            }
+            if (last == TYPE) {
+                int64_t previous = -1;
+                int64_t sym = declare(&st, name, t->loc, &previous);
+                failed = sym == -1;
+                if (sym == -2) {
+                    printPosition(lines, filename, t->loc, out);
+                    fprintf(out, "error: %s is already declared at ", t->value);
+                    printLineColumn(lines, st.symbols[previous].loc, out);
+                    fprintf(out, "\n");
+                    duplicates++;
+                } else if (sym >= 0) {
+                    printLineColumn(lines, t->loc, out);
+                    fprintf(out, ": %s declared in scope %d\n", t->value, st.depth);
+                    decls++;
+                }
+            } else {
+                int64_t sym = lookup(&st, name);
+                if (sym < 0) {
+                    printPosition(lines, filename, t->loc, out);
+                    fprintf(out, "error: %s is not declared\n", t->value);
+                    undeclared++;
+                } else {
+                    printLineColumn(lines, t->loc, out);
+                    fprintf(out, ": %s refers to ", t->value);
+                    printLineColumn(lines, st.symbols[sym].loc, out);
+                    fprintf(out, "\n");
+                    uses++;
+                }
+            }
+        }
+    }
+    freeSymbolTable(&st);
+    if (failed) {
+        fprintf(out, "Error: memory allocation failed\n");
+        return -1;
+    }
+    fprintf(out, "Names: %zu declarations, %zu uses, %d undeclared, %d duplicate%s\n",
+            decls, uses, undeclared, duplicates, duplicates == 1 ? "" : "s");
+    return undeclared + duplicates;
+}
+
+/*===========================*/
+// SSA IR                    //
+/*===========================*/
+
+// The IR of a program, in SSA form: each instruction defines one value, named
+// by its index in IR.insts (printed "v<index>"), and the blocks are named by
+// their index in IR.blocks ("b<index>", b0 is the entry). Everything lives in
+// a few dense arrays, so a million instructions take about 20 MB.
+
+#define NOVALUE UINT32_MAX // no instruction, value or block
+#define MAXNESTING 10000   // statements and expressions nested deeper are an error, not a stack overflow
+
+typedef enum Opcode {
+    OpConst, // consts[a]
+    OpUndef, // the value of a variable read before it is assigned
+    OpAdd,   // a + b
+    OpSub,   // a - b
+    OpEq,    // a == b, as 0 or 1, and so on
+    OpLt,
+    OpLe,
+    OpGt,
+    OpGe,
+    OpPhi    // a if the block is entered from preds[0], b if from preds[1]
+} Opcode;
+
+const Name opNames[OpPhi + 1] = {
+    NAME("const"), NAME("undef"), NAME("add"), NAME("sub"), NAME("eq"),
+    NAME("lt"), NAME("le"), NAME("gt"), NAME("ge"), NAME("phi")
+};
+
+// the statement a BranchTerm comes from, for messages
+typedef enum BranchKind {
+    IfKind,
+    IfElseKind,
+    WhileKind
+} BranchKind;
+
+typedef enum Terminator {
+    NoTerm,     // the block is being built
+    JumpTerm,   // go to succs[0]
+    BranchTerm, // go to succs[0] if cond is not 0, else to succs[1]
+    ReturnTerm  // the end of main()
+} Terminator;
+
+typedef struct Inst {
+    uint32_t a, b;  // the operands, see Opcode
+    uint32_t block; // the block of the instruction
+    uint32_t next;  // the next instruction (or phi) of the block, NOVALUE after the last
+    uint8_t op;     // Opcode
+} Inst;
+
+// The control flow of if/else and while never joins more than two edges,
+// so the predecessors of a block, and the operands of a phi, fit in two slots.
+typedef struct Block {
+    uint32_t preds[2];
+    uint32_t succs[2];
+    uint32_t cond;        // the value tested by a BranchTerm
+    uint32_t first, last; // the instructions other than phis, in order
+    uint32_t phis;        // the first phi
+    uint8_t npreds;
+    uint8_t term;         // Terminator
+    uint8_t kind;         // BranchKind of a BranchTerm
+    size_t loc;           // the offset of the condition of a BranchTerm, for messages
+} Block;
+
+typedef struct IR {
+    Inst* insts;
+    size_t ninsts, instCap;
+    int64_t* consts;
+    size_t nconsts, constCap;
+    Block* blocks;
+    size_t nblocks, blockCap;
+} IR;
+
+void freeIR(IR* ir) {
+    free(ir->insts);
+    free(ir->consts);
+    free(ir->blocks);
+    memset(ir, 0, sizeof(IR));
+}
+
+// Returns the new block, or NOVALUE on failure.
+uint32_t newBlock(IR* ir) {
+    if (reserveOne((void**)&ir->blocks, ir->nblocks, &ir->blockCap, sizeof(Block)) < 0) {
+        return NOVALUE;
+    }
+    uint32_t id = (uint32_t)ir->nblocks++;
+    ir->blocks[id] = (Block){{NOVALUE, NOVALUE}, {NOVALUE, NOVALUE}, NOVALUE,
+                             NOVALUE, NOVALUE, NOVALUE, 0, NoTerm, 0, 0};
+    return id;
+}
+
+void addPred(IR* ir, uint32_t block, uint32_t pred) {
+    Block* bl = &ir->blocks[block];
+    bl->preds[bl->npreds++] = pred;
+}
+
+// A new instruction, not linked to its block yet. Returns it, or NOVALUE on failure.
+uint32_t newInst(IR* ir, Opcode op, uint32_t a, uint32_t b, uint32_t block) {
+    if (reserveOne((void**)&ir->insts, ir->ninsts, &ir->instCap, sizeof(Inst)) < 0) {
+        return NOVALUE;
+    }
+    uint32_t id = (uint32_t)ir->ninsts++;
+    ir->insts[id] = (Inst){a, b, block, NOVALUE, (uint8_t)op};
+    return id;
+}
+
+// Append an instruction to a block. Returns it, or NOVALUE on failure.
+uint32_t appendInst(IR* ir, Opcode op, uint32_t a, uint32_t b, uint32_t block) {
+    uint32_t id = newInst(ir, op, a, b, block);
+    if (id == NOVALUE) {
+        return NOVALUE;
+    }
+    Block* bl = &ir->blocks[block];
+    if (bl->last == NOVALUE) {
+        bl->first = id;
+    } else {
+        ir->insts[bl->last].next = id;
+    }
+    bl->last = id;
+    return id;
+}
+
+// An assignment in an open branch or loop body, undone at its end
+typedef struct Assignment {
+    uint32_t var, old; // the variable and its value before
+    uint32_t stamp;    // and the stamp of that value
+} Assignment;
+
+// A variable whose value depends on the way the control flow came: assigned in an if,
+// its values x at the end of the then branch and y at the end of the else branch
+// (or of the condition); in a while, x is its phi in the header (see endLoop())
+// and y its value at the end of the body.
+typedef struct JoinValue {
+    uint32_t var, x, y;
+} JoinValue;
+
+// a while being parsed
+typedef struct Loop {
+    uint32_t header; // the block testing the condition
+    uint32_t gen;    // the values stamped before this are from before the loop
+} Loop;
+
+// The SSA construction, while parsing the tokens. Since the control flow is
+// structured, the current value of each variable is kept in an array: an
+// assignment overwrites it, logging the old value if it is in a branch or a
+// loop body. At the end of each branch, the log gives the variables it
+// assigned and restores their values; the join gets a phi for each variable
+// that differs between the ways.
+// Loops are done as by Braun et al. (Simple and Efficient Construction of SSA
+// Form, 2013): a while header is not sealed until the end of its body, so a read
+// of a variable whose value is from before the loop (its stamp tells) puts an
+// incomplete phi in the header, and in the headers of the enclosing loops which
+// the value is from before too. Its second operand is filled in at the end of
+// the body, where the variables assigned in the loop get their header phi as well.
+// So each assignment is handled once per enclosing if or while, and each phi
+// is made once: the construction is linear in the size of the program.
+// The variables are the symbols of the declarations (see SymbolTable).
+typedef struct IRBuilder {
+    IR* ir;
+    SymbolTable st;
+    uint32_t* values;   // values[var]: the current value of the variable
+    uint32_t* stamps;   // stamps[var]: the gen of the innermost loop open when values[var] was set
+    uint32_t* marks;    // marks[var]: the last pass which saw the variable
+    uint32_t* slots;    // slots[var]: the JoinValue of the variable, if joins[slot].var is var
+    size_t varCap;
+    uint32_t pass;
+    Assignment* log;    // the assignments since the start of the outermost open region
+    size_t nlog, logCap;
+    int regions;        // number of open branches and loop bodies
+    JoinValue* joins;   // a stack, one group for each if and while being parsed
+    size_t njoins, joinCap;
+    Loop* loops;        // the whiles being parsed, the innermost last
+    size_t nloops, loopCap;
+    uint32_t gen;       // the gen of the last loop opened, 0 outside of the loops
+    int depth;          // nesting of the statement or expression being parsed
+    uint32_t undef;     // the OpUndef value, NOVALUE until it is needed
+    uint32_t cur;       // the block being built
+    Token* tok;         // the next token
+    LineIndex* lines;
+    const char* filename;
+    FILE* out;
+    int failed;         // an error was printed, the IR is incomplete
+} IRBuilder;
+
+// Print an error at the next token (or at the end of the file) and stop the construction.
+void irError(IRBuilder* b, const char* message, const char* name) {
+    if (b->failed) {
+        return;
+    }
+    b->failed = 1;
+    printPosition(b->lines, b->filename, b->tok != NULL ? b->tok->loc : b->lines->size, b->out);
+    if (name != NULL) {
+        fprintf(b->out, "error: %s %s\n", name, message);
+    } else {
+        fprintf(b->out, "error: %s\n", message);
+    }
+}
+
+void irOutOfMemory(IRBuilder* b) {
+    if (!b->failed) {
+        b->failed = 1;
+        fprintf(b->out, "Error: memory allocation failed\n");
+    }
+}
+
+// the OpUndef value, first in the entry block
+uint32_t getUndef(IRBuilder* b) {
+    if (b->undef == NOVALUE) {
+        IR* ir = b->ir;
+        uint32_t id = newInst(ir, OpUndef, NOVALUE, NOVALUE, 0);
+        if (id == NOVALUE) {
+            irOutOfMemory(b);
+            return NOVALUE;
+        }
+        ir->insts[id].next = ir->blocks[0].first;
+        ir->blocks[0].first = id;
+        if (ir->blocks[0].last == NOVALUE) {
+            ir->blocks[0].last = id;
+        }
+        b->undef = id;
+    }
+    return b->undef;
+}
+
+// An instruction appended to the current block, NOVALUE after an error.
+uint32_t emit(IRBuilder* b, Opcode op, uint32_t x, uint32_t y) {
+    if (b->failed) {
+        return NOVALUE;
+    }
+    uint32_t id = appendInst(b->ir, op, x, y, b->cur);
+    if (id == NOVALUE) {
+        irOutOfMemory(b);
+    }
+    return id;
+}
+
+uint32_t emitConst(IRBuilder* b, int64_t value) {
+    IR* ir = b->ir;
+    if (b->failed || reserveOne((void**)&ir->consts, ir->nconsts, &ir->constCap, sizeof(int64_t)) < 0) {
+        irOutOfMemory(b);
+        return NOVALUE;
+    }
+    ir->consts[ir->nconsts] = value;
+    return emit(b, OpConst, (uint32_t)ir->nconsts++, NOVALUE);
+}
+
+// A phi at the start of block, NOVALUE after an error. An incomplete phi of a
+// while header has the variable instead of its second operand until the header is sealed.
+uint32_t emitPhi(IRBuilder* b, uint32_t block, uint32_t x, uint32_t y) {
+    if (b->failed) {
+        return NOVALUE;
+    }
+    IR* ir = b->ir;
+    uint32_t id = newInst(ir, OpPhi, x, y, block);
+    if (id == NOVALUE) {
+        irOutOfMemory(b);
+        return NOVALUE;
+    }
+    ir->insts[id].next = ir->blocks[block].phis;
+    ir->blocks[block].phis = id;
+    return id;
+}
+
+// Make room for the variable of a new symbol. Returns 0, or -1 on failure.
+int addVariable(IRBuilder* b, int64_t var) {
+    while ((size_t)var >= b->varCap) {
+        size_t cap = b->varCap == 0 ? 256 : b->varCap * 2;
+        uint32_t* values = (uint32_t*)realloc(b->values, cap * sizeof(uint32_t));
+        if (values != NULL) {
+            b->values = values;
+        }
+        uint32_t* stamps = (uint32_t*)realloc(b->stamps, cap * sizeof(uint32_t));
+        if (stamps != NULL) {
+            b->stamps = stamps;
+        }
+        uint32_t* marks = (uint32_t*)realloc(b->marks, cap * sizeof(uint32_t));
+        if (marks != NULL) {
+            b->marks = marks;
+        }
+        uint32_t* slots = (uint32_t*)realloc(b->slots, cap * sizeof(uint32_t));
+        if (slots != NULL) {
+            b->slots = slots;
+        }
+        if (values == NULL || stamps == NULL || marks == NULL || slots == NULL) {
+            return -1;
+        }
+        for (size_t i = b->varCap; i < cap; i++) {
+            b->marks[i] = 0;
+            b->slots[i] = 0;
+        }
+        b->varCap = cap;
+    }
+    b->values[var] = NOVALUE;
+    b->stamps[var] = 0;
+    return 0;
+}
+
+// the gen of the innermost open loop, 0 outside of the loops
+uint32_t loopGen(const IRBuilder* b) {
+    return b->nloops > 0 ? b->loops[b->nloops - 1].gen : 0;
+}
+
+void writeVariable(IRBuilder* b, uint32_t var, uint32_t value) {
+    if (b->failed) {
+        return;
+    }
+    if (b->regions > 0) {
+        if (reserveOne((void**)&b->log, b->nlog, &b->logCap, sizeof(Assignment)) < 0) {
+            irOutOfMemory(b);
+            return;
+        }
+        b->log[b->nlog++] = (Assignment){var, b->values[var], b->stamps[var]};
+    }
+    b->values[var] = value;
+    b->stamps[var] = loopGen(b);
+}
+
+// The current value of a variable, NOVALUE after an error. A value from before
+// an open loop goes through an incomplete phi in its header, and so on for the
+// loops inside it: only the phi of the innermost loop is kept in values.
+uint32_t readVariable(IRBuilder* b, uint32_t var) {
+    uint32_t value = b->values[var];
+    if (value == NOVALUE) { // int x = x
+        return getUndef(b);
+    }
+    size_t i = b->nloops;
+    while (i > 0 && b->loops[i - 1].gen > b->stamps[var]) {
+        i--;
+    }
+    if (i == b->nloops) {
+        return value;
+    }
+    for (; i < b->nloops; i++) {
+        value = emitPhi(b, b->loops[i].header, value, var);
+    }
+    b->values[var] = value; // a phi of the header holds in the whole loop, so it is not logged
+    b->stamps[var] = loopGen(b);
+    return value;
+}
+
+// Returns 0, or -1 on failure.
+int pushJoin(IRBuilder* b, uint32_t var, uint32_t x, uint32_t y) {
+    if (reserveOne((void**)&b->joins, b->njoins, &b->joinCap, sizeof(JoinValue)) < 0) {
+        return -1;
+    }
+    b->slots[var] = (uint32_t)b->njoins;
+    b->joins[b->njoins++] = (JoinValue){var, x, y};
+    return 0;
+}
+
+// the JoinValue of var in joins[base..njoins), NULL if none
+JoinValue* findJoin(IRBuilder* b, uint32_t var, size_t base) {
+    uint32_t slot = b->slots[var];
+    return slot >= base && slot < b->njoins && b->joins[slot].var == var ? &b->joins[slot] : NULL;
+}
+
+// At the end of a branch of an if, undo the assignments logged since mark
+// and record the values they leave in joins[base..]: as x for the then branch,
+// as y for the else branch. The variables declared in the branch, from firstVar
+// on, are out of scope after it and need no phi.
+void endBranch(IRBuilder* b, size_t mark, size_t base, uint32_t firstVar, int isElse) {
+    if (b->failed) {
+        return;
+    }
+    uint32_t pass = ++b->pass;
+    size_t start = b->njoins;
+    for (size_t i = base; i < start; i++) { // the ifs and whiles of the branch reused the slots
+        b->slots[b->joins[i].var] = (uint32_t)i;
+    }
+    for (size_t i = b->nlog; i-- > mark; ) {
+        uint32_t var = b->log[i].var;
+        if (var < firstVar && b->marks[var] != pass) { // the last assignment of var
+            b->marks[var] = pass;
+            uint32_t value = readVariable(b, var);
+            JoinValue* j = isElse ? findJoin(b, var, base) : NULL;
+            if (j != NULL) {
+                j->y = value;
+            } else if (pushJoin(b, var, isElse ? NOVALUE : value, isElse ? value : NOVALUE) < 0) {
+                irOutOfMemory(b);
+                return;
+            }
+        }
+        b->values[var] = b->log[i].old;
+        b->stamps[var] = b->log[i].stamp;
+    }
+    b->nlog = mark;
+    // the other way keeps the values from before the if, until the else branch changes them
+    for (size_t i = isElse ? start : base; i < b->njoins; i++) {
+        JoinValue* j = &b->joins[i];
+        if (isElse) {
+            j->x = readVariable(b, j->var);
+        } else {
+            j->y = readVariable(b, j->var);
+        }
+    }
+}
+
+// A new block, with pred as its predecessor unless it is NOVALUE.
+uint32_t startBlock(IRBuilder* b, uint32_t pred) {
+    if (b->failed) {
+        return NOVALUE;
+    }
+    uint32_t id = newBlock(b->ir);
+    if (id == NOVALUE) {
+        irOutOfMemory(b);
+        return NOVALUE;
+    }
+    if (pred != NOVALUE) {
+        addPred(b->ir, id, pred);
+    }
+    return id;
+}
+
+// End the current block with a jump to target, which gets it as a predecessor.
+void jumpTo(IRBuilder* b, uint32_t target) {
+    Block* bl = &b->ir->blocks[b->cur];
+    bl->term = JumpTerm;
+    bl->succs[0] = target;
+    addPred(b->ir, target, b->cur);
+}
+
+int accept(IRBuilder* b, TokenType type) {
+    if (b->tok != NULL && b->tok->type == type) {
+        b->tok = b->tok->next;
+        return 1;
+    }
+    return 0;
+}
+
+void expect(IRBuilder* b, TokenType type, const char* what) {
+    if (!accept(b, type)) {
+        irError(b, what, NULL);
+    }
+}
+
+// The symbol of the identifier at the next token, -1 after an error.
+int64_t useName(IRBuilder* b) {
+    int64_t name = internName(&b->st, b->tok->value);
+    if (name < 0) {
+        irOutOfMemory(b);
+        return -1;
+    }
+    int64_t sym = lookup(&b->st, name);
+    if (sym < 0) {
+        irError(b, "is not declared", b->tok->value);
+    }
+    return sym;
+}
+
+uint32_t parseExpression(IRBuilder* b);
+
+// identifier | literal | ( expression ) | - primary
+uint32_t parsePrimary(IRBuilder* b) {
+    if (b->failed) {
+        return NOVALUE;
+    }
+    Token* t = b->tok;
+    if (t != NULL && t->type == ID) {
+        int64_t sym = useName(b);
+        if (sym < 0) {
+            return NOVALUE;
+        }
+        b->tok = t->next;
+        return readVariable(b, (uint32_t)sym);
+    } else if (t != NULL && t->type == LITERAL) {
+        int64_t value = 0;
+        for (const char* p = t->value; *p != '\0'; p++) {
+            if (value > (INT64_MAX - (*p - '0')) / 10) {
+                irError(b, "integer literal out of range", NULL);
+                return NOVALUE;
+            }
+            value = value * 10 + (*p - '0');
+        }
+        b->tok = t->next;
+        return emitConst(b, value);
+    } else if (b->depth == MAXNESTING && t != NULL && (t->type == LEFTPAREN || t->type == MINUS)) {
+        irError(b, "expression nested too deeply", NULL);
+        return NOVALUE;
+    } else if (accept(b, LEFTPAREN)) {
+        b->depth++;
+        uint32_t value = parseExpression(b);
+        b->depth--;
+        expect(b, RIGHTPAREN, "expected ')'");
+        return value;
+    } else if (accept(b, MINUS)) {
+        b->depth++;
+        uint32_t value = parsePrimary(b);
+        b->depth--;
+        uint32_t zero = emitConst(b, 0);
+        return emit(b, OpSub, zero, value);
+    }
+    irError(b, "expected an expression", NULL);
+    return NOVALUE;
+}
+
+// primary { ( + | - ) primary }
+uint32_t parseSum(IRBuilder* b) {
+    uint32_t value = parsePrimary(b);
+    while (!b->failed && b->tok != NULL && (b->tok->type == PLUS || b->tok->type == MINUS)) {
+        Opcode op = b->tok->type == PLUS ? OpAdd : OpSub;
+        b->tok = b->tok->next;
+        uint32_t right = parsePrimary(b);
+        value = emit(b, op, value, right);
+    }
+    return value;
+}
+
+// sum [ ( == | < | <= | > | >= ) sum ]
+uint32_t parseExpression(IRBuilder* b) {
+    uint32_t value = parseSum(b);
+    if (b->failed || b->tok == NULL) {
+        return value;
+    }
+    Opcode op;
+    switch (b->tok->type) {
+        case EQUAL: op = OpEq; break;
+        case LESS: op = OpLt; break;
+        case LESSEQUAL: op = OpLe; break;
+        case GREATER: op = OpGt; break;
+        case GREATEREQUAL: op = OpGe; break;
+        default: return value;
+    }
+    b->tok = b->tok->next;
+    uint32_t right = parseSum(b);
+    return emit(b, op, value, right);
+}
+
+// "(" expression ")" ending the current block with a branch on it
+void parseCondition(IRBuilder* b) {
+    size_t loc = b->tok != NULL ? b->tok->loc : 0;
+    expect(b, LEFTPAREN, "expected '('");
+    uint32_t cond = parseExpression(b);
+    expect(b, RIGHTPAREN, "expected ')'");
+    if (!b->failed) {
+        b->ir->blocks[b->cur].term = BranchTerm;
+        b->ir->blocks[b->cur].cond = cond;
+        b->ir->blocks[b->cur].loc = loc;
+    }
+}
+
+void parseStatement(IRBuilder* b);
+
+// "{" { statement } "}", a scope
+void parseBlock(IRBuilder* b) {
+    expect(b, LEFTBRACE, "expected '{'");
+    if (!b->failed && openScope(&b->st) < 0) {
+        irOutOfMemory(b);
+    }
+    while (!b->failed && b->tok != NULL && b->tok->type != RIGHTBRACE) {
+        parseStatement(b);
+    }
+    expect(b, RIGHTBRACE, "expected '}'");
+    closeScope(&b->st);
+}
+
+// if ( condition ) statement [ else statement ]: the condition ends the
+// current block, and both ways join in a new one, with the phis of joins
+void parseIf(IRBuilder* b) {
+    parseCondition(b);
+    uint32_t head = b->cur;
+    size_t mark = b->nlog, base = b->njoins;
+    uint32_t firstVar = (uint32_t)b->st.nsymbols;
+    b->cur = startBlock(b, head);
+    if (b->failed) {
+        return;
+    }
+    b->ir->blocks[head].succs[0] = b->cur;
+    b->regions++;
+    parseStatement(b);
+    endBranch(b, mark, base, firstVar, 0);
+    uint32_t thenEnd = b->cur;
+    uint32_t elseEnd = head;
+    if (accept(b, ELSE)) {
+        b->cur = startBlock(b, head);
+        if (b->failed) {
+            return;
+        }
+        b->ir->blocks[head].succs[1] = b->cur;
+        b->ir->blocks[head].kind = IfElseKind;
+        parseStatement(b);
+        endBranch(b, mark, base, firstVar, 1);
+        elseEnd = b->cur;
+    }
+    b->regions--;
+    uint32_t join = startBlock(b, NOVALUE);
+    if (b->failed) {
+        return;
+    }
+    b->cur = thenEnd;
+    jumpTo(b, join);
+    if (elseEnd == head) {
+        b->ir->blocks[head].succs[1] = join;
+        addPred(b->ir, join, head);
+    } else {
+        b->cur = elseEnd;
+        jumpTo(b, join);
+    }
+    b->cur = join;
+    for (size_t i = base; i < b->njoins; i++) {
+        JoinValue j = b->joins[i];
+        writeVariable(b, j.var, j.x == j.y ? j.x : emitPhi(b, join, j.x, j.y));
+    }
+    b->njoins = base;
+}
+
+// Seal the header of the innermost loop at the end of its body, and close the loop.
+// The incomplete phis of the header get the values at the end of the body, and
+// each variable assigned in the loop gets a phi if it has none yet. The assignments
+// of the body are undone, and the loop exits from the header with the values of its phis.
+void endLoop(IRBuilder* b, size_t mark, uint32_t firstVar) {
+    IR* ir = b->ir;
+    Loop loop = b->loops[b->nloops - 1];
+    uint32_t pass = ++b->pass;
+    size_t base = b->njoins;
+    for (uint32_t phi = ir->blocks[loop.header].phis; phi != NOVALUE && !b->failed; phi = ir->insts[phi].next) {
+        uint32_t var = ir->insts[phi].b;
+        b->marks[var] = pass;
+        ir->insts[phi].b = b->stamps[var] >= loop.gen ? b->values[var] : phi; // else unchanged in the loop
+        if (pushJoin(b, var, phi, NOVALUE) < 0) {
+            irOutOfMemory(b);
+        }
+    }
+    for (size_t i = mark; i < b->nlog && !b->failed; i++) {
+        uint32_t var = b->log[i].var;
+        if (var < firstVar && b->marks[var] != pass) { // assigned before it was read: no phi yet
+            b->marks[var] = pass;
+            uint32_t value = b->stamps[var] >= loop.gen ? b->values[var] : NOVALUE;
+            if (pushJoin(b, var, NOVALUE, value) < 0) {
+                irOutOfMemory(b);
+            }
+        }
+    }
+    while (b->nlog > mark) {
+        b->nlog--;
+        b->values[b->log[b->nlog].var] = b->log[b->nlog].old;
+        b->stamps[b->log[b->nlog].var] = b->log[b->nlog].stamp;
+    }
+    b->nloops--;
+    b->regions--;
+    for (size_t i = base; i < b->njoins && !b->failed; i++) {
+        JoinValue* j = &b->joins[i];
+        if (j->x == NOVALUE) { // the value on entry is read outside of the loop, in the enclosing ones
+            j->x = emitPhi(b, loop.header, readVariable(b, j->var), j->y);
+            if (j->x != NOVALUE && j->y == NOVALUE) {
+                ir->insts[j->x].b = j->x;
+            }
+        } else if (b->values[j->var] == j->x) { // read in the loop, the phi did not hold before it
+            b->values[j->var] = ir->insts[j->x].a;
+            b->stamps[j->var] = loopGen(b);
+        }
+        // an assignment, so that a branch around the loop joins it with the other way
+        writeVariable(b, j->var, j->x);
+    }
+    b->njoins = base;
+}
+
+// while ( condition ) statement: the condition is tested in a header block,
+// which is sealed at the end of the body (see endLoop())
+void parseWhile(IRBuilder* b) {
+    uint32_t header = startBlock(b, NOVALUE);
+    if (b->failed || reserveOne((void**)&b->loops, b->nloops, &b->loopCap, sizeof(Loop)) < 0) {
+        irOutOfMemory(b);
+        return;
+    }
+    jumpTo(b, header);
+    b->cur = header;
+    b->ir->blocks[header].kind = WhileKind;
+    b->loops[b->nloops++] = (Loop){header, ++b->gen};
+    b->regions++;
+    size_t mark = b->nlog;
+    uint32_t firstVar = (uint32_t)b->st.nsymbols;
+    parseCondition(b);
+    b->cur = startBlock(b, header);
+    if (b->failed) {
+        return;
+    }
+    b->ir->blocks[header].succs[0] = b->cur;
+    parseStatement(b);
+    if (b->failed) {
+        return;
+    }
+    jumpTo(b, header);
+    endLoop(b, mark, firstVar);
+    b->cur = startBlock(b, header);
+    if (!b->failed) {
+        b->ir->blocks[header].succs[1] = b->cur;
+    }
+}
+
+// int identifier [ = expression ] ;
+void parseDeclaration(IRBuilder* b) {
+    if (b->tok == NULL || b->tok->type != ID) {
+        irError(b, "expected an identifier", NULL);
+        return;
+    }
+    Token* t = b->tok;
+    int64_t name = internName(&b->st, t->value);
+    int64_t previous = -1;
+    int64_t sym = name < 0 ? -1 : declare(&b->st, name, t->loc, &previous);
+    if (sym == -1 || (sym >= 0 && addVariable(b, sym) < 0)) {
+        irOutOfMemory(b);
+        return;
+    } else if (sym == -2) {
+        b->failed = 1;
+        printPosition(b->lines, b->filename, t->loc, b->out);
+        fprintf(b->out, "error: %s is already declared at ", t->value);
+        printLineColumn(b->lines, b->st.symbols[previous].loc, b->out);
+        fprintf(b->out, "\n");
+        return;
+    }
+    b->tok = t->next;
+    uint32_t value = accept(b, ASSIGN) ? parseExpression(b) : getUndef(b);
+    expect(b, SEMICOLON, "expected ';'");
+    writeVariable(b, (uint32_t)sym, value);
+}
+
+// declaration | identifier = expression ; | if | while | block | ;
+// The nesting is bounded, so that the recursion cannot overflow the stack.
+void parseStatement(IRBuilder* b) {
+    Token* t = b->tok;
+    if (t == NULL) {
+        irError(b, "expected a statement", NULL);
+    } else if (b->depth == MAXNESTING) {
+        irError(b, "statement nested too deeply", NULL);
+    } else if (accept(b, TYPE)) {
+        parseDeclaration(b);
+    } else if (t->type == ID) {
+        int64_t sym = useName(b);
+        if (sym < 0) {
+            return;
+        }
+        b->tok = t->next;
+        expect(b, ASSIGN, "expected '='");
+        uint32_t value = parseExpression(b);
+        expect(b, SEMICOLON, "expected ';'");
+        writeVariable(b, (uint32_t)sym, value);
+    } else if (accept(b, IF)) {
+        b->depth++;
+        parseIf(b);
+        b->depth--;
+    } else if (accept(b, WHILE)) {
+        b->depth++;
+        parseWhile(b);
+        b->depth--;
+    } else if (t->type == LEFTBRACE) {
+        b->depth++;
+        parseBlock(b);
+        b->depth--;
+    } else if (!accept(b, SEMICOLON)) {
+        irError(b, "expected a statement", NULL);
+    }
+}
+
+// Remove the phis whose operands are all the same value (or the phi itself),
+// which the construction leaves when a variable does not change in a loop or
+// in both ways of an if. Such a phi is forwarded to that value: the phis using
+// it get that value instead, move to its list of users and are checked again.
+// A use only moves when the value it uses is removed, which is rare beyond
+// once, so this is about linear. At last, the other operands
+// are rewritten to the values they are forwarded to, and the removed phis
+// unlinked from their blocks.
+// Returns the number of phis removed, or -1 on failure.
+int64_t removeTrivialPhis(IRBuilder* b) {
+    IR* ir = b->ir;
+    size_t n = ir->ninsts;
+    uint32_t* fwd = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));     // fwd[n]: the OpUndef of getUndef()
+    uint32_t* uses = (uint32_t*)malloc(n * sizeof(uint32_t) + 1);        // uses[v]: the first use of v
+    uint32_t* nextUse = (uint32_t*)malloc(2 * n * sizeof(uint32_t) + 1); // a use is 2 * phi + operand
+    uint32_t* work = (uint32_t*)malloc(n * sizeof(uint32_t) + 1);
+    uint8_t* queued = (uint8_t*)calloc(n + 1, 1);
+    if (fwd == NULL || uses == NULL || nextUse == NULL || work == NULL || queued == NULL) {
+        free(fwd);
+        free(uses);
+        free(nextUse);
+        free(work);
+        free(queued);
+        return -1;
+    }
+    size_t nwork = 0;
+    for (size_t v = 0; v < n; v++) {
+        fwd[v] = NOVALUE;
+        uses[v] = NOVALUE;
+    }
+    fwd[n] = NOVALUE;
+    for (size_t v = 0; v < n; v++) {
+        if (ir->insts[v].op == OpPhi) {
+            uint32_t ops[2] = {ir->insts[v].a, ir->insts[v].b};
+            for (int i = 0; i < 2; i++) {
+                nextUse[2 * v + i] = uses[ops[i]];
+                uses[ops[i]] = (uint32_t)(2 * v + i);
+            }
+            work[nwork++] = (uint32_t)v;
+            queued[v] = 1;
+        }
+    }
+
+    int64_t removed = 0;
+    while (nwork > 0) {
+        uint32_t phi = work[--nwork];
+        queued[phi] = 0;
+        if (fwd[phi] != NOVALUE) {
+            continue;
+        }
+        uint32_t ops[2] = {ir->insts[phi].a, ir->insts[phi].b};
+        uint32_t same = NOVALUE;
+        int trivial = 1;
+        for (int i = 0; i < 2; i++) {
+            if (ops[i] != phi && ops[i] != same) {
+                trivial = same == NOVALUE;
+                same = ops[i];
+            }
+        }
+        if (!trivial) {
+            continue;
+        }
+        if (same == NOVALUE) { // only reachable from itself
+            same = getUndef(b);
+            if (same == NOVALUE) {
+                break;
+            }
+        }
+        fwd[phi] = same;
+        removed++;
+        uint32_t use = uses[phi];
+        while (use != NOVALUE) { // the uses of phi become uses of same
+            uint32_t next = nextUse[use];
+            uint32_t user = use / 2;
+            if (user != phi) {
+                if (use % 2 == 0) {
+                    ir->insts[user].a = same;
+                } else {
+                    ir->insts[user].b = same;
+                }
+                if (same < n) { // not the OpUndef appended by getUndef()
+                    nextUse[use] = uses[same];
+                    uses[same] = use;
+                }
+                if (!queued[user]) {
+                    queued[user] = 1;
+                    work[nwork++] = user;
+                }
+            }
+            use = next;
+        }
+        uses[phi] = NOVALUE;
+    }
+
+    // getUndef() may have appended one instruction, which is not forwarded
+    for (size_t v = 0; v < ir->ninsts; v++) {
+        Inst* in = &ir->insts[v];
+        if (in->op == OpConst || in->op == OpUndef || (v < n && fwd[v] != NOVALUE)) {
+            continue;
+        }
+        while (fwd[in->a] != NOVALUE) {
+            in->a = fwd[in->a];
+        }
+        while (fwd[in->b] != NOVALUE) {
+            in->b = fwd[in->b];
+        }
+    }
+    for (size_t i = 0; i < ir->nblocks; i++) {
+        Block* bl = &ir->blocks[i];
+        while (bl->term == BranchTerm && fwd[bl->cond] != NOVALUE) {
+            bl->cond = fwd[bl->cond];
+        }
+        uint32_t* link = &bl->phis;
+        while (*link != NOVALUE) {
+            if (fwd[*link] != NOVALUE) {
+                *link = ir->insts[*link].next;
+            } else {
+                link = &ir->insts[*link].next;
+            }
+        }
+    }
+    free(fwd);
+    free(uses);
+    free(nextUse);
+    free(work);
+    free(queued);
+    return b->failed ? -1 : removed;
+}
+
+// Build the IR of the program in a token list: int main ( ) block.
+// The syntax and name errors are printed, with the file name, to out.
+// Returns 0, or 1 after an error.
+int buildIR(IR* ir, const TokenList* list, LineIndex* lines, const char* filename, FILE* out) {
+    IRBuilder b = {0};
+    b.ir = ir;
+    b.undef = NOVALUE;
+    b.tok = list->head;
+    b.lines = lines;
+    b.filename = filename;
+    b.out = out;
+    memset(ir, 0, sizeof(IR));
+    b.cur = startBlock(&b, NOVALUE);
+    expect(&b, TYPE, "expected 'int main ( )'");
+    expect(&b, MAIN, "expected 'int main ( )'");
+    expect(&b, LEFTPAREN, "expected '('");
+    expect(&b, RIGHTPAREN, "expected ')'");
+    parseBlock(&b);
+    if (!b.failed && b.tok != NULL) {
+        irError(&b, "expected the end of the file", NULL);
+    }
+    if (!b.failed) {
+        ir->blocks[b.cur].term = ReturnTerm;
+        if (removeTrivialPhis(&b) < 0) {
+            irOutOfMemory(&b);
+        }
+    }
+    freeSymbolTable(&b.st);
+    free(b.values);
+    free(b.stamps);
+    free(b.marks);
+    free(b.slots);
+    free(b.log);
+    free(b.joins);
+    free(b.loops);
+    return b.failed;
+}
+
+// append len bytes (at most WRITEBUFSIZE)
+void writeText(Writer* w, const char* text, size_t len) {
+    if (w->len + len > WRITEBUFSIZE) {
+        flushWriter(w);
+    }
+    memcpy(w->buf + w->len, text, len);
+    w->len += len;
+}
+
+// append "    v<id> = op operands\n"
+void writeInst(const IR* ir, uint32_t v, Writer* w) {
+    const Inst* in = &ir->insts[v];
+    char line[96];
+    int n = snprintf(line, sizeof(line), "    v%u = %s", v, opNames[in->op].str);
+    if (in->op == OpConst) {
+        n += snprintf(line + n, sizeof(line) - n, " %" PRId64, ir->consts[in->a]);
+    } else if (in->op != OpUndef) {
+        n += snprintf(line + n, sizeof(line) - n, " v%u, v%u", in->a, in->b);
+    }
+    line[n++] = '\n';
+    writeText(w, line, n);
+}
+
+// Print each block: its predecessors, phis, instructions and terminator,
+// then the size of the IR.
+void printIR(const IR* ir, FILE* out) {
+    Writer w;
+    initWriter(&w, out);
+    size_t ninsts = 0, nphis = 0;
+    char line[96];
+    int n;
+    for (uint32_t i = 0; i < ir->nblocks; i++) {
+        const Block* bl = &ir->blocks[i];
+        if (bl->npreds == 2) {
+            n = snprintf(line, sizeof(line), "b%u:    ; preds b%u, b%u\n", i, bl->preds[0], bl->preds[1]);
+        } else if (bl->npreds == 1) {
+            n = snprintf(line, sizeof(line), "b%u:    ; preds b%u\n", i, bl->preds[0]);
+        } else {
+            n = snprintf(line, sizeof(line), "b%u:\n", i);
+        }
+        writeText(&w, line, n);
+        for (uint32_t v = bl->phis; v != NOVALUE; v = ir->insts[v].next, nphis++) {
+            writeInst(ir, v, &w);
+        }
+        for (uint32_t v = bl->first; v != NOVALUE; v = ir->insts[v].next, ninsts++) {
+            writeInst(ir, v, &w);
+        }
+        if (bl->term == JumpTerm) {
+            n = snprintf(line, sizeof(line), "    jump b%u\n", bl->succs[0]);
+        } else if (bl->term == BranchTerm) {
+            n = snprintf(line, sizeof(line), "    branch v%u, b%u, b%u\n", bl->cond, bl->succs[0], bl->succs[1]);
+        } else {
+            n = snprintf(line, sizeof(line), "    return\n");
+        }
+        writeText(&w, line, n);
+    }
+    flushWriter(&w);
+    fprintf(out, "IR: %zu block%s, %zu instruction%s, %zu phi%s\n", ir->nblocks, ir->nblocks == 1 ? "" : "s",
+            ninsts + nphis, ninsts + nphis == 1 ? "" : "s", nphis, nphis == 1 ? "" : "s");
+}
+
+/*===========================*/
+// Constant propagation      //
+/*===========================*/
+
+// Sparse conditional constant propagation (Wegman and Zadeck): the values are
+// evaluated on a lattice, optimistically, only in the blocks found reachable,
+// and a branch on a constant makes only one of its successors reachable.
+// Each value is lowered at most twice and each edge marked once, so this is
+// linear. An undef is not assumed to be any constant.
+
+typedef enum Lattice {
+    Unknown,  // not evaluated yet, or only from unreachable paths
+    Constant, // always the same value
+    Varying   // not a constant
+} Lattice;
+
+// What optimizeIR() eliminated
+typedef struct OptStats {
+    size_t branches;     // branches on a constant, turned into jumps
+    size_t blocks;       // unreachable blocks
+    size_t constants;    // instructions and phis replaced by a constant
+    size_t phis;         // phis left with one operand
+    size_t dead;         // instructions whose value is not used any more
+} OptStats;
+
+typedef struct SCCP {
+    IR* ir;
+    uint8_t* lattice;    // lattice[v]: Lattice
+    int64_t* values;     // values[v]: the constant, if lattice[v] is Constant
+    uint8_t* reachable;  // reachable[block]
+    uint8_t* edges;      // edges[2 * block + i]: the edge to succs[i] can be taken
+    uint32_t* start;     // the users of v: users[start[v]..start[v + 1]);
+    uint32_t* users;     // ninsts + block for the condition of a block
+    uint32_t* valueWork; // values whose lattice was lowered
+    size_t nvalueWork;
+    uint32_t* blockWork; // blocks found reachable
+    size_t nblockWork;
+} SCCP;
+
+void freeSCCP(SCCP* s) {
+    free(s->lattice);
+    free(s->values);
+    free(s->reachable);
+    free(s->edges);
+    free(s->start);
+    free(s->users);
+    free(s->valueWork);
+    free(s->blockWork);
+}
+
+// Returns 0, or -1 on failure.
+int initSCCP(SCCP* s, IR* ir) {
+    size_t n = ir->ninsts, nb = ir->nblocks;
+    memset(s, 0, sizeof(SCCP));
+    s->ir = ir;
+    s->lattice = (uint8_t*)calloc(n + 1, 1);
+    s->values = (int64_t*)calloc(n + 1, sizeof(int64_t));
+    s->reachable = (uint8_t*)calloc(nb + 1, 1);
+    s->edges = (uint8_t*)calloc(2 * nb + 1, 1);
+    s->start = (uint32_t*)calloc(n + 2, sizeof(uint32_t));
+    s->users = (uint32_t*)malloc((2 * n + nb + 1) * sizeof(uint32_t));
+    s->valueWork = (uint32_t*)malloc((2 * n + 1) * sizeof(uint32_t));
+    s->blockWork = (uint32_t*)malloc((nb + 1) * sizeof(uint32_t));
+    if (s->lattice == NULL || s->values == NULL || s->reachable == NULL || s->edges == NULL
+        || s->start == NULL || s->users == NULL || s->valueWork == NULL || s->blockWork == NULL) {
+        freeSCCP(s);
+        return -1;
+    }
+    // count the uses of each value, then place the users (the phis unlinked
+    // by removeTrivialPhis() are not in the lists of the blocks)
+    for (int fill = 0; fill < 2; fill++) {
+        for (uint32_t i = 0; i < nb; i++) {
+            Block* bl = &ir->blocks[i];
+            for (int list = 0; list < 2; list++) {
+                for (uint32_t v = list == 0 ? bl->phis : bl->first; v != NOVALUE; v = ir->insts[v].next) {
+                    Inst* in = &ir->insts[v];
+                    if (in->op == OpConst || in->op == OpUndef) {
+                        continue;
+                    }
+                    if (fill) {
+                        s->users[--s->start[in->a]] = v;
+                        s->users[--s->start[in->b]] = v;
+                    } else {
+                        s->start[in->a]++;
+                        s->start[in->b]++;
+                    }
+                }
+            }
+            if (bl->term == BranchTerm) {
+                if (fill) {
+                    s->users[--s->start[bl->cond]] = (uint32_t)n + i;
+                } else {
+                    s->start[bl->cond]++;
+                }
+            }
+        }
+        for (size_t v = 0, sum = 0; !fill && v <= n; v++) {
+            sum += s->start[v];
+            s->start[v] = (uint32_t)sum;
+        }
+    }
+    return 0;
+}
+
+// Lower the lattice of v to state (it is never raised), and queue its users.
+void lower(SCCP* s, uint32_t v, Lattice state, int64_t value) {
+    Lattice old = (Lattice)s->lattice[v];
+    if (state == Constant && old == Constant && s->values[v] != value) {
+        state = Varying; // two different constants
+    }
+    if (state <= old) {
+        return;
+    }
+    s->lattice[v] = (uint8_t)state;
+    s->values[v] = value;
+    s->valueWork[s->nvalueWork++] = v;
+}
+
+// Evaluate an instruction (or phi) of a reachable block.
+void visitInst(SCCP* s, uint32_t v) {
+    IR* ir = s->ir;
+    const Inst* in = &ir->insts[v];
+    if (in->op == OpConst) {
+        lower(s, v, Constant, ir->consts[in->a]);
+        return;
+    } else if (in->op == OpUndef) {
+        lower(s, v, Varying, 0);
+        return;
+    } else if (in->op == OpPhi) { // the meet of the operands coming from the edges taken
+        const Block* bl = &ir->blocks[in->block];
+        Lattice state = Unknown;
+        int64_t value = 0;
+        for (int i = 0; i < bl->npreds; i++) {
+            uint32_t pred = bl->preds[i];
+            uint32_t x = i == 0 ? in->a : in->b;
+            int slot = ir->blocks[pred].succs[0] == in->block ? 0 : 1;
+            if (!s->edges[2 * pred + slot] || s->lattice[x] == Unknown) {
+                continue;
+            }
+            if (s->lattice[x] == Varying || (state == Constant && s->values[x] != value)) {
+                state = Varying;
+                break;
+            }
+            state = Constant;
+            value = s->values[x];
+        }
+        if (state != Unknown) {
+            lower(s, v, state, value);
+        }
+        return;
+    }
+    uint8_t la = s->lattice[in->a], lb = s->lattice[in->b];
+    uint64_t x = (uint64_t)s->values[in->a], y = (uint64_t)s->values[in->b];
+    if (in->a == in->b && in->op != OpAdd) { // x - x, x == x and so on do not depend on x
+        la = lb = Constant;
+        x = y = 0;
+    }
+    if (la == Varying || lb == Varying) {
+        lower(s, v, Varying, 0);
+        return;
+    } else if (la == Unknown || lb == Unknown) {
+        return;
+    }
+    int64_t sx = (int64_t)x, sy = (int64_t)y;
+    int64_t value;
+    switch (in->op) {
+        case OpAdd: value = (int64_t)(x + y); break; // wraps around
+        case OpSub: value = (int64_t)(x - y); break;
+        case OpEq: value = sx == sy; break;
+        case OpLt: value = sx < sy; break;
+        case OpLe: value = sx <= sy; break;
+        case OpGt: value = sx > sy; break;
+        default: value = sx >= sy; break;
+    }
+    lower(s, v, Constant, value);
+}
+
+void markEdge(SCCP* s, uint32_t block, int slot) {
+    IR* ir = s->ir;
+    if (s->edges[2 * block + slot]) {
+        return;
+    }
+    s->edges[2 * block + slot] = 1;
+    uint32_t succ = ir->blocks[block].succs[slot];
+    if (!s->reachable[succ]) {
+        s->reachable[succ] = 1;
+        s->blockWork[s->nblockWork++] = succ;
+    } else { // a new operand for the phis
+        for (uint32_t v = ir->blocks[succ].phis; v != NOVALUE; v = ir->insts[v].next) {
+            visitInst(s, v);
+        }
+    }
+}
+
+// Mark the edges that the terminator of a reachable block can take.
+void visitTerminator(SCCP* s, uint32_t block) {
+    const Block* bl = &s->ir->blocks[block];
+    if (bl->term == JumpTerm) {
+        markEdge(s, block, 0);
+    } else if (bl->term == BranchTerm) {
+        uint8_t state = s->lattice[bl->cond];
+        if (state == Varying || (state == Constant && s->values[bl->cond] != 0)) {
+            markEdge(s, block, 0);
+        }
+        if (state == Varying || (state == Constant && s->values[bl->cond] == 0)) {
+            markEdge(s, block, 1);
+        }
+    }
+}
+
+void propagate(SCCP* s) {
+    IR* ir = s->ir;
+    s->reachable[0] = 1;
+    s->blockWork[s->nblockWork++] = 0;
+    while (s->nblockWork > 0 || s->nvalueWork > 0) {
+        if (s->nblockWork > 0) {
+            uint32_t block = s->blockWork[--s->nblockWork];
+            const Block* bl = &ir->blocks[block];
+            for (uint32_t v = bl->phis; v != NOVALUE; v = ir->insts[v].next) {
+                visitInst(s, v);
+            }
+            for (uint32_t v = bl->first; v != NOVALUE; v = ir->insts[v].next) {
+                visitInst(s, v);
+            }
+            visitTerminator(s, block);
+            continue;
+        }
+        uint32_t v = s->valueWork[--s->nvalueWork];
+        for (uint32_t i = s->start[v]; i < s->start[v + 1]; i++) {
+            uint32_t user = s->users[i];
+            if (user >= ir->ninsts) {
+                if (s->reachable[user - ir->ninsts]) {
+                    visitTerminator(s, user - (uint32_t)ir->ninsts);
+                }
+            } else if (s->reachable[ir->insts[user].block]) {
+                visitInst(s, user);
+            }
+        }
+    }
+}
+
+// Remove the edge from pred to block, with the operand of the phis coming from it.
+void removePred(IR* ir, uint32_t block, uint32_t pred) {
+    Block* bl = &ir->blocks[block];
+    if (bl->npreds == 2 && bl->preds[0] == pred) {
+        bl->preds[0] = bl->preds[1];
+        for (uint32_t v = bl->phis; v != NOVALUE; v = ir->insts[v].next) {
+            ir->insts[v].a = ir->insts[v].b;
+        }
+    }
+    bl->npreds--;
+    bl->preds[bl->npreds] = NOVALUE;
+    for (uint32_t v = bl->phis; v != NOVALUE; v = ir->insts[v].next) {
+        ir->insts[v].b = NOVALUE;
+    }
+}
+
+// Print where the branch of a block on a constant was folded.
+void reportBranch(const Block* bl, int taken, LineIndex* lines, const char* filename, FILE* out) {
+    printPosition(lines, filename, bl->loc, out);
+    if (bl->kind == WhileKind) {
+        fprintf(out, "the while condition is always %s, %s\n", taken ? "true" : "false",
+                taken ? "the loop never exits" : "the loop body is removed");
+    } else if (taken) {
+        fprintf(out, "the if condition is always true%s\n",
+                bl->kind == IfElseKind ? ", the else branch is removed" : "");
+    } else {
+        fprintf(out, "the if condition is always false, the then branch is removed\n");
+    }
+}
+
+// Optimize the IR with SCCP: the values found constant are replaced by
+// constants, the branches on a constant by jumps, the unreachable blocks are
+// removed, then the phis left with one operand and the values no longer used.
+// The folded branches are printed with their position. Returns 0, or -1 on failure.
+int optimizeIR(IR* ir, OptStats* stats, LineIndex* lines, const char* filename, FILE* out) {
+    SCCP s;
+    memset(stats, 0, sizeof(OptStats));
+    if (initSCCP(&s, ir) < 0) {
+        return -1;
+    }
+    propagate(&s);
+
+    size_t n = ir->ninsts;
+    uint32_t* fwd = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    uint32_t* uses = (uint32_t*)calloc(n + 1, sizeof(uint32_t));
+    uint32_t* renumber = (uint32_t*)malloc((ir->nblocks + 1) * sizeof(uint32_t));
+    if (fwd == NULL || uses == NULL || renumber == NULL) {
+        free(fwd);
+        free(uses);
+        free(renumber);
+        freeSCCP(&s);
+        return -1;
+    }
+    for (size_t v = 0; v < n; v++) {
+        fwd[v] = NOVALUE;
+    }
+
+    // the branches on a constant, then the edges out of unreachable blocks
+    for (uint32_t i = 0; i < ir->nblocks; i++) {
+        Block* bl = &ir->blocks[i];
+        if (s.reachable[i] && bl->term == BranchTerm && s.lattice[bl->cond] == Constant) {
+            int taken = s.values[bl->cond] != 0;
+            reportBranch(bl, taken, lines, filename, out);
+            removePred(ir, bl->succs[taken], i);
+            bl->term = JumpTerm;
+            bl->succs[0] = bl->succs[!taken];
+            bl->succs[1] = NOVALUE;
+            stats->branches++;
+        }
+    }
+    for (uint32_t i = 0; i < ir->nblocks; i++) {
+        Block* bl = &ir->blocks[i];
+        if (s.reachable[i]) {
+            continue;
+        }
+        stats->blocks++;
+        for (int k = 0; k < 2 && bl->term != ReturnTerm; k++) {
+            if (bl->succs[k] != NOVALUE && s.reachable[bl->succs[k]]) {
+                removePred(ir, bl->succs[k], i);
+            }
+        }
+    }
+
+    // the constants, and the phis left with one operand
+    for (uint32_t i = 0; i < ir->nblocks; i++) {
+        Block* bl = &ir->blocks[i];
+        if (!s.reachable[i]) {
+            continue;
+        }
+        uint32_t phi = bl->phis;
+        bl->phis = NOVALUE;
+        while (phi != NOVALUE) {
+            Inst* in = &ir->insts[phi];
+            uint32_t next = in->next;
+            if (s.lattice[phi] == Constant || bl->npreds == 1) {
+                if (s.lattice[phi] != Constant) {
+                    fwd[phi] = in->a;
+                    stats->phis++;
+                } else {
+                    in->next = bl->first; // a constant comes first
+                    bl->first = phi;
+                    if (bl->last == NOVALUE) {
+                        bl->last = phi;
+                    }
+                }
+            } else {
+                in->next = bl->phis;
+                bl->phis = phi;
+            }
+            phi = next;
+        }
+        for (uint32_t v = bl->first; v != NOVALUE; v = ir->insts[v].next) {
+            Inst* in = &ir->insts[v];
+            if (s.lattice[v] == Constant && in->op != OpConst) {
+                if (reserveOne((void**)&ir->consts, ir->nconsts, &ir->constCap, sizeof(int64_t)) < 0) {
+                    free(fwd);
+                    free(uses);
+                    free(renumber);
+                    freeSCCP(&s);
+                    return -1;
+                }
+                ir->consts[ir->nconsts] = s.values[v];
+                in->op = OpConst;
+                in->a = (uint32_t)ir->nconsts++;
+                in->b = NOVALUE;
+                stats->constants++;
+            }
+        }
+    }
+
+    // forward the operands, count the uses, and remove the values without any
+    // (nothing else has effects), which may leave their operands without any
+    uint32_t* work = s.valueWork; // large enough for each value once
+    size_t nwork = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < ir->nblocks; i++) {
+            Block* bl = &ir->blocks[i];
+            if (!s.reachable[i]) {
+                continue;
+            }
+            for (int list = 0; list < 2; list++) {
+                for (uint32_t v = list == 0 ? bl->phis : bl->first; v != NOVALUE; v = ir->insts[v].next) {
+                    Inst* in = &ir->insts[v];
+                    if (pass == 1) {
+                        if (uses[v] == 0) {
+                            work[nwork++] = v;
+                        }
+                        continue;
+                    } else if (in->op == OpConst || in->op == OpUndef) {
+                        continue;
+                    }
+                    while (fwd[in->a] != NOVALUE) {
+                        in->a = fwd[in->a];
+                    }
+                    uses[in->a]++;
+                    if (in->b != NOVALUE) {
+                        while (fwd[in->b] != NOVALUE) {
+                            in->b = fwd[in->b];
+                        }
+                        uses[in->b]++;
+                    }
+                }
+            }
+            if (pass == 0 && bl->term == BranchTerm) {
+                while (fwd[bl->cond] != NOVALUE) {
+                    bl->cond = fwd[bl->cond];
+                }
+                uses[bl->cond]++;
+            }
+        }
+    }
+    uint8_t* dead = s.lattice; // the lattice is not needed any more
+    memset(dead, 0, n);
+    while (nwork > 0) {
+        uint32_t v = work[--nwork];
+        Inst* in = &ir->insts[v];
+        dead[v] = 1;
+        stats->dead++;
+        if (in->op == OpConst || in->op == OpUndef) {
+            continue;
+        }
+        if (--uses[in->a] == 0 && in->a != v) {
+            work[nwork++] = in->a;
+        }
+        if (in->b != NOVALUE && --uses[in->b] == 0 && in->b != v) {
+            work[nwork++] = in->b;
+        }
+    }
+
+    // unlink the dead values and number the blocks left in order
+    uint32_t nblocks = 0;
+    for (uint32_t i = 0; i < ir->nblocks; i++) {
+        renumber[i] = s.reachable[i] ? nblocks++ : NOVALUE;
+    }
+    for (uint32_t i = 0; i < ir->nblocks; i++) {
+        if (!s.reachable[i]) {
+            continue;
+        }
+        Block bl = ir->blocks[i];
+        for (int list = 0; list < 2; list++) {
+            uint32_t* link = list == 0 ? &bl.phis : &bl.first;
+            bl.last = NOVALUE;
+            while (*link != NOVALUE) {
+                if (dead[*link]) {
+                    *link = ir->insts[*link].next;
+                } else {
+                    ir->insts[*link].block = renumber[i];
+                    bl.last = *link;
+                    link = &ir->insts[*link].next;
+                }
+            }
+        }
+        for (int k = 0; k < 2; k++) {
+            bl.preds[k] = k < bl.npreds ? renumber[bl.preds[k]] : NOVALUE;
+            bl.succs[k] = bl.succs[k] != NOVALUE ? renumber[bl.succs[k]] : NOVALUE;
+        }
+        ir->blocks[renumber[i]] = bl;
+    }
+    ir->nblocks = nblocks;
+    free(fwd);
+    free(uses);
+    free(renumber);
+    freeSCCP(&s);
+    return 0;
+}
+
+// Build the IR of a token list, optimize it if asked, and print it.
+// Returns 0, or 1 after an error.
+int compileProgram(const TokenList* list, int optimize, LineIndex* lines, const char* filename, FILE* out) {
+    IR ir;
+    OptStats stats;
+    int result = buildIR(&ir, list, lines, filename, out);
+    if (result == 0 && optimize && optimizeIR(&ir, &stats, lines, filename, out) < 0) {
+        fprintf(out, "Error: memory allocation failed\n");
+        result = 1;
+    }
+    if (result == 0) {
+        printIR(&ir, out);
+    }
+    if (result == 0 && optimize) {
+        fprintf(out, "SCCP: %zu branch%s folded, %zu unreachable block%s, %zu constant%s, "
+                "%zu phi%s with one operand and %zu dead value%s removed\n",
+                stats.branches, stats.branches == 1 ? "" : "es", stats.blocks, stats.blocks == 1 ? "" : "s",
+                stats.constants, stats.constants == 1 ? "" : "s", stats.phis, stats.phis == 1 ? "" : "s",
+                stats.dead, stats.dead == 1 ? "" : "s");
+    }
+    freeIR(&ir);
+    return result;
+}
+
+/*===========================*/
+// Driver                    //
+/*===========================*/
+
+// Read a whole file into a memory cache terminated by EOFF.
+// Returns NULL on failure, after printing the reason to out.
+unsigned char* readFile(const char* filename, size_t* size, FILE* out) {
+    // estimate the file size
+    FILE* fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(out, "Error: file %s not found\n", filename);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    size_t fileSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    // Allocate a memory cache which the entire file content is to read into.
+    unsigned char* content = (unsigned char*)malloc(fileSize + 1);
+    if (content == NULL) {
+        fprintf(out, "Error: memory allocation failed\n");
+        fclose(fp);
+        return NULL;
+    }
+    size_t bytesRead = fread(content, 1, fileSize, fp);
+    if (bytesRead != fileSize) {
+        fprintf(out, "Error: read %zu bytes, but expected %zu bytes\n", bytesRead, fileSize);
+        free(content);
+        fclose(fp);
+        return NULL;
+    }
+    content[fileSize] = EOFF; // add a redefined EOF terminator to the end of the content
+
+    fclose(fp);
+    *size = fileSize;
+    return content;
+}
+
+// TokenSink callback which only counts the tokens, ctx is a size_t*
+void countTokens(void* ctx, const TokenRef* tokens, int n) {
+    (void)tokens;
+    *(size_t*)ctx += n;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#if DFASTATS == YES
+    const char* phaseNames[NPHASES] = {"read", "scan", "print", "cache"};
+
+    // Dump the counters of a scan to stderr, one record of space-separated fields per line,
+    // without the zero counts (all lines of a file are written at once, even in batch mode):
+    //   file <filename>
+    //   phase <name> <seconds>
+    //   state <state> <visits>
+    //   transition <from> <to> <count>
+    //   token <type> <count> <bytes>
+    //   length <bytes> <count>        (BUFFERSIZE for longer tokens)
+    void printProfile(const Profile* prof, const char* filename) {
+        flockfile(stderr);
+        fprintf(stderr, "file %s\n", filename);
+        for (int p = 0; p < NPHASES; p++) {
+            fprintf(stderr, "phase %s %.9f\n", phaseNames[p], prof->phases[p]);
+        }
+        for (int i = 0; i <= ERROR_STATE; i++) {
+            if (prof->visits[i] > 0) {
+                fprintf(stderr, "state %d %zu\n", i, prof->visits[i]);
+            }
+        }
+        for (int i = 0; i <= ERROR_STATE; i++) {
+            for (int j = 0; j <= ERROR_STATE; j++) {
+                if (prof->transitions[i][j] > 0) {
+                    fprintf(stderr, "transition %d %d %zu\n", i, j, prof->transitions[i][j]);
+                }
+            }
+        }
+        for (int t = TYPE; t <= RIGHTBRACE; t++) {
+            if (prof->tokens[t] > 0) {
+                fprintf(stderr, "token %s %zu %zu\n", tokenNames[t].str, prof->tokens[t], prof->tokenBytes[t]);
+            }
+        }
+        for (int i = 0; i <= BUFFERSIZE; i++) {
+            if (prof->lengths[i] > 0) {
+                fprintf(stderr, "length %d %zu\n", i, prof->lengths[i]);
+            }
+        }
+        funlockfile(stderr);
+    }
+#endif
+
+// Scan one file and print its token list (or statistics) to out.
+// With useCache, the token list comes from the cache of the file if it is valid,
+// and the cache is written otherwise; statistics and the later stages always need a scan.
+// With recover, the scan goes on after lexical errors, which are all printed at the end.
+// With positions, the tokens and the error are printed with their line and column.
+// Past ScanStage, the tokens go on through the later stages, which print instead of them.
+// bytes and tokens are set for throughput reports.
+// Returns 0 on success, 1 on failure.
+int scanFile(const char* filename, int useStats, int useCache, int recover, int positions, Stage stage, int nthreads, FILE* out, size_t* bytes, size_t* tokens) {
+    size_t fileSize = 0;
+    *bytes = 0;
+    *tokens = 0;
+    #if DFASTATS == YES
+        double mark = now(); // start of the current phase
+    #endif
+    unsigned char* content = readFile(filename, &fileSize, out);
+    if (content == NULL) {
+        return 1;
+    }
+    #if DFASTATS == YES
+        double readTime = now() - mark;
+    #endif
+
+    useCache = useCache && !useStats && stage == ScanStage;
+    uint64_t hash = useCache ? hashContent(content, fileSize) : 0;
+    TokenCache tc;
+    if (useCache && openTokenCache(&tc, filename, hash, fileSize, recover) == 0) {
+        LineIndex lines; // built only if a position is printed
+        initLineIndex(&lines, content, fileSize);
+        int result = tc.header->result;
+        if (result != 0) {
+            if (positions) {
+                printPosition(&lines, filename, tc.header->errLoc, out);
+            }
+            Lexer lx; // printError() only needs the error
+            lx.errState = tc.header->errState;
+            lx.errChar = (unsigned char)tc.header->errChar;
+            printError(&lx, out);
+        } else {
+            printTokenCache(&tc, positions ? &lines : NULL, out);
+        }
+        if (tc.header->ndiags > 0) {
+            printCacheDiagnostics(&tc, &lines, filename, out);
+            result = 1;
+        }
+        freeLineIndex(&lines);
+        *bytes = fileSize;
+        *tokens = tc.header->ntokens;
+        closeTokenCache(&tc);
+        free(content);
+        return result;
+    }
+
+    Lexer lx;
+    initLexer(&lx, content, useStats);
+    lx.recover = recover;
+    // The statistics are collected by the scanner itself, so a single-threaded
+    // scan for them does not need to keep the tokens: they go to a counting sink.
+    TokenSink* sink = NULL;
+    size_t counted = 0;
+    if (useStats && nthreads <= 1) {
+        sink = (TokenSink*)malloc(sizeof(TokenSink));
+        if (sink != NULL) {
+            sink->push = countTokens;
+            sink->ctx = &counted;
+            sink->n = 0;
+            lx.sink = sink;
+        }
+    }
+
+    #if DFASTATS == YES
+        lx.prof.phases[ReadPhase] = readTime;
+        mark = now();
+    #endif
+    int result = nthreads > 1 ? parallelScanner(&lx, fileSize, nthreads) : scanner(&lx);
+    #if DFASTATS == YES
+        lx.prof.phases[ScanPhase] = now() - mark;
+        mark = now();
+    #endif
+    int scanned = result; // what the cache keeps, the diagnostics are kept apart
+    LineIndex lines; // built only if a position is printed
+    initLineIndex(&lines, content, fileSize);
+    if (result != 0) {
+        if (positions) {
+            printPosition(&lines, filename, lx.errLoc, out);
+        }
+        printError(&lx, out);
+    } else if (useStats) {
+        printStats(&lx, out);
+    } else if (stage == NamesStage) {
+        result = resolveNames(&lx.tklist, &lines, filename, out) != 0;
+    } else if (stage >= IRStage) {
+        result = compileProgram(&lx.tklist, stage == OptStage, &lines, filename, out);
+    } else {
+        printTokenList(&lx.tklist, positions ? &lines : NULL, out); // print the token list
+    }
+    if (lx.ndiags > 0) {
+        printDiagnostics(&lx, &lines, filename, out);
+        result = 1;
+    }
+    freeLineIndex(&lines);
+    #if DFASTATS == YES
+        lx.prof.phases[PrintPhase] = now() - mark;
+        mark = now();
+    #endif
+    if (useCache) {
+        writeTokenCache(filename, &lx, scanned, hash, fileSize);
+    }
+    #if DFASTATS == YES
+        lx.prof.phases[CachePhase] = now() - mark;
+        printProfile(&lx.prof, filename);
+    #endif
+    *bytes = fileSize;
+    *tokens = sink != NULL ? counted : (size_t)lx.tklist.size;
+
+    free(sink);
+    free(lx.diags);
+    free(content); // free the memory cache
+    freeTokenList(&lx.tklist); // free the token list
+    return result;
+}
+
+// Scan a file into a TokenBuffer, then apply the edits "offset:deleted:text" one by one,
+// and print the final token list (or the lexical error) to out. Only the tokens around
+// each edit are scanned again; the work done for each edit is reported to err.
+// Returns 0 on success, 1 on failure.
+int editFile(const char* filename, char** edits, int nedits, FILE* out, FILE* err) {
+    size_t fileSize = 0;
+    unsigned char* content = readFile(filename, &fileSize, out);
+    if (content == NULL) {
+        return 1;
+    }
+    TokenBuffer* tb = newTokenBuffer(content, fileSize);
+    free(content);
+    if (tb == NULL) {
+        fprintf(err, "Error: memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < nedits; i++) {
+        size_t off, del;
+        int n = 0;
+        sscanf(edits[i], "%zu:%zu:%n", &off, &del, &n);
+        size_t insLen = n > 0 ? strlen(edits[i] + n) : 0;
+        double start = now();
+        int state = n > 0 ? editTokenBuffer(tb, off, del, (const unsigned char*)edits[i] + n, insLen) : -1;
+        if (state < 0) {
+            fprintf(err, "Error: invalid edit %s\n", edits[i]);
+            freeTokenBuffer(tb);
+            return 1;
+        }
+        // an edit may bring in a lexical error or fix it, so the edits go on after one
+        fprintf(err, "Edit %s: %d tokens scanned again, %d tokens%s, %.3f ms\n",
+                edits[i], tb->relexed, tbCount(tb), state != 0 ? ", lexical error" : "",
+                (now() - start) * 1e3);
+    }
+    int result = tb->errPos != NOERROR;
+    if (result != 0) {
+        tbPrintError(tb, out);
+    } else {
+        tbPrintTokens(tb, out);
+    }
+    freeTokenBuffer(tb);
+    return result;
+}
+
+/*===========================*/
+// Batch mode                //
+/*===========================*/
+
+// One file of a batch. The output is kept in memory until the whole batch
+// is done, so that it is printed in the order of the files on the command line.
+typedef struct Job {
+    const char* filename;
+    char* out;       // output of the file, from open_memstream()
+    size_t outSize;
+    int result;      // return value of scanFile()
+    size_t bytes;    // size of the file
+    size_t tokens;   // number of tokens
+    double seconds;  // time spent on the file
+} Job;
+
+// Work stealing: each worker owns a range of jobs and takes them from the front.
+// A worker whose range is empty steals the back half of another worker's range.
+typedef struct Worker {
+    pthread_mutex_t lock;
+    int lo, hi;      // jobs [lo, hi) are not started yet
+    pthread_t thread;
+    struct Pool* pool;
+    int id;
+} Worker;
+
+typedef struct Pool {
+    Job* jobs;
+    Worker* workers;
+    int nworkers;
+    int useStats;
+    int useCache;
+    int recover;
+    int positions;
+    Stage stage;
+} Pool;
+
+// take the next job of a worker, stealing if needed; returns -1 if there is none left
+int nextJob(Worker* w) {
+    Pool* pool = w->pool;
+    int job = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->lo < w->hi) {
+        job = w->lo++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 1; job < 0 && i < pool->nworkers; i++) {
+        Worker* victim = &pool->workers[(w->id + i) % pool->nworkers];
+        int lo = 0, hi = 0;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->lo < victim->hi) {
+            lo = victim->lo + (victim->hi - victim->lo) / 2; // the victim keeps the front half
+            hi = victim->hi;
+            victim->hi = lo;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (lo < hi) {
+            pthread_mutex_lock(&w->lock);
+            job = lo;
+            w->lo = lo + 1;
+            w->hi = hi;
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return job;
+}
+
+void* runWorker(void* arg) {
+    Worker* w = (Worker*)arg;
+    int i;
+    while ((i = nextJob(w)) >= 0) {
+        Job* job = &w->pool->jobs[i];
+        double start = now();
+        FILE* out = open_memstream(&job->out, &job->outSize);
+        if (out == NULL) {
+            job->result = 1;
+            continue;
+        }
+        job->result = scanFile(job->filename, w->pool->useStats, w->pool->useCache, w->pool->recover, w->pool->positions, w->pool->stage, 1, out, &job->bytes, &job->tokens);
+        fclose(out);
+        job->seconds = now() - start;
+    }
+    return NULL;
+}
+
+// Scan all files with nworkers threads, print the outputs in order to stdout
+// and the throughput of each file and of the whole batch to stderr.
+// Returns 0 if all files were scanned successfully.
+int runBatch(const char** files, int nfiles, int nworkers, int useStats, int useCache, int recover, int positions, Stage stage) {
+    Job* jobs = (Job*)calloc(nfiles, sizeof(Job));
+    if (nworkers > nfiles) {
+        nworkers = nfiles;
+    }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    Worker* workers = (Worker*)calloc(nworkers, sizeof(Worker));
+    if (jobs == NULL || workers == NULL) {
+        printf("Error: memory allocation failed\n");
+        free(jobs);
+        free(workers);
+        return 1;
+    }
+    Pool pool = {jobs, workers, nworkers, useStats, useCache, recover, positions, stage};
+    for (int i = 0; i < nfiles; i++) {
+        jobs[i].filename = files[i];
+    }
+    for (int i = 0; i < nworkers; i++) { // contiguous ranges, stealing evens out the rest
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].lo = (int)((long long)nfiles * i / nworkers);
+        workers[i].hi = (int)((long long)nfiles * (i + 1) / nworkers);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    double start = now();
+    int started = 1;
+    for (; started < nworkers; started++) { // worker 0 is this thread
+        if (pthread_create(&workers[started].thread, NULL, runWorker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    runWorker(&workers[0]); // also does the jobs of workers that could not be started
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = now() - start;
+
+    int failed = 0;
+    size_t bytes = 0, tokens = 0;
+    for (int i = 0; i < nfiles; i++) {
+        printf("==> %s <==\n", jobs[i].filename);
+        if (jobs[i].out != NULL) {
+            fwrite(jobs[i].out, 1, jobs[i].outSize, stdout);
+            free(jobs[i].out);
+        }
+        fprintf(stderr, "%s: %zu bytes, %zu tokens, %.3f ms, %.2f MB/s%s\n", jobs[i].filename,
+                jobs[i].bytes, jobs[i].tokens, jobs[i].seconds * 1e3,
+                jobs[i].seconds > 0 ? jobs[i].bytes / jobs[i].seconds / 1e6 : 0.0,
+                jobs[i].result != 0 ? " (failed)" : "");
+        failed += jobs[i].result != 0;
+        bytes += jobs[i].bytes;
+        tokens += jobs[i].tokens;
+    }
+    fprintf(stderr, "Total: %d files (%d failed), %zu bytes, %zu tokens, %.3f s, %d threads\n",
+            nfiles, failed, bytes, tokens, seconds, nworkers);
+    if (seconds > 0) {
+        fprintf(stderr, "Throughput: %.2f MB/s, %.0f tokens/s, %.0f files/s\n",
+                bytes / seconds / 1e6, tokens / seconds, nfiles / seconds);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    free(workers);
+    free(jobs);
+    return failed != 0;
+}
+
+// Read the file names of a manifest, one per line; empty lines and lines starting with # are skipped.
+// Returns the number of names added to *files (grown with realloc), or -1 on failure.
+int readManifest(const char* manifest, char*** files, int* nfiles, int* cap) {
+    FILE* fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        printf("Error: file %s not found\n", manifest);
+        return -1;
+    }
+    char* line = NULL;
+    size_t lineCap = 0;
+    ssize_t n;
+    int added = 0;
+    while ((n = getline(&line, &lineCap, fp)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+        if (n == 0 || line[0] == '#') {
+            continue;
+        }
+        if (*nfiles == *cap) {
+            int newCap = *cap == 0 ? 64 : *cap * 2;
+            char** tmp = (char**)realloc(*files, sizeof(char*) * newCap);
+            if (tmp == NULL) {
+                break;
+            }
+            *files = tmp;
+            *cap = newCap;
+        }
+        (*files)[(*nfiles)++] = strdup(line);
+        added++;
+    }
+    free(line);
+    fclose(fp);
+    return added;
+}
+
+/*===========================*/
+// Benchmark                 //
+/*===========================*/
+
+// xorshift64*, so that a seed always generates the same program
+uint64_t nextRandom(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// A random valid program written by generateProgram()
+typedef struct Generator {
+    Writer w;
+    size_t written;   // number of bytes written so far
+    size_t size;      // statements are added until this many bytes are written
+    int depth;        // maximal nesting of blocks and parentheses
+    int idents;       // number of distinct identifiers
+    double* cdf;      // cdf[k]: probability of picking an identifier <= k, NULL for a uniform pick
+    uint64_t rng;
+} Generator;
+
+void genWrite(Generator* g, const char* str, size_t len) {
+    if (g->w.len + len > WRITEBUFSIZE) {
+        flushWriter(&g->w);
+    }
+    memcpy(g->w.buf + g->w.len, str, len);
+    g->w.len += len;
+    g->written += len;
+}
+
+#define GENSTR(g, s) genWrite(g, s, sizeof(s) - 1)
+
+// a random identifier number, uniform or by the table of generateProgram()
+uint64_t genPick(Generator* g) {
+    if (g->cdf == NULL) {
+        return nextRandom(&g->rng) % (uint64_t)g->idents;
+    }
+    double u = (double)(nextRandom(&g->rng) >> 11) * 0x1.0p-53; // in [0, 1)
+    size_t lo = 0, hi = (size_t)g->idents - 1; // the first k with u < cdf[k] is in [lo, hi]
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (u < g->cdf[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// Identifier k is "v" followed by k in base 26 (letters only, never a keyword).
+void genName(Generator* g, uint64_t k) {
+    char name[16];
+    int n = 0;
+    name[n++] = 'v';
+    do {
+        name[n++] = 'a' + k % 26;
+        k /= 26;
+    } while (k > 0);
+    genWrite(g, name, n);
+}
+
+void genIdent(Generator* g) {
+    genName(g, genPick(g));
+}
+
+void genLiteral(Generator* g) {
+    char digits[24];
+    int n = sprintf(digits, "%u", (unsigned)(nextRandom(&g->rng) % 1000000));
+    genWrite(g, digits, n);
+}
+
+// term { ( + | - ) term }, where a term is an identifier, a literal or ( expr )
+void genExpr(Generator* g, int depth) {
+    int terms = 1 + (int)(nextRandom(&g->rng) % 3);
+    for (int i = 0; i < terms; i++) {
+        if (i > 0) {
+            if (nextRandom(&g->rng) % 2 == 0) GENSTR(g, " + ");
+            else GENSTR(g, " - ");
+        }
+        uint64_t r = nextRandom(&g->rng) % 8;
+        if (r == 0 && depth < g->depth) {
+            GENSTR(g, "( ");
+            genExpr(g, depth + 1);
+            GENSTR(g, " )");
+        } else if (r < 5) {
+            genIdent(g);
+        } else {
+            genLiteral(g);
+        }
+    }
+}
+
+const Name genRelops[5] = {NAME(" == "), NAME(" < "), NAME(" <= "), NAME(" > "), NAME(" >= ")};
+
+void genCondition(Generator* g, int depth) {
+    genExpr(g, depth);
+    Name op = genRelops[nextRandom(&g->rng) % 5];
+    genWrite(g, op.str, op.len);
+    genExpr(g, depth);
+}
+
+void genIndent(Generator* g, int depth) {
+    for (int i = 0; i <= depth; i++) {
+        GENSTR(g, "    ");
+    }
+}
+
+void genStatement(Generator* g, int depth, uint64_t* declared, int* ndeclared);
+
+// "{", 1 to 4 statements, "}"
+void genBlock(Generator* g, int depth) {
+    GENSTR(g, "{\n");
+    uint64_t declared[4]; // identifiers declared in this block
+    int ndeclared = 0;
+    int n = 1 + (int)(nextRandom(&g->rng) % 4);
+    for (int i = 0; i < n; i++) {
+        genStatement(g, depth + 1, declared, &ndeclared);
+    }
+    genIndent(g, depth);
+    GENSTR(g, "}");
+}
+
+// The identifiers are all declared at the top of main(), so that every use
+// resolves; a block declares an identifier at most once (declared holds
+// those of the current block, NULL at the top level, which declares none).
+void genStatement(Generator* g, int depth, uint64_t* declared, int* ndeclared) {
+    genIndent(g, depth);
+    uint64_t r = nextRandom(&g->rng) % 100;
+    uint64_t k = genPick(g);
+    int fresh = declared != NULL;
+    for (int i = 0; fresh && i < *ndeclared; i++) {
+        fresh = declared[i] != k;
+    }
+    if (r < 15 && depth < g->depth) {
+        GENSTR(g, "if ( ");
+        genCondition(g, depth);
+        GENSTR(g, " ) ");
+        genBlock(g, depth);
+        if (nextRandom(&g->rng) % 2 == 0) {
+            GENSTR(g, " else ");
+            genBlock(g, depth);
+        }
+    } else if (r < 25 && depth < g->depth) {
+        GENSTR(g, "while ( ");
+        genCondition(g, depth);
+        GENSTR(g, " ) ");
+        genBlock(g, depth);
+    } else if (r < 35 && fresh) {
+        declared[(*ndeclared)++] = k;
+        GENSTR(g, "int ");
+        genName(g, k);
+        GENSTR(g, " ;");
+    } else {
+        genName(g, k);
+        GENSTR(g, " = ");
+        genExpr(g, depth);
+        GENSTR(g, " ;");
+    }
+    GENSTR(g, "\n");
+}
+
+// Write a random program of about size bytes to out, with blocks and parentheses
+// nested up to depth and idents distinct identifiers, all declared at the top of main()
+// with a literal. The same seed gives the same program.
+// With zipf > 0, identifier k is used with a probability proportional to 1 / (k + 1)^zipf
+// (Zipf's law: a few identifiers are frequent, most are rare, as in real code);
+// with zipf == 0, all are used alike.
+void generateProgram(size_t size, int depth, int idents, uint64_t seed, double zipf, FILE* out) {
+    Generator* g = (Generator*)malloc(sizeof(Generator));
+    if (g == NULL) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        return;
+    }
+    g->idents = idents < 1 ? 1 : idents;
+    g->cdf = NULL;
+    if (zipf > 0) {
+        g->cdf = (double*)malloc(sizeof(double) * g->idents);
+        if (g->cdf == NULL) {
+            fprintf(stderr, "Error: memory allocation failed\n");
+            free(g);
+            return;
+        }
+        double sum = 0;
+        for (int k = 0; k < g->idents; k++) {
+            sum += pow(k + 1, -zipf);
+            g->cdf[k] = sum;
+        }
+        for (int k = 0; k < g->idents; k++) {
+            g->cdf[k] /= sum;
+        }
+        g->cdf[g->idents - 1] = 1; // whatever the rounding, every u < 1 is below it
+    }
+    initWriter(&g->w, out);
+    g->written = 0;
+    g->size = size;
+    g->depth = depth < 0 ? 0 : depth;
+    g->rng = seed != 0 ? seed : 1; // xorshift never leaves 0
+    GENSTR(g, "int main ( ) {\n");
+    for (int k = 0; k < g->idents; k++) {
+        genIndent(g, 0);
+        GENSTR(g, "int ");
+        genName(g, (uint64_t)k);
+        GENSTR(g, " = ");
+        genLiteral(g);
+        GENSTR(g, " ;\n");
+    }
+    while (g->written < g->size) {
+        genStatement(g, 0, NULL, NULL);
+    }
+    GENSTR(g, "}\n");
+    flushWriter(&g->w);
+    free(g->cdf);
+    free(g);
+}
+
+int compareTimes(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// the p-th percentile of n sorted times (nearest rank)
+double percentile(const double* times, int n, int p) {
+    int rank = (n * p + 99) / 100;
+    return times[rank > 0 ? rank - 1 : 0];
+}
+
+// Print the median, 90th percentile and best time of a phase, and the throughput
+// at the median: bytes per second and, if unit is not NULL, items per second.
+void printPhase(const char* phase, double* times, int runs, size_t bytes, size_t items, const char* unit) {
+    qsort(times, runs, sizeof(double), compareTimes);
+    double median = percentile(times, runs, 50);
+    printf("%-6s median %9.3f ms, p90 %9.3f ms, min %9.3f ms | %8.2f MB/s",
+           phase, median * 1e3, percentile(times, runs, 90) * 1e3, times[0] * 1e3,
+           median > 0 ? bytes / median / 1e6 : 0.0);
+    if (unit != NULL) {
+        printf(", %.0f %s/s", median > 0 ? items / median : 0.0, unit);
+    }
+    printf("\n");
+}
+
+// Scan a file runs times (with nthreads threads) and print its tokens to memory each time,
+// then report the scan (input MB/s and tokens/s) and the printing (output MB/s).
+// Returns 0 on success, 1 on failure.
+int benchFile(const char* filename, int runs, int nthreads) {
+    size_t fileSize;
+    unsigned char* content = readFile(filename, &fileSize, stdout);
+    if (content == NULL) {
+        return 1;
+    }
+    double* times = (double*)malloc(sizeof(double) * runs * 2);
+    if (times == NULL) {
+        printf("Error: memory allocation failed\n");
+        free(content);
+        return 1;
+    }
+    double* scanTimes = times;
+    double* printTimes = times + runs;
+    size_t ntokens = 0, outBytes = 0;
+    int result = 0;
+    for (int i = 0; i < runs && result == 0; i++) {
+        Lexer lx;
+        initLexer(&lx, content, 0);
+        double start = now();
+        result = nthreads > 1 ? parallelScanner(&lx, fileSize, nthreads) : scanner(&lx);
+        scanTimes[i] = now() - start;
+        if (result != 0) {
+            printError(&lx, stdout);
+        } else {
+            char* buf = NULL;
+            FILE* out = open_memstream(&buf, &outBytes);
+            if (out == NULL) {
+                result = 1;
+            } else {
+                start = now();
+                printTokenList(&lx.tklist, NULL, out);
+                fflush(out);
+                printTimes[i] = now() - start;
+                fclose(out);
+                free(buf);
+            }
+        }
+        ntokens = lx.tklist.size;
+        freeTokenList(&lx.tklist);
+    }
+    if (result == 0) {
+        printf("%s: %zu bytes, %zu tokens, %d runs, %d thread%s\n",
+               filename, fileSize, ntokens, runs, nthreads, nthreads == 1 ? "" : "s");
+        printPhase("scan", scanTimes, runs, fileSize, ntokens, "tokens");
+        printPhase("print", printTimes, runs, outBytes, 0, NULL);
+    }
+    free(times);
+    free(content);
+    return result;
+}
+
+/*===========================*/
+// main()                    //
+/*===========================*/
+
+// Usage: main [-s] [-c] [-k] [-l] [-n] [-i] [-O] [-j threads] [-m manifest] [-e offset:deleted:text]... [file...]
+//        main -g size[:depth[:idents[:seed[:zipf]]]]
+//        main -b runs [-j threads] [file...]
+//   -s    print token and character statistics instead of the token list
+//   -c    print the token list from "<file>.tkc" if the file has not changed, else scan and write it
+//         (with -l and -k as well; -s, -n, -i and -O always scan)
+//   -k    keep going after a lexical error: skip the bad token and report all the errors at the end
+//   -l    print the line and column of each token and of the error
+//   -n    resolve each identifier to its declaration instead of printing the tokens,
+//         and report the undeclared and duplicate names
+//   -i    build the SSA IR of the program (int main ( ) { ... }) and print it
+//   -O    the same, after constant propagation: report the branches folded
+//         and what was removed
+//   -j    scan with this many threads, 0 for one per online processor
+//   -m    also scan the files listed in the manifest, one per line
+//   -e    edit the file after scanning it and scan again only the tokens around the edit,
+//         replacing the deleted bytes at offset by the text (one file only)
+//   -g    write a random program of size bytes to stdout, with blocks nested up to
+//         depth (default 6), idents distinct identifiers (default 1000) and a seed;
+//         identifier k is used with a probability proportional to 1 / (k + 1)^zipf
+//         (default 1), 0 for a uniform distribution
+//   -b    benchmark: scan and print each file this many times and report the throughput
+// With one file, -j splits the file into chunks scanned in parallel.
+// With several files (batch mode), -j is the number of worker threads,
+// the outputs are printed in order and the throughput is reported to stderr.
+int main(int argc, char* argv[]) {
+    int nthreads = 1;
+    int useStats = 0;
+    int useCache = 0;
+    int recover = 0;
+    int positions = 0;
+    Stage stage = ScanStage;
+    char** files = NULL; // file names, the ones from argv are not copied
+    int nfiles = 0;
+    int cap = 0;
+    int fromArgv = 0;    // files[0..fromArgv) point into argv
+    const char* manifest = NULL;
+    const char* generate = NULL;
+    int runs = 0;
+    char** edits = (char**)malloc(sizeof(char*) * argc); // at most argc / 2 edits
+    int nedits = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            useStats = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            useCache = 1;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            recover = 1;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            positions = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            stage = NamesStage;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            stage = IRStage;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            stage = OptStage;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            edits[nedits++] = argv[++i];
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            generate = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            if (nfiles == cap) {
+                cap = cap == 0 ? 16 : cap * 2;
+                files = (char**)realloc(files, sizeof(char*) * cap);
+            }
+            files[nfiles++] = argv[i];
+            fromArgv++;
+        }
+    }
+    if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > MAXTHREADS) {
+        nthreads = MAXTHREADS;
+    }
+    if (manifest != NULL && readManifest(manifest, &files, &nfiles, &cap) < 0) {
+        free(files);
+        free(edits);
+        return 1;
+    }
+    if (useCache && (useStats || stage != ScanStage)) {
+        fprintf(stderr, "Note: -c is ignored with -s, -n, -i and -O\n");
+    }
+
+    int result;
+    if (generate != NULL) {
+        unsigned long long size = 0, seed = 1;
+        int depth = 6, idents = 1000;
+        double zipf = 1;
+        sscanf(generate, "%llu:%d:%d:%llu:%lf", &size, &depth, &idents, &seed, &zipf);
+        generateProgram((size_t)size, depth, idents, seed, zipf, stdout);
+        result = 0;
+    } else if (runs > 0) {
+        if (nfiles == 0) {
+            result = benchFile("sample.c", runs, nthreads);
+        } else {
+            result = 0;
+            for (int i = 0; i < nfiles; i++) {
+                result |= benchFile(files[i], runs, nthreads);
+            }
+        }
+    } else if (nedits > 0 && (nfiles != 1 || manifest != NULL)) {
+        printf("Error: -e needs exactly one file\n");
+        result = 1;
+    } else if (nfiles == 0 && manifest == NULL) {
+        size_t bytes, tokens;
+        result = scanFile("sample.c", useStats, useCache, recover, positions, stage, nthreads, stdout, &bytes, &tokens);
+    } else if (nfiles == 1 && manifest == NULL) {
+        size_t bytes, tokens;
+        if (nedits > 0) {
+            result = editFile(files[0], edits, nedits, stdout, stderr);
+        } else {
+            result = scanFile(files[0], useStats, useCache, recover, positions, stage, nthreads, stdout, &bytes, &tokens);
+        }
+    } else {
+        result = runBatch((const char**)files, nfiles, nthreads, useStats, useCache, recover, positions, stage);
+    }
+
+    for (int i = fromArgv; i < nfiles; i++) {
+        free(files[i]);
+    }
+    free(files);
+    free(edits);
+    return result;
+}
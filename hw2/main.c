@@ -1,22 +1,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SAMPLEFILE "sample.txt" // default file name
 
 #define BUFFERSIZE 1024 // to store the token
-#define MAXFILENAME 256 // limit the max filename length
 #define EOFF 255        // use 255 to represent EOF (redefine EOF)
 #define ERROR_STATE 99  // error state
-#define LINEMAX 128 // max length of a line in the AST output
-
-// use global variables to store the file content
-unsigned char c;
-unsigned char buffer[BUFFERSIZE] = {0};
-int len = 0;
-
-unsigned char* ptr = NULL; // pointer to the file content cache
-size_t loc = 0; // current location in the file content cache
+#define RANGE_STATE 98  // error state of an integer literal larger than INT64_MAX
+#define MAXTHREADS 64   // limit the number of worker threads
+#define SINKBATCH 256   // number of tokens pushed to a TokenSink at once
+#define WRITEBUFSIZE 65536 // output buffer of a Writer
 
 typedef enum TokenType {
     PLUS_TOKEN,
@@ -42,6 +50,8 @@ typedef enum TokenType {
     EOF_TOKEN
 } TokenType;
 
+typedef struct Lexer Lexer;
+typedef struct Parser Parser;
 typedef struct Token Token;
 typedef struct TokenList TokenList;
 typedef struct ASTNode ASTNode;
@@ -52,7 +62,7 @@ typedef struct ASTOutput ASTOutput;
 typedef struct Token {
     TokenType type;
     union {
-        int intval;
+        int64_t intval;
         char* strval;
     };
     Token* next;
@@ -65,6 +75,25 @@ typedef struct TokenList {
     size_t count;
 } TokenList;
 
+// A token as pushed to a TokenSink. Nothing is allocated for it:
+// the text is not NUL-terminated and points into the content cache.
+typedef struct TokenRef {
+    TokenType type;
+    int len;                   // length of the text
+    const unsigned char* text; // the token in the content cache
+    size_t loc;                // offset of the token in the content cache
+} TokenRef;
+
+// Instead of building a TokenList, scanToSink() pushes the tokens to a sink,
+// in batches of SINKBATCH tokens (the last batch may be shorter).
+// The batch is only valid during the call of push().
+typedef struct TokenSink {
+    void (*push)(void* ctx, const TokenRef* tokens, int n);
+    void* ctx;                 // passed to push()
+    TokenRef batch[SINKBATCH]; // tokens not pushed yet
+    int n;
+} TokenSink;
+
 void addToken(TokenList* list, Token token) {
     Token* newToken = (Token*)malloc(sizeof(Token));
     if (newToken == NULL) {
@@ -90,7 +119,7 @@ void freeTokenList(TokenList* list) {
     Token* current = list->first;
     while (current != NULL) {
         Token* next = current->next;
-        if (current->type == ID_TOKEN || current->type == LITERAL_TOKEN) {
+        if (current->type != LITERAL_TOKEN) {
             free(current->strval);  // strval 是指向 strdup 的字串
         }
         free(current);
@@ -126,14 +155,22 @@ typedef struct ASTNode {
     int childCount; // number of children
     int loc; // for printing, the x coordinate in the printing blackboard
              // 0 is the leftmost position
+    int dloc; // loc - parent->loc, so that a subtree can be moved (see reparse())
+    // The text of the node, relative to the parent so that a subtree can be moved:
+    size_t pos; // start of the first token - start of the parent (the root: start of the text)
+    size_t len; // end of the last token - start of the node
+    size_t dep; // end of the lookahead token when the node was done - start of the node,
+                // the node depends on the text up to there
     union {
         char* strval; // for ID_TOKEN and TYPE_TOKEN
-        int intval;  // for LITERAL_TOKEN
+        int64_t intval; // for LITERAL_TOKEN
     };
 } ASTNode;
 
 typedef struct ASTOutputLn {
-    char line[LINEMAX];
+    char* line; // the text of the line, from its x coordinate loc on, grown as needed
+    int len, cap;
+    int loc; // x coordinate of the expanded nonterminal, where the text starts
     int* locs; // array of x coordinates for each same symbol when expanded
     int locCount; // number of x coordinates in locs
     ASTOutputLn* next; // pointer to the next line in the output
@@ -181,6 +218,7 @@ typedef struct ASTOutputLn {
 typedef struct ASTOutput {
     ASTOutputLn* blackboard;
     int lineCount; // number of lines in the output
+    ASTOutputLn* last; // the last line, where the next one is linked
 } ASTOutput;
 
 typedef struct AST {
@@ -207,7 +245,7 @@ void printNodeInfo(ASTNode* node) {
                 case LESSEQUAL_TOKEN: printf("<="); break;
                 case GREATER_TOKEN: printf(">"); break;
                 case GREATEREQUAL_TOKEN: printf(">="); break;
-                case LITERAL_TOKEN: printf("%d", node->intval); break;
+                case LITERAL_TOKEN: printf("%" PRId64, node->intval); break;
                 case ID_TOKEN: printf("%s", node->strval); break;
                 case LEFTPAREN_TOKEN: printf("("); break;
                 case RIGHTPAREN_TOKEN: printf(")"); break;
@@ -224,52 +262,209 @@ void printNodeInfo(ASTNode* node) {
     }
 }
 
-int in_s() {
+// The offsets of the first byte of each line of a text, to turn an offset
+// into a line and a column. Nothing is tracked while scanning: the index is
+// built on the first lookup, so only a run that prints positions pays for it.
+typedef struct LineIndex {
+    const unsigned char* text;
+    size_t size;
+    size_t* starts;   // starts[i] is the offset of line i + 1, NULL until built
+    size_t n, cap;
+} LineIndex;
+
+void initLineIndex(LineIndex* li, const unsigned char* text, size_t size) {
+    li->text = text;
+    li->size = size;
+    li->starts = NULL;
+    li->n = 0;
+    li->cap = 0;
+}
+
+void freeLineIndex(LineIndex* li) {
+    free(li->starts);
+    li->starts = NULL;
+    li->n = 0;
+    li->cap = 0;
+}
+
+// returns 0, or -1 if out of memory
+int addLineStart(LineIndex* li, size_t start) {
+    if (li->n == li->cap) {
+        size_t cap = li->cap == 0 ? 1024 : li->cap * 2;
+        size_t* tmp = (size_t*)realloc(li->starts, sizeof(size_t) * cap);
+        if (tmp == NULL) {
+            return -1;
+        }
+        li->starts = tmp;
+        li->cap = cap;
+    }
+    li->starts[li->n++] = start;
+    return 0;
+}
+
+// Find the newlines 16 bytes at a time where SSE2 is available
+// (a compare and a movemask per block, then one bit per newline).
+// Returns 0, or -1 if out of memory.
+int buildLineIndex(LineIndex* li) {
+    const unsigned char* text = li->text;
+    size_t i = 0;
+    if (addLineStart(li, 0) < 0) {
+        return -1;
+    }
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= li->size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(text + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        while (mask != 0) {
+            if (addLineStart(li, i + __builtin_ctz(mask) + 1) < 0) {
+                return -1;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < li->size; i++) {
+        if (text[i] == '\n' && addLineStart(li, i + 1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Turn an offset into a line and a column, both counted from 1 (the column in bytes).
+// Returns 0, or -1 if the index could not be built.
+int lineColumn(LineIndex* li, size_t loc, size_t* line, size_t* column) {
+    if (li->starts == NULL && buildLineIndex(li) < 0) {
+        freeLineIndex(li);
+        return -1;
+    }
+    size_t lo = 0, hi = li->n; // the last start <= loc is in [lo, hi)
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (li->starts[mid] <= loc) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    *line = lo + 1;
+    *column = loc - li->starts[lo] + 1;
+    return 0;
+}
+
+// print "line:column: ", or "offset N: " if there is no index
+void printPosition(LineIndex* li, size_t loc, FILE* out) {
+    size_t line, column;
+    if (lineColumn(li, loc, &line, &column) == 0) {
+        fprintf(out, "%zu:%zu: ", line, column);
+    } else {
+        fprintf(out, "offset %zu: ", loc);
+    }
+}
+
+// An error collected in recovery mode (option -k), instead of being printed
+typedef struct Diagnostic {
+    size_t loc;       // offset in the text
+    int state;        // for a lexical error, the state in which the scanner failed, else -1
+    unsigned char c;  // for a lexical error, the unexpected character
+    char msg[96];     // for a parse error, the message
+} Diagnostic;
+
+typedef struct Diagnostics {
+    Diagnostic* items;
+    int n, cap;
+    int lexical;      // number of lexical errors among them
+} Diagnostics;
+
+// Add an error at loc to diags. Returns NULL on failure.
+Diagnostic* addDiagnostic(Diagnostics* diags, size_t loc) {
+    if (diags->n == diags->cap) {
+        int cap = diags->cap == 0 ? 16 : diags->cap * 2;
+        Diagnostic* tmp = (Diagnostic*)realloc(diags->items, sizeof(Diagnostic) * cap);
+        if (tmp == NULL) {
+            return NULL;
+        }
+        diags->items = tmp;
+        diags->cap = cap;
+    }
+    Diagnostic* d = &diags->items[diags->n++];
+    d->loc = loc;
+    d->state = -1;
+    d->c = 0;
+    d->msg[0] = '\0';
+    return d;
+}
+
+// All the state of the scanner, so that several files can be scanned at the same time
+typedef struct Lexer {
+    unsigned char c;                  // current character
+    unsigned char buffer[BUFFERSIZE]; // to store the token
+    int len;                          // length of the token in buffer
+    unsigned char* ptr;               // pointer to the file content cache
+    size_t loc;                       // current location in the file content cache
+    size_t size;                      // size of the file content, without the EOFF terminator
+    size_t cap;                       // bytes allocated at ptr once editLexer() grew it, else 0
+    FILE* out;                        // where the lexical errors are printed
+    Diagnostics* diags;               // if not NULL, lexical errors are collected there and the scan goes on
+    LineIndex* lines;                 // if not NULL, the printed errors start with their position
+} Lexer;
+
+int in_s(const Lexer* lx) {
+    unsigned char c = lx->c;
     return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == EOFF || \
            c == '{' || c == '}' || c == '(' || c == ')' || c == ';';
 }
 
-int in_n() {
+int in_n(const Lexer* lx) {
+    unsigned char c = lx->c;
     return c >= '0' && c <= '9';
 }
 
-int in_r() {
+int in_r(const Lexer* lx) {
+    unsigned char c = lx->c;
     return c == '+' || c == '-' || c == '>' || c == '<' || c == '=';
 }
 
-int in_a() {
+int in_a(const Lexer* lx) {
+    unsigned char c = lx->c;
     return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-int in_a1() {
+int in_a1(const Lexer* lx) {
+    unsigned char c = lx->c;
     return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') && \
             (c != 'e' && c!= 'i' && c != 'm' && c != 'w');
 }
 
-int in_s1() {
+int in_s1(const Lexer* lx) {
+    unsigned char c = lx->c;
     return c == '{' || c == '}' || c == '(' || c == ')' || c == ';';
 }
 
 // in_a2() can not be implemented directly
 //         because it falls into the "else" branch in the if statement.
 
-void mygetc() { // no EOF check here, it is left for the switch statement
-    c = ptr[loc++];
-    buffer[len++] = c;
+void mygetc(Lexer* lx) { // no EOF check here, it is left for the switch statement
+    lx->c = lx->ptr[lx->loc++];
+    lx->buffer[lx->len++] = lx->c;
 }
 
-void myungetc() {
-    loc--;
-    len--;
-    buffer[len] = '\0'; // reset the buffer to empty
+void myungetc(Lexer* lx) {
+    lx->loc--;
+    lx->len--;
+    lx->buffer[lx->len] = '\0'; // reset the buffer to empty
 }
 
-void resetBuffer() { // note: buffer is to store the token, not file content
-    len = 0;
-    buffer[len] = '\0'; // reset the buffer to empty
+void resetBuffer(Lexer* lx) { // note: buffer is to store the token, not file content
+    lx->len = 0;
+    lx->buffer[lx->len] = '\0'; // reset the buffer to empty
 }
 
-int scanner(const char* filename, TokenList* tokenList, int useDefault) {
+// Read the file (or the default test string) into the content cache of the lexer.
+// On success, lx->ptr is the content cache, to be freed by the caller.
+// Errors are printed to out, which is also kept for the errors of next_token().
+int openLexer(Lexer* lx, const char* filename, int useDefault, FILE* out) {
     // estimate the file size
     size_t fileSize = 0;
     FILE* fp;
@@ -277,7 +472,7 @@ int scanner(const char* filename, TokenList* tokenList, int useDefault) {
     if (useDefault == 0) {
         fp = fopen(filename, "rb");
         if (fp == NULL) {
-            printf("Error: file %s not found\n", filename);
+            fprintf(out, "Error: file %s not found\n", filename);
             return 1;
         }
         fseek(fp, 0, SEEK_END);
@@ -287,13 +482,13 @@ int scanner(const char* filename, TokenList* tokenList, int useDefault) {
         // Allocate a memory cache which the entire file content is to read into.
         content = (unsigned char*)malloc(fileSize + 1);
         if (content == NULL) {
-            printf("Error: memory allocation failed\n");
+            fprintf(out, "Error: memory allocation failed\n");
             fclose(fp);
             return 1;
         }
         size_t bytesRead = fread(content, 1, fileSize, fp);
         if (bytesRead != fileSize) {
-            printf("Error: read %zu bytes, but expected %lu bytes\n", bytesRead, fileSize);
+            fprintf(out, "Error: read %zu bytes, but expected %lu bytes\n", bytesRead, fileSize);
             free(content);
             fclose(fp);
             return 1;
@@ -305,479 +500,679 @@ int scanner(const char* filename, TokenList* tokenList, int useDefault) {
     }
     content[fileSize] = EOFF; // add a redefined EOF terminator to the end of the content
 
-    // initialize the token list
-    tokenList->first = NULL;
-    tokenList->last = NULL;
-    tokenList->current = NULL;
-    tokenList->count = 0;
+    // assign the content to the lexer for later use in functions
+    memset(lx, 0, sizeof(Lexer));
+    lx->ptr = content;
+    lx->size = fileSize;
+    lx->loc = 0; // reset the location to the beginning of the file content
+    lx->out = out;
+    return 0;
+}
+
+void printLexError(FILE* out, int state, unsigned char c) {
+    if (state == ERROR_STATE) {
+        fprintf(out, "Error due to invalid token detected.\n");
+        fprintf(out, "Alphabet character should not be followed by a digit\n");
+        fprintf(out, "when the token is to be determined as an integer.\n");
+    } else if (state == RANGE_STATE) {
+        fprintf(out, "Error due to integer literal out of range.\n");
+        fprintf(out, "An integer literal should not be larger than %" PRId64 ".\n", INT64_MAX);
+    } else {
+        fprintf(out, "Error in state %d: found unexpected character with decimal = %u, represented as %c\n", state, c, c);
+    }
+}
+
+// Report a lexical error found in the given state: print it to lx->out and return 1,
+// so that the scanner stops. In recovery mode (lx->diags), the error is collected
+// instead, the rest of the bad token is skipped up to the next delimiter (panic mode),
+// and 0 is returned: the scanner goes on in state 0.
+int lexError(Lexer* lx, int state) {
+    Diagnostic* d = lx->diags != NULL ? addDiagnostic(lx->diags, lx->loc - 1) : NULL;
+    if (d == NULL) {
+        if (lx->lines != NULL) {
+            printPosition(lx->lines, lx->loc - 1, lx->out);
+        }
+        printLexError(lx->out, state, lx->c);
+        return 1;
+    }
+    d->state = state;
+    d->c = lx->c;
+    lx->diags->lexical++;
+    if (lx->c == EOFF) {
+        lx->loc--; // read again in state 0, where the scan ends
+        return 0;
+    }
+    while (1) {
+        resetBuffer(lx);
+        mygetc(lx);
+        if (in_s(lx) || in_r(lx)) { // the delimiter starts the next token
+            myungetc(lx);
+            return 0;
+        }
+    }
+}
+
+// Load 8 bytes of the text, the first one in the lowest byte.
+uint64_t loadDigits8(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// 1 if the 8 bytes loaded by loadDigits8() are all '0'..'9': the high nibble of each
+// byte is 3, and stays 3 when 6 is added (':' and above carry into 4).
+int allDigits8(uint64_t v) {
+    return ((v & 0xF0F0F0F0F0F0F0F0ull) |
+            (((v + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) >> 4)) == 0x3333333333333333ull;
+}
+
+// The value of the 8 digits loaded by loadDigits8(), with three multiplications
+// instead of eight: the digits are combined in pairs, then the pairs in fours.
+uint64_t parseDigits8(uint64_t v) {
+    v -= 0x3030303030303030ull;
+    v = v * 10 + (v >> 8);
+    return (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+            (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+}
+
+// Convert the n digits at p. Returns 0, or 1 if the value is larger than INT64_MAX.
+int parseLiteral(const unsigned char* p, size_t n, int64_t* value) {
+    while (n > 0 && *p == '0') { // leading zeros do not count
+        p++;
+        n--;
+    }
+    if (n > 19) { // INT64_MAX has 19 digits, and 19 digits fit in an uint64_t
+        return 1;
+    }
+    uint64_t v = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        v = v * 100000000 + parseDigits8(loadDigits8(p + i));
+    }
+    for (; i < n; i++) {
+        v = v * 10 + (p[i] - '0');
+    }
+    if (v > INT64_MAX) {
+        return 1;
+    }
+    *value = (int64_t)v;
+    return 0;
+}
 
-    // assign the content to the pointer for later use in functions
-    ptr = content;
-    loc = 0; // reset the location to the beginning of the file content
+// In next_token(): stop on a lexical error, or go on in state 0 if lexError() recovered from it
+#define LEXERROR(st) { if (lexError(lx, st)) return 1; state = 0; continue; }
 
+// Pull the next token from the lexer into tok.
+// The string of an ID_TOKEN or TYPE_TOKEN points into the lexer and is only
+// valid until the next call. After the end of the content, EOF_TOKEN is returned again and again.
+// Returns 0 on success, 1 on a lexical error (printed to lx->out).
+// In recovery mode, the lexical errors are collected in lx->diags and skipped.
+int next_token(Lexer* lx, Token* tok) {
     int state = 0;
     while (1) {
         switch (state) {
             case 0:
-                resetBuffer(); // reset the buffer to empty
-                mygetc();      // read the next character
-                     if (c == '+') state = 1;
-                else if (c == '-') state = 2;
-                else if (c == '=') state = 3;
-                else if (c == '<') state = 6;
-                else if (c == '>') state = 9;
-                else if (in_n()) state = 12;
-                else if (in_s1()) state = 14;
-                else if (in_a1()) state = 37;
-                else if (c == EOFF) state = 39;
-                else if (c == 'e') state = 15;
-                else if (c == 'i') state = 18;
-                else if (c == 'm') state = 20;
-                else if (c == 'w') state = 23;
-                else if (c == ' ') state = 0;
-                else if (c == '\n') state = 0;
-                else if (c == '\t') state = 0;
-                else if (c == '\r') state = 0;
+                resetBuffer(lx); // reset the buffer to empty
+                mygetc(lx);      // read the next character
+                     if (lx->c == '+') state = 1;
+                else if (lx->c == '-') state = 2;
+                else if (lx->c == '=') state = 3;
+                else if (lx->c == '<') state = 6;
+                else if (lx->c == '>') state = 9;
+                else if (in_n(lx)) state = 12;
+                else if (in_s1(lx)) state = 14;
+                else if (in_a1(lx)) state = 37;
+                else if (lx->c == EOFF) state = 39;
+                else if (lx->c == 'e') state = 15;
+                else if (lx->c == 'i') state = 18;
+                else if (lx->c == 'm') state = 20;
+                else if (lx->c == 'w') state = 23;
+                else if (lx->c == ' ') state = 0;
+                else if (lx->c == '\n') state = 0;
+                else if (lx->c == '\t') state = 0;
+                else if (lx->c == '\r') state = 0;
                 else {
-                    printf("Error in state 0: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(0)
                 }
                 break;
             case 1:
                 // printf("+: PLUS_TOKEN\n");
-                addToken(tokenList, (Token){.type = PLUS_TOKEN});
-                tokenList->last->strval = strdup("+");
-                state = 0;
-                break;
+                *tok = (Token){.type = PLUS_TOKEN};
+                return 0;
             case 2:
                 // printf("-: MINUS_TOKEN\n");
-                addToken(tokenList, (Token){.type = MINUS_TOKEN});
-                tokenList->last->strval = strdup("-");
-                state = 0;
-                break;
+                *tok = (Token){.type = MINUS_TOKEN};
+                return 0;
             case 3:
-                mygetc();
-                if (c == '=') state = 4;
+                mygetc(lx);
+                if (lx->c == '=') state = 4;
                 else state = 5;
                 break;
             case 4:
                 // printf("==: EQUAL_TOKEN\n");
-                addToken(tokenList, (Token){.type = EQUAL_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = EQUAL_TOKEN};
+                return 0;
             case 5:
-                myungetc();
+                myungetc(lx);
                 // printf("=: ASSIGN_TOKEN\n");
-                addToken(tokenList, (Token){.type = ASSIGN_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = ASSIGN_TOKEN};
+                return 0;
             case 6:
-                mygetc();
-                if (c == '=') state = 7;
+                mygetc(lx);
+                if (lx->c == '=') state = 7;
                 else state = 8;
                 break;
             case 7:
                 // printf("<=: LESSEQUAL_TOKEN\n");
-                addToken(tokenList, (Token){.type = LESSEQUAL_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = LESSEQUAL_TOKEN};
+                return 0;
             case 8:
-                myungetc();
+                myungetc(lx);
                 // printf("<: LESS_TOKEN\n");
-                addToken(tokenList, (Token){.type = LESS_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = LESS_TOKEN};
+                return 0;
             case 9:
-                mygetc();
-                if (c == '=') state = 10;
+                mygetc(lx);
+                if (lx->c == '=') state = 10;
                 else state = 11;
                 break;
             case 10:
                 // printf(">=: GREATEREQUAL_TOKEN\n");
-                addToken(tokenList, (Token){.type = GREATEREQUAL_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = GREATEREQUAL_TOKEN};
+                return 0;
             case 11:
-                myungetc();
+                myungetc(lx);
                 // printf(">: GREATER_TOKEN\n");
-                addToken(tokenList, (Token){.type = GREATER_TOKEN});
-                state = 0;
-                break;
-            case 12:
-                mygetc();
-                if (in_n()) state = 12;
-                else if (in_s() || in_r()) state = 13;
-                else if (in_a()) state = ERROR_STATE;
+                *tok = (Token){.type = GREATER_TOKEN};
+                return 0;
+            case 12: {
+                // The digits are not copied to the buffer: they are skipped in the text,
+                // 8 at a time, and the literal is converted from there in state 13.
+                size_t start = lx->loc - 1;
+                while (lx->loc + 8 <= lx->size && allDigits8(loadDigits8(lx->ptr + lx->loc))) {
+                    lx->loc += 8;
+                }
+                while (lx->ptr[lx->loc] >= '0' && lx->ptr[lx->loc] <= '9') {
+                    lx->loc++;
+                }
+                lx->len = (int)(lx->loc - start); // the token is the text before lx->loc
+                lx->c = lx->ptr[lx->loc++];       // the character after it, not in the token
+                if (in_s(lx) || in_r(lx)) state = 13;
+                else if (in_a(lx)) state = ERROR_STATE;
                 else {
-                    printf("Error in state 12: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(12)
                 }
                 break;
-            case 13:
-                myungetc();
-                buffer[len] = '\0'; // add a null terminator to the buffer
+            }
+            case 13: {
+                lx->loc--; // the delimiter starts the next token
                 // printf("%s: LITERAL_TOKEN\n", buffer);
-                addToken(tokenList, (Token){.type = LITERAL_TOKEN, .intval = atoi(buffer)});
-                state = 0;
-                break;
+                size_t start = lx->loc - lx->len;
+                int64_t value;
+                if (parseLiteral(lx->ptr + start, lx->len, &value) != 0) {
+                    lx->loc = start + 1; // the error is at the first digit
+                    lx->c = lx->ptr[start];
+                    LEXERROR(RANGE_STATE)
+                }
+                *tok = (Token){.type = LITERAL_TOKEN, .intval = value};
+                return 0;
+            }
             case 14:
-                buffer[len] = '\0';
-                switch (c) {
+                lx->buffer[lx->len] = '\0';
+                switch (lx->c) {
                     case '(':
                         // printf("(: LEFTPAREN_TOKEN\n");
-                        addToken(tokenList, (Token){.type = LEFTPAREN_TOKEN});
-                        tokenList->last->strval = strdup("(");
+                        *tok = (Token){.type = LEFTPAREN_TOKEN};
                         break;
                     case ')':
                         // printf("): RIGHTPAREN_TOKEN\n");
-                        addToken(tokenList, (Token){.type = RIGHTPAREN_TOKEN});
-                        tokenList->last->strval = strdup(")");
+                        *tok = (Token){.type = RIGHTPAREN_TOKEN};
                         break;
                     case '{':
                         // printf("{: LEFTBRACE_TOKEN\n");
-                        addToken(tokenList, (Token){.type = LEFTBRACE_TOKEN});
+                        *tok = (Token){.type = LEFTBRACE_TOKEN};
                         break;
                     case '}':
                         // printf("}: RIGHTBRACE_TOKEN\n");
-                        addToken(tokenList, (Token){.type = RIGHTBRACE_TOKEN});
+                        *tok = (Token){.type = RIGHTBRACE_TOKEN};
                         break;
                     case ';':
                         // printf(";: SEMICOLON_TOKEN\n");
-                        addToken(tokenList, (Token){.type = SEMICOLON_TOKEN});
+                        *tok = (Token){.type = SEMICOLON_TOKEN};
                         break;
                 }
-                state = 0;
-                break;
+                return 0;
             case 15:
-                mygetc();
-                if (c == 'l') state = 16;
-                else if (in_n() || in_a()) state = 37; // because c == 'l' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'l') state = 16;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'l' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 15: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(15)
                 }
                 break;
             case 16:
-                mygetc();
-                if (c == 's') state = 17;
-                else if (in_n() || in_a()) state = 37; // because c == 's' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 's') state = 17;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 's' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 16: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(16)
                 }
                 break;
             case 17:
-                mygetc();
-                if (c == 'e') state = 27;
-                else if (in_n() || in_a()) state = 37; // because c == 'e' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'e') state = 27;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'e' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 17: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(17)
                 }
                 break;
             case 18:
-                mygetc();
-                if (c == 'f') state = 28;
-                else if (c == 'n') state = 19;
-                else if (in_n() || in_a()) state = 37; // because c == 'f' and 'n' are used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'f') state = 28;
+                else if (lx->c == 'n') state = 19;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'f' and 'n' are used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 18: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(18)
                 }
                 break;
             case 19:
-                mygetc();
-                if (c == 't') state = 29;
-                else if (in_n() || in_a()) state = 37; // because c == 't' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 't') state = 29;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 't' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 19: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(19)
                 }
                 break;
             case 20:
-                mygetc();
-                if (c == 'a') state = 21;
-                else if (in_n() || in_a()) state = 37; // because c == 'a' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'a') state = 21;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'a' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 20: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(20)
                 }
                 break;
             case 21:
-                mygetc();
-                if (c == 'i') state = 22;
-                else if (in_n() || in_a()) state = 37; // because c == 'i' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'i') state = 22;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'i' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 21: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(21)
                 }
                 break;
             case 22:
-                mygetc();
-                if (c == 'n') state = 30;
-                else if (in_n() || in_a()) state = 37; // because c == 'n' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'n') state = 30;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'n' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 22: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(22)
                 }
                 break;
             case 23:
-                mygetc();
-                if (c == 'h') state = 24;
-                else if (in_n() || in_a()) state = 37; // because c == 'h' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'h') state = 24;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'h' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 23: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(23)
                 }
                 break;
             case 24:
-                mygetc();
-                if (c == 'i') state = 25;
-                else if (in_n() || in_a()) state = 37; // because c == 'i' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'i') state = 25;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'i' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 24: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(24)
                 }
                 break;
             case 25:
-                mygetc();
-                if (c == 'l') state = 26;
-                else if (in_n() || in_a()) state = 37; // because c == 'l' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'l') state = 26;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'l' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 25: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(25)
                 }
                 break;
             case 26:
-                mygetc();
-                if (c == 'e') state = 31;
-                else if (in_n() || in_a()) state = 37; // because c == 'e' is used, here in_a() is actually in_a2()
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (lx->c == 'e') state = 31;
+                else if (in_n(lx) || in_a(lx)) state = 37; // because lx->c == 'e' is used, here in_a(lx) is actually in_a2()
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 26: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(26)
                 }
                 break;
             case 27:
                 // printf("in state 27: ");
-                mygetc();
+                mygetc(lx);
                 // printf("get a c = %d (%c) at loc = %zu\n", c, c, loc);
-                // printf("in_s() = %d, in_r() = %d, in_n() = %d, in_a() = %d\n", in_s(), in_r(), in_n(), in_a());
-                if (in_s() || in_r()) state = 32;
-                else if (in_n() || in_a()) state = 37;
+                // printf("in_s(lx) = %d, in_r(lx) = %d, in_n(lx) = %d, in_a(lx) = %d\n", in_s(lx), in_r(lx), in_n(lx), in_a(lx));
+                if (in_s(lx) || in_r(lx)) state = 32;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 27: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(27)
                 }
                 break;
             case 28:
-                mygetc();
-                if (in_s() || in_r()) state = 33;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 33;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 28: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(28)
                 }
                 break;
             case 29:
-                mygetc();
-                if (in_s() || in_r()) state = 34;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 34;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 29: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(29)
                 }
                 break;
             case 30:
-                mygetc();
-                if (in_s() || in_r()) state = 35;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 35;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 30: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(30)
                 }
                 break;
             case 31:
-                mygetc();
-                if (in_s() || in_r()) state = 36;
-                else if (in_n() || in_a()) state = 37;
+                mygetc(lx);
+                if (in_s(lx) || in_r(lx)) state = 36;
+                else if (in_n(lx) || in_a(lx)) state = 37;
                 else {
-                    printf("Error in state 31: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(31)
                 }
                 break;
             case 32:
-                myungetc();
+                myungetc(lx);
                 // printf("else: ELSE_TOKEN\n");
-                addToken(tokenList, (Token){.type = ELSE_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = ELSE_TOKEN};
+                return 0;
             case 33:
-                myungetc();
+                myungetc(lx);
                 // printf("if: IF_TOKEN\n");
-                addToken(tokenList, (Token){.type = IF_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = IF_TOKEN};
+                return 0;
             case 34:
-                myungetc();
+                myungetc(lx);
                 // printf("int: TYPE_TOKEN\n");
-                addToken(tokenList, (Token){.type = TYPE_TOKEN, .strval = strdup("int")});
-                state = 0;
-                break;
+                *tok = (Token){.type = TYPE_TOKEN, .strval = (char*)"int"};
+                return 0;
             case 35:
-                myungetc();
+                myungetc(lx);
                 // printf("main: MAIN_TOKEN\n");
-                addToken(tokenList, (Token){.type = MAIN_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = MAIN_TOKEN};
+                return 0;
             case 36:
-                myungetc();
+                myungetc(lx);
                 // printf("while: WHILE_TOKEN\n");
-                addToken(tokenList, (Token){.type = WHILE_TOKEN});
-                state = 0;
-                break;
+                *tok = (Token){.type = WHILE_TOKEN};
+                return 0;
             case 37:
-                mygetc();
-                if (in_n() || in_a()) state = 37;
-                else if (in_s() || in_r()) state = 38;
+                mygetc(lx);
+                if (in_n(lx) || in_a(lx)) state = 37;
+                else if (in_s(lx) || in_r(lx)) state = 38;
                 else {
-                    printf("Error in state 37: found unexpected character with decimal = %u, represented as %c\n", c, c);
-                    free(content); // free the memory cache
-                    return 1;
+                    LEXERROR(37)
                 }
                 break;
             case 38:
-                myungetc();
-                buffer[len] = '\0'; // add a null terminator to the buffer
+                myungetc(lx);
+                lx->buffer[lx->len] = '\0'; // add a null terminator to the buffer
                 // printf("%s: ID_TOKEN\n", buffer);
-                addToken(tokenList, (Token){.type = ID_TOKEN, .strval = strdup(buffer)});
-                state = 0;
-                break;
+                *tok = (Token){.type = ID_TOKEN, .strval = (char*)lx->buffer};
+                return 0;
             case 39: // End of process
-                // append EOF token at the end of the token list
-                addToken(tokenList, (Token){.type = EOF_TOKEN});
-                tokenList->last->strval = strdup("EOF");
+                myungetc(lx); // stay at the EOF terminator
+                *tok = (Token){.type = EOF_TOKEN};
                 return 0;
             default:
-                printf("Error due to invalid token detected.\n");
-                printf("Alphabet character should not be followed by a digit\n");
-                printf("when the token is to be determined as an integer.\n");
-                return 1;
+                LEXERROR(ERROR_STATE)
+        }
+    }
+}
+
+// Read the file (or the default test string) and scan it into tokenList.
+// On success, lx->ptr is the content cache, to be freed by the caller.
+// Errors are printed to out.
+int scanner(Lexer* lx, const char* filename, TokenList* tokenList, int useDefault, FILE* out) {
+    // initialize the token list
+    tokenList->first = NULL;
+    tokenList->last = NULL;
+    tokenList->current = NULL;
+    tokenList->count = 0;
+
+    if (openLexer(lx, filename, useDefault, out) != 0) {
+        return 1;
+    }
+    Token tok;
+    do {
+        if (next_token(lx, &tok) != 0) {
+            return 1;
+        }
+        addToken(tokenList, tok);
+        if (tok.type == ID_TOKEN || tok.type == TYPE_TOKEN) {
+            tokenList->last->strval = strdup(tok.strval); // tok.strval is only valid until the next token
+        }
+    } while (tok.type != EOF_TOKEN);
+    return 0;
+}
+
+// Scan the content of an opened lexer (see openLexer()) and push the tokens to sink.
+// EOF_TOKEN is not pushed. The tokens before a lexical error are still pushed.
+// Returns 0 on success, 1 on a lexical error (printed to lx->out).
+int scanToSink(Lexer* lx, TokenSink* sink) {
+    Token tok;
+    int result;
+    sink->n = 0;
+    while ((result = next_token(lx, &tok)) == 0 && tok.type != EOF_TOKEN) {
+        TokenRef* ref = &sink->batch[sink->n++];
+        ref->type = tok.type;
+        ref->len = lx->len; // the buffer holds exactly the bytes before lx->loc
+        ref->loc = lx->loc - lx->len;
+        ref->text = lx->ptr + ref->loc;
+        if (sink->n == SINKBATCH) {
+            sink->push(sink->ctx, sink->batch, sink->n);
+            sink->n = 0;
+        }
+    }
+    if (sink->n > 0) {
+        sink->push(sink->ctx, sink->batch, sink->n);
+        sink->n = 0;
+    }
+    return result;
+}
+
+// TokenSink callback which only counts the tokens, ctx is a size_t*
+void countTokens(void* ctx, const TokenRef* tokens, int n) {
+    (void)tokens;
+    *(size_t*)ctx += n;
+}
+
+// a string with its length, for copying without strlen()
+typedef struct Name {
+    const char* str;
+    int len;
+} Name;
+#define NAME(s) {s, sizeof(s) - 1}
+
+// The lines of printTokenList(): the whole line, or what follows the value
+// for LITERAL_TOKEN, ID_TOKEN and TYPE_TOKEN. The numbers follow TokenType.
+const Name tokenLines[EOF_TOKEN + 1] = {
+    [PLUS_TOKEN]         = NAME("+: PLUS_TOKEN (0)\n"),
+    [MINUS_TOKEN]        = NAME("-: MINUS_TOKEN (1)\n"),
+    [EQUAL_TOKEN]        = NAME("==: EQUAL_TOKEN (2)\n"),
+    [ASSIGN_TOKEN]       = NAME("=: ASSIGN_TOKEN (3)\n"),
+    [LESS_TOKEN]         = NAME("<: LESS_TOKEN (4)\n"),
+    [LESSEQUAL_TOKEN]    = NAME("<=: LESSEQUAL_TOKEN (5)\n"),
+    [GREATER_TOKEN]      = NAME(">: GREATER_TOKEN (6)\n"),
+    [GREATEREQUAL_TOKEN] = NAME(">=: GREATEREQUAL_TOKEN (7)\n"),
+    [LITERAL_TOKEN]      = NAME(": LITERAL_TOKEN (8)\n"),
+    [ID_TOKEN]           = NAME(": ID_TOKEN (9)\n"),
+    [LEFTPAREN_TOKEN]    = NAME("(: LEFTPAREN_TOKEN (10)\n"),
+    [RIGHTPAREN_TOKEN]   = NAME("): RIGHTPAREN_TOKEN (11)\n"),
+    [LEFTBRACE_TOKEN]    = NAME("{: LEFTBRACE_TOKEN (12)\n"),
+    [RIGHTBRACE_TOKEN]   = NAME("}: RIGHTBRACE_TOKEN (13)\n"),
+    [SEMICOLON_TOKEN]    = NAME(";: SEMICOLON_TOKEN (14)\n"),
+    [TYPE_TOKEN]         = NAME(": TYPE_TOKEN (15)\n"),
+    [MAIN_TOKEN]         = NAME("main: MAIN_TOKEN (16)\n"),
+    [WHILE_TOKEN]        = NAME("while: WHILE_TOKEN (17)\n"),
+    [IF_TOKEN]           = NAME("if: IF_TOKEN (18)\n"),
+    [ELSE_TOKEN]         = NAME("else: ELSE_TOKEN (19)\n"),
+    [EOF_TOKEN]          = NAME("EOF: EOF_TOKEN (20); this token is not counted.\n"),
+};
+
+// the names of the token types, for exportJSON()
+const Name tokenNames[EOF_TOKEN + 1] = {
+    [PLUS_TOKEN]         = NAME("PLUS_TOKEN"),
+    [MINUS_TOKEN]        = NAME("MINUS_TOKEN"),
+    [EQUAL_TOKEN]        = NAME("EQUAL_TOKEN"),
+    [ASSIGN_TOKEN]       = NAME("ASSIGN_TOKEN"),
+    [LESS_TOKEN]         = NAME("LESS_TOKEN"),
+    [LESSEQUAL_TOKEN]    = NAME("LESSEQUAL_TOKEN"),
+    [GREATER_TOKEN]      = NAME("GREATER_TOKEN"),
+    [GREATEREQUAL_TOKEN] = NAME("GREATEREQUAL_TOKEN"),
+    [LITERAL_TOKEN]      = NAME("LITERAL_TOKEN"),
+    [ID_TOKEN]           = NAME("ID_TOKEN"),
+    [LEFTPAREN_TOKEN]    = NAME("LEFTPAREN_TOKEN"),
+    [RIGHTPAREN_TOKEN]   = NAME("RIGHTPAREN_TOKEN"),
+    [LEFTBRACE_TOKEN]    = NAME("LEFTBRACE_TOKEN"),
+    [RIGHTBRACE_TOKEN]   = NAME("RIGHTBRACE_TOKEN"),
+    [SEMICOLON_TOKEN]    = NAME("SEMICOLON_TOKEN"),
+    [TYPE_TOKEN]         = NAME("TYPE_TOKEN"),
+    [MAIN_TOKEN]         = NAME("MAIN_TOKEN"),
+    [WHILE_TOKEN]        = NAME("WHILE_TOKEN"),
+    [IF_TOKEN]           = NAME("IF_TOKEN"),
+    [ELSE_TOKEN]         = NAME("ELSE_TOKEN"),
+    [EOF_TOKEN]          = NAME("EOF_TOKEN"),
+};
+
+// An output buffer which is flushed with a single write() (or fwrite() for
+// streams without a file descriptor, like the memory streams of the batch mode).
+// Dumping tokens is much faster this way than with a printf() per token.
+typedef struct Writer {
+    FILE* out;
+    int fd;                  // fileno(out), -1 if none
+    size_t len;              // number of bytes in buf
+    char buf[WRITEBUFSIZE];
+} Writer;
+
+void initWriter(Writer* w, FILE* out) {
+    fflush(out); // what printf() already buffered goes out first
+    w->out = out;
+    w->fd = fileno(out);
+    w->len = 0;
+}
+
+void flushWriter(Writer* w) {
+    if (w->fd < 0) {
+        fwrite(w->buf, 1, w->len, w->out);
+    } else {
+        size_t done = 0;
+        while (done < w->len) {
+            ssize_t n = write(w->fd, w->buf + done, w->len - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break; // the output is lost, as with a failed printf()
+            }
+            done += n;
         }
     }
+    w->len = 0;
+}
+
+void writeBytes(Writer* w, const char* str, size_t len) {
+    while (w->len + len > WRITEBUFSIZE) {
+        size_t n = WRITEBUFSIZE - w->len;
+        memcpy(w->buf + w->len, str, n);
+        w->len += n;
+        flushWriter(w);
+        str += n;
+        len -= n;
+    }
+    memcpy(w->buf + w->len, str, len);
+    w->len += len;
+}
+
+// write a string literal
+#define WRITESTR(w, s) writeBytes(w, s, sizeof(s) - 1)
+
+void writeInt(Writer* w, int64_t value) {
+    char digits[21];
+    int n = 0;
+    uint64_t u = value < 0 ? 0u - (uint64_t)value : (uint64_t)value;
+    do {
+        digits[sizeof(digits) - 1 - n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (value < 0) {
+        digits[sizeof(digits) - 1 - n++] = '-';
+    }
+    writeBytes(w, digits + sizeof(digits) - n, n);
+}
 
-    free(content); // free the memory cache if we reach here (should not happen)
+void writeSpaces(Writer* w, size_t n) {
+    while (n > 0) {
+        if (w->len == WRITEBUFSIZE) {
+            flushWriter(w);
+        }
+        size_t k = WRITEBUFSIZE - w->len < n ? WRITEBUFSIZE - w->len : n;
+        memset(w->buf + w->len, ' ', k);
+        w->len += k;
+        n -= k;
+    }
 }
 
-void printTokenList(const TokenList* list) {
-    printf("Printing Token List: ");
+void printTokenList(const TokenList* list, FILE* out) {
+    fprintf(out, "Printing Token List: ");
     if (list->count == 0) {
-        printf("empty token list.\n");
+        fprintf(out, "empty token list.\n");
         return;
     }
-    printf("total %zu tokens\n", list->count-1); // exclude the EOF token
-    Token* current = list->first;
-    while (current != NULL) {
+    fprintf(out, "total %zu tokens\n", list->count-1); // exclude the EOF token
+    Writer w;
+    initWriter(&w, out);
+    for (Token* current = list->first; current != NULL; current = current->next) {
         switch (current->type) {
-            case PLUS_TOKEN:
-                printf("+: PLUS_TOKEN (%d)\n", PLUS_TOKEN);
-                break;
-            case MINUS_TOKEN:
-                printf("-: MINUS_TOKEN (%d)\n", MINUS_TOKEN);
-                break;
-            case EQUAL_TOKEN:
-                printf("==: EQUAL_TOKEN (%d)\n", EQUAL_TOKEN);
-                break;
-            case ASSIGN_TOKEN:
-                printf("=: ASSIGN_TOKEN (%d)\n", ASSIGN_TOKEN);
-                break;
-            case LESS_TOKEN:
-                printf("<: LESS_TOKEN (%d)\n", LESS_TOKEN);
-                break;
-            case LESSEQUAL_TOKEN:
-                printf("<=: LESSEQUAL_TOKEN (%d)\n", LESSEQUAL_TOKEN);
-                break;
-            case GREATER_TOKEN:
-                printf(">: GREATER_TOKEN (%d)\n", GREATER_TOKEN);
-                break;
-            case GREATEREQUAL_TOKEN:
-                printf(">=: GREATEREQUAL_TOKEN (%d)\n", GREATEREQUAL_TOKEN);
-                break;
             case LITERAL_TOKEN:
-                printf("%d: LITERAL_TOKEN (%d)\n", current->intval, LITERAL_TOKEN);
+                writeInt(&w, current->intval);
                 break;
             case ID_TOKEN:
-                printf("%s: ID_TOKEN (%d)\n", current->strval, ID_TOKEN);
-                break;
-            case LEFTPAREN_TOKEN:
-                printf("(: LEFTPAREN_TOKEN (%d)\n", LEFTPAREN_TOKEN);
-                break;
-            case RIGHTPAREN_TOKEN:
-                printf("): RIGHTPAREN_TOKEN (%d)\n", RIGHTPAREN_TOKEN);
-                break;
-            case LEFTBRACE_TOKEN:
-                printf("{: LEFTBRACE_TOKEN (%d)\n", LEFTBRACE_TOKEN);
-                break;
-            case RIGHTBRACE_TOKEN:
-                printf("}: RIGHTBRACE_TOKEN (%d)\n", RIGHTBRACE_TOKEN);
-                break;
-            case SEMICOLON_TOKEN:
-                printf(";: SEMICOLON_TOKEN (%d)\n", SEMICOLON_TOKEN);
-                break;
             case TYPE_TOKEN:
-                printf("%s: TYPE_TOKEN (%d)\n", current->strval, TYPE_TOKEN);
-                break;
-            case MAIN_TOKEN:
-                printf("main: MAIN_TOKEN (%d)\n", MAIN_TOKEN);
-                break;
-            case WHILE_TOKEN:
-                printf("while: WHILE_TOKEN (%d)\n", WHILE_TOKEN);
-                break;
-            case IF_TOKEN:
-                printf("if: IF_TOKEN (%d)\n", IF_TOKEN);
-                break;
-            case ELSE_TOKEN:
-                printf("else: ELSE_TOKEN (%d)\n", ELSE_TOKEN);
-                break;
-            case EOF_TOKEN:
-                printf("EOF: EOF_TOKEN (%d); this token is not counted.\n", EOF_TOKEN);
+                if (current->strval != NULL) {
+                    writeBytes(&w, current->strval, strlen(current->strval));
+                } else {
+                    writeBytes(&w, "(null)", 6); // as printf("%s") does
+                }
                 break;
             default:
-                printf("Unknown token type: %d\n", current->type);
+                if ((unsigned int)current->type > EOF_TOKEN) {
+                    flushWriter(&w);
+                    fprintf(out, "Unknown token type: %d\n", current->type);
+                    fflush(out);
+                    continue;
+                }
                 break;
         }
-        current = current->next;
+        writeBytes(&w, tokenLines[current->type].str, tokenLines[current->type].len);
     }
+    flushWriter(&w);
 }
 
 void addASTNode(AST* ast, ASTNode* node, ASTNode* parent) {
@@ -794,6 +1189,7 @@ void addASTNode(AST* ast, ASTNode* node, ASTNode* parent) {
         }
     }
     node->parent = parent; // set the parent of the new node in the AST
+    node->dloc = parent != NULL ? node->loc - parent->loc : node->loc;
     node->sibling = NULL; // initialize sibling to NULL
     ast->current = node; // set the current node to the new node
     ast->nodeCount++;
@@ -825,6 +1221,7 @@ ASTNode* createASTNode(NonterminalType nonterminal, int loc) {
     node->parent = NULL;
     node->childCount = 0;
     node->loc = loc;
+    node->pos = node->len = node->dep = 0;
     return node;
 }
 
@@ -853,6 +1250,7 @@ ASTNode* createASTNodeT(TokenType token, int loc) {
     node->parent = NULL; // parent will be set later
     node->childCount = 0; // terminal nodes do not have children
     node->loc = loc;
+    node->pos = node->len = node->dep = 0;
     return node;
 }
 
@@ -864,34 +1262,217 @@ E -> num   (note: num is 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9)
 E -> ( S )
 */
 
+// All the state of the parser, so that several files can be parsed at the same time
+typedef struct Parser {
+    AST* ast;             // the AST being built
+    Lexer* lx;            // tokens are pulled from the lexer on demand, no token list is built
+    Token tok;            // the lookahead token
+    size_t tokLoc;        // start of the lookahead token in the text
+    size_t tokEnd;        // end of the lookahead token
+    size_t lastEnd;       // end of the last consumed token
+    size_t ntokens;       // number of tokens pulled, excluding EOF_TOKEN
+    int hasError;
+    int lexError;         // set together with hasError when the lexer fails
+    int afterLexError;    // in recovery mode, the lexer dropped a bad lexeme before the lookahead token
+    FILE* err;            // where the parse errors are printed
+    Diagnostics* diags;   // in recovery mode, where the parse errors are collected (lx->diags)
+    // for reparse(): the AST before the edit, and the edit
+    ASTNode* old;         // root of the old AST, NULL for a full parse
+    ASTNode* cur;         // last old node looked at by findOldNode()
+    size_t curStart;      // start of cur in the old text
+    size_t editOff;       // text[editOff, editOff + editDel) was replaced
+    size_t editDel;       // by editIns bytes
+    size_t editIns;
+    int created;          // number of nodes created
+    int reused;           // number of old subtrees reused
+} Parser;
+
+// consume the lookahead token and pull the next one
+void advance(Parser* ps) {
+    ps->lastEnd = ps->tokEnd;
+    int lexical = ps->diags != NULL ? ps->diags->lexical : 0;
+    int result = next_token(ps->lx, &ps->tok);
+    ps->afterLexError = ps->diags != NULL && ps->diags->lexical != lexical;
+    ps->tokLoc = ps->lx->loc - ps->lx->len;
+    ps->tokEnd = ps->lx->loc;
+    if (result != 0) {
+        ps->tok.type = EOF_TOKEN; // never look at a half-scanned token
+        ps->hasError = 1;
+        ps->lexError = 1;
+        return;
+    }
+    if (ps->tok.type != EOF_TOKEN) {
+        ps->ntokens++;
+    }
+}
+
+// Report a parse error at the lookahead token: print it to ps->err and set hasError,
+// so that the parser unwinds (returns 1). In recovery mode (ps->diags), the error is
+// collected instead, and the tokens are skipped up to a synchronizing one: ')' is kept
+// as the lookahead, to close an E -> ( S ), and ';' or '}' is consumed. Returns 0:
+// the caller goes on as if its symbol was parsed.
+// Right after a lexeme dropped by the lexer, the error is only the missing lexeme,
+// which is already reported: the tokens are skipped without a second diagnostic.
+int parseError(Parser* ps, const char* fmt, ...) {
+    if (ps->diags == NULL || !ps->afterLexError) {
+        va_list ap;
+        va_start(ap, fmt);
+        Diagnostic* d = ps->diags != NULL ? addDiagnostic(ps->diags, ps->tokLoc) : NULL;
+        if (d == NULL) {
+            if (ps->lx->lines != NULL) {
+                printPosition(ps->lx->lines, ps->tokLoc, ps->err);
+            }
+            vfprintf(ps->err, fmt, ap);
+            va_end(ap);
+            ps->hasError = 1;
+            return 1;
+        }
+        vsnprintf(d->msg, sizeof(d->msg), fmt, ap);
+        va_end(ap);
+    }
+    while (ps->tok.type != RIGHTPAREN_TOKEN && ps->tok.type != EOF_TOKEN) {
+        int sync = ps->tok.type == SEMICOLON_TOKEN || ps->tok.type == RIGHTBRACE_TOKEN;
+        advance(ps);
+        if (ps->hasError) {
+            return 1; // the lexer failed
+        }
+        if (sync) {
+            break;
+        }
+    }
+    return 0;
+}
+
+void printDiagnostics(const Diagnostics* diags, LineIndex* lines, FILE* out) {
+    for (int i = 0; i < diags->n; i++) {
+        const Diagnostic* d = &diags->items[i];
+        printPosition(lines, d->loc, out);
+        if (d->state >= 0) {
+            printLexError(out, d->state, d->c);
+        } else {
+            fputs(d->msg, out);
+        }
+    }
+    fprintf(out, "%d error%s (%d lexical)\n", diags->n, diags->n == 1 ? "" : "s", diags->lexical);
+}
+
+// Find the old node of the given type starting at pos in the old text.
+// The search starts from the node found last, as the nodes are looked for in the order of the text.
+ASTNode* findOldNode(Parser* ps, NonterminalType type, size_t pos) {
+    ASTNode* cur = ps->cur;
+    size_t curStart = ps->curStart;
+    while (cur != NULL && !(curStart <= pos && pos < curStart + cur->len)) { // climb up to a node containing pos
+        curStart -= cur->pos;
+        cur = cur->parent;
+    }
+    if (cur == NULL) {
+        cur = ps->old;
+        curStart = cur->pos;
+        if (!(curStart <= pos && pos < curStart + cur->len)) {
+            return NULL;
+        }
+    }
+    while (cur->kind != Nonterminal || cur->nonterminal != type || curStart != pos) { // go down
+        ASTNode* child = cur->firstChild;
+        while (child != NULL && !(child->kind == Nonterminal && curStart + child->pos <= pos &&
+                                  pos < curStart + child->pos + child->len)) {
+            child = child->sibling;
+        }
+        if (child == NULL) {
+            break;
+        }
+        curStart += child->pos;
+        cur = child;
+    }
+    ps->cur = cur;
+    ps->curStart = curStart;
+    return cur->kind == Nonterminal && cur->nonterminal == type && curStart == pos ? cur : NULL;
+}
+
+// Called when the parsing of node starts: if the old AST has the same node
+// at the same place, and the text it depends on is not edited, the children
+// of the old node are moved to node and the lexer skips the text of node.
+// Returns 1 if node is done.
+int reuseASTNode(Parser* ps, ASTNode* node) {
+    if (ps->old == NULL) {
+        return 0;
+    }
+    size_t pos = ps->tokLoc;
+    size_t oldPos;
+    if (pos < ps->editOff) {
+        oldPos = pos;
+    } else if (pos >= ps->editOff + ps->editIns) {
+        oldPos = pos - ps->editIns + ps->editDel;
+    } else {
+        return 0; // in the inserted text
+    }
+    ASTNode* old = findOldNode(ps, node->nonterminal, oldPos);
+    if (old == NULL || old->firstChild == NULL) {
+        return 0;
+    }
+    if (pos < ps->editOff && oldPos + old->dep >= ps->editOff) {
+        return 0; // its tokens or the lookahead token reach the edit
+    }
+    node->firstChild = old->firstChild;
+    node->lastChild = old->lastChild;
+    node->childCount = old->childCount;
+    for (ASTNode* child = node->firstChild; child != NULL; child = child->sibling) {
+        child->parent = node;
+    }
+    old->firstChild = old->lastChild = NULL;
+    node->len = old->len;
+    node->dep = old->dep;
+    ps->reused++;
+
+    ps->lx->loc = pos + node->len; // skip the text of node, then pull the lookahead token again
+    advance(ps);
+    ps->lastEnd = pos + node->len;
+    return 1;
+}
+
+// Called when the parsing of node, which started at start, is done
+void endASTNode(Parser* ps, ASTNode* node, size_t start) {
+    node->len = ps->lastEnd > start ? ps->lastEnd - start : 0;
+    node->dep = ps->tokEnd - start;
+}
+
+// for a terminal node: the lookahead token, which is about to be consumed
+void setTokenPos(Parser* ps, ASTNode* node, size_t start) {
+    node->pos = ps->tokLoc - start;
+    node->len = node->dep = ps->tokEnd - ps->tokLoc;
+}
+
 // Use recursive descent parser to parse the token list
 // The following functions are specific to the test string: (1+2+(3+4))+5
-void parse_S(AST* ast, TokenList* tokenlist, int loc);
-void parse_Sp(AST* ast, TokenList* tokenlist, int loc);
-void parse_E(AST* ast, TokenList* tokenlist, int loc);
+void parse_S(Parser* ps, int loc);
+void parse_Sp(Parser* ps, int loc);
+void parse_E(Parser* ps, int loc);
 
-int hasError = 0;
-#define ERR if (hasError) return;
-#define ERR2 if (hasError) return 0;
+// Note: the macros expect the parser to be named ps.
+#define ERR if (ps->hasError) return;
+#define ERR2 if (ps->hasError) return 0;
 #define ERR3(ptr) if (ptr == NULL) { \
-    hasError = 1; \
+    ps->hasError = 1; \
     return; \
 }
 #define ERR4(ptr) if (ptr == NULL) { \
-    hasError = 1; \
+    ps->hasError = 1; \
     return 0; \
 }
 
-void parse_S(AST* ast, TokenList* tokenlist, int loc) {
-    // if (tokenlist->current->type != LITERAL_TOKEN) {
+void parse_S(Parser* ps, int loc) {
+    AST* ast = ps->ast;
+    // if (ps->tok.type != LITERAL_TOKEN) {
     //     printf("Parsing S at %d, dealing token %s (%d)\n", loc,
-    //            tokenlist->current->strval, tokenlist->current->type);
+    //            ps->tok.strval, ps->tok.type);
     // } else {
     //     printf("Parsing S at %d, dealing token %d (%d)\n", loc,
-    //            tokenlist->current->intval, tokenlist->current->type);
+    //            ps->tok.intval, ps->tok.type);
     // }
     ASTNode* nodeS = ast->current; // nodeS already exists for parse_S
-    switch (tokenlist->current->type) {
+    size_t start = ps->tokLoc; // nodeS starts with the lookahead token
+    if (reuseASTNode(ps, nodeS)) return;
+    switch (ps->tok.type) {
         case LITERAL_TOKEN:
         case LEFTPAREN_TOKEN:
             // apply S -> E S'
@@ -900,38 +1481,45 @@ void parse_S(AST* ast, TokenList* tokenlist, int loc) {
             addASTNode(ast, nodeE, nodeS); // add E as a child of S (1st child)
             addASTNode(ast, nodeSp, nodeS); // add S' as a child of S (2nd child)
             ast->current = nodeE; // set the current node to E for the next parse
-            parse_E(ast, tokenlist, loc+5); ERR
+            nodeE->pos = ps->tokLoc - start;
+            parse_E(ps, loc+5); ERR
             // ast->current = ast->current->parent; // this should be equivalent to the following line
             ast->current = nodeSp; // set the current node to Sp for the next parse
-            parse_Sp(ast, tokenlist, loc+7); ERR
+            nodeSp->pos = ps->tokLoc - start;
+            parse_Sp(ps, loc+7); ERR
+            endASTNode(ps, nodeS, start);
             return;
         default:
-            fprintf(stderr, "ERROR in parsing S\n");
-            fprintf(stderr, "Handling token type %d at location %d\n", tokenlist->current->type, loc);
-            hasError = 1;
+            parseError(ps, "ERROR in parsing S\nHandling token type %d at location %d\n", ps->tok.type, loc); // recovered, or hasError is set
             return;
     }
 }
 
-void parse_Sp(AST* ast, TokenList* tokenlist, int loc) {
-    // if (tokenlist->current->type != LITERAL_TOKEN) {
+void parse_Sp(Parser* ps, int loc) {
+    AST* ast = ps->ast;
+    // if (ps->tok.type != LITERAL_TOKEN) {
     //     printf("Parsing S' at %d, dealing token %s (%d)\n", loc,
-    //            tokenlist->current->strval, tokenlist->current->type);
+    //            ps->tok.strval, ps->tok.type);
     // } else {
     //     printf("Parsing S' at %d, dealing token %d (%d)\n", loc,
-    //            tokenlist->current->intval, tokenlist->current->type);
+    //            ps->tok.intval, ps->tok.type);
     // }
     ASTNode* nodeSp = ast->current; // nodeSp already exists for parse_Sp
-    switch (tokenlist->current->type) {
+    size_t start = ps->tokLoc; // nodeSp starts with the lookahead token
+    if (reuseASTNode(ps, nodeSp)) return;
+    switch (ps->tok.type) {
         case PLUS_TOKEN:
             // apply S' -> + S
-            tokenlist->current = tokenlist->current->next; // consume the '+' token
             ASTNode* nodePlus = createASTNodeT(PLUS_TOKEN, loc+6); ERR3(nodePlus)
-            ASTNode* nodeS = createASTNode(S, loc+8); ERR3(nodeS)
+            setTokenPos(ps, nodePlus, start);
             addASTNode(ast, nodePlus, nodeSp); // add '+' as a child of S' (1st child)
+            advance(ps); ERR // consume the '+' token
+            ASTNode* nodeS = createASTNode(S, loc+8); ERR3(nodeS)
             addASTNode(ast, nodeS, nodeSp); // add S as a child of S' (2nd child)
             ast->current = nodeS; // set the current node to S for the next parse
-            parse_S(ast, tokenlist, loc+8); ERR
+            nodeS->pos = ps->tokLoc - start;
+            parse_S(ps, loc+8); ERR
+            endASTNode(ps, nodeSp, start);
             return;
         case RIGHTPAREN_TOKEN:
         case EOF_TOKEN: // end of file
@@ -939,198 +1527,1636 @@ void parse_Sp(AST* ast, TokenList* tokenlist, int loc) {
             // nodeSp->childCount = 0; // S' has no children in this case, but no need to set it
             ASTNode* nodeEpsilon = createASTNode(epsilon, loc+6); ERR3(nodeEpsilon)
             addASTNode(ast, nodeEpsilon, nodeSp); // add the ε node as a child of S' (1st child)
+            endASTNode(ps, nodeSp, start); // empty, but it depends on the lookahead token
             // Should this token (RIGHTPAREN_TOKEN or EOF_TOKEN) be consumed?
             // Ans: No, because S' is the last production in the grammar <-- verify this later
             return; // ε production
         default:
-            fprintf(stderr, "ERROR in parsing S'\n");
-            hasError = 1;
+            parseError(ps, "ERROR in parsing S'\n"); // recovered, or hasError is set
             return;
     }
 }
 
-void parse_E(AST* ast, TokenList* tokenlist, int loc) {
-    // if (tokenlist->current->type != LITERAL_TOKEN) {
+void parse_E(Parser* ps, int loc) {
+    AST* ast = ps->ast;
+    // if (ps->tok.type != LITERAL_TOKEN) {
     //     printf("Parsing E at %d, dealing token %s (%d)\n", loc,
-    //            tokenlist->current->strval, tokenlist->current->type);
+    //            ps->tok.strval, ps->tok.type);
     // } else {
     //     printf("Parsing E at %d, dealing token %d (%d)\n", loc,
-    //            tokenlist->current->intval, tokenlist->current->type);
+    //            ps->tok.intval, ps->tok.type);
     // }
     ASTNode* nodeE = ast->current; // nodeE already exists for parse_E
-    switch (tokenlist->current->type) {
+    size_t start = ps->tokLoc; // nodeE starts with the lookahead token
+    if (reuseASTNode(ps, nodeE)) return;
+    switch (ps->tok.type) {
         case LITERAL_TOKEN:
             // apply E -> num
             nodeE->childCount = 1; // E has one child: the literal token
             ASTNode* nodeNum = createASTNodeT(LITERAL_TOKEN, loc+5); ERR3(nodeNum)
-            nodeNum->intval = tokenlist->current->intval; // retrieve the value before consuming the token
+            nodeNum->intval = ps->tok.intval; // retrieve the value before consuming the token
+            setTokenPos(ps, nodeNum, start);
             addASTNode(ast, nodeNum, nodeE); // add the literal token as a child of E
-            tokenlist->current = tokenlist->current->next; // consume the literal token after retrieving its value
+            advance(ps); ERR // consume the literal token after retrieving its value
+            endASTNode(ps, nodeE, start);
             return;
         case LEFTPAREN_TOKEN:
             // apply E -> ( S )
-            tokenlist->current = tokenlist->current->next; // consume the '(' token
             ASTNode* nodeLParen = createASTNodeT(LEFTPAREN_TOKEN, loc+5); ERR3(nodeLParen)
+            setTokenPos(ps, nodeLParen, start);
+            addASTNode(ast, nodeLParen, nodeE); // add '(' as a child of E (1st child)
+            advance(ps); ERR // consume the '(' token
             ASTNode* nodeS = createASTNode(S, loc+7); ERR3(nodeS)
             ASTNode* nodeRParen = createASTNodeT(RIGHTPAREN_TOKEN, loc+9); ERR3(nodeRParen)
-            addASTNode(ast, nodeLParen, nodeE); // add '(' as a child of E (1st child)
             addASTNode(ast, nodeS, nodeE); // add S as a child of E (2nd child)
             addASTNode(ast, nodeRParen, nodeE); // add ')' as a child of E (3rd child)
             ast->current = nodeS; // set the current node to S for the next parse
-            parse_S(ast, tokenlist, loc+7); // parse the expression inside the parentheses
-            if (tokenlist->current->type != RIGHTPAREN_TOKEN) {
-                fprintf(stderr, "ERROR: expected RIGHTPAREN_TOKEN but found %d\n", tokenlist->current->type);
-                hasError = 1;
-                return;
+            nodeS->pos = ps->tokLoc - start;
+            parse_S(ps, loc+7); // parse the expression inside the parentheses
+            if (ps->lexError) return; // the lookahead is not a token, and the error is already reported
+            if (ps->tok.type != RIGHTPAREN_TOKEN) {
+                if (parseError(ps, "ERROR: expected RIGHTPAREN_TOKEN but found %d\n", ps->tok.type)) return;
+                if (ps->tok.type != RIGHTPAREN_TOKEN) return; // not closed before the end
             }
-            tokenlist->current = tokenlist->current->next; // consume the ')' token
+            setTokenPos(ps, nodeRParen, start);
+            advance(ps); ERR // consume the ')' token
+            endASTNode(ps, nodeE, start);
             return;
         default:
-            fprintf(stderr, "ERROR in parsing E\n");
-            hasError = 1;
+            parseError(ps, "ERROR in parsing E\n"); // recovered, or hasError is set
             return;
     }
 }
 
-// print space
-void sp(int n) {
-    for (int i = 0; i < n; i++) {
-        printf(" ");
+// Append len bytes to the text of a line of the blackboard.
+// Returns 0 on success, 1 on failure.
+int appendOutput(ASTOutputLn* ln, const char* str, int len) {
+    if (ln->len + len > ln->cap) {
+        int cap = ln->cap == 0 ? 32 : ln->cap * 2;
+        while (cap < ln->len + len) {
+            cap *= 2;
+        }
+        char* tmp = (char*)realloc(ln->line, cap);
+        if (tmp == NULL) {
+            return 1;
+        }
+        ln->line = tmp;
+        ln->cap = cap;
     }
+    memcpy(ln->line + ln->len, str, len);
+    ln->len += len;
+    return 0;
 }
 
-void printAST(AST* ast) {
-    if (ast->root == NULL) {
-        printf("printAST: AST is empty.\n");
-        return;
-    }
-    ASTNode* current = ast->current; // this will be altered during processing
-    if (current == NULL) {
-        printf("printAST: Current node is NULL.\n");
-        return;
+// Add a line to the blackboard for the expansion of a nonterminal at x coordinate loc,
+// with a '|' at each of the locCount x coordinates in locs. Returns NULL on failure.
+ASTOutputLn* addOutputLn(ASTOutput* output, int loc, const int* locs, int locCount) {
+    ASTOutputLn* ln = (ASTOutputLn*)calloc(1, sizeof(ASTOutputLn));
+    if (ln == NULL) {
+        return NULL;
     }
-    ASTNode* currentChild = current->firstChild; // for traversing children
-    sp(current->loc);
-    printf("%s ->", current->strval); // this must be a nonterminal node
-    current = current->firstChild;
-    while (current != NULL) {
-        printf(" ");
-        if (current->kind == Nonterminal) {
-            printf("%s", current->strval);
-        } else if (current->token != LITERAL_TOKEN) { // below must be a terminal node
-            printf("%s", current->strval);
-        } else { // terminal node with LITERAL_TOKEN
-            printf("%d", current->intval);
+    if (locCount > 0) {
+        ln->locs = (int*)malloc(sizeof(int) * locCount);
+        if (ln->locs == NULL) {
+            free(ln);
+            return NULL;
         }
-        current = current->sibling; // move to the next sibling
+        memcpy(ln->locs, locs, sizeof(int) * locCount);
     }
-    printf("\n");
+    ln->locCount = locCount;
+    ln->loc = loc;
+    if (output->last == NULL) {
+        output->blackboard = ln;
+    } else {
+        output->last->next = ln;
+    }
+    output->last = ln;
+    output->lineCount++;
+    return ln;
+}
 
-    // restore the current node to its original state and traverse its children
-    current = currentChild;
-    while (current != NULL) {
-        if (current->kind == Nonterminal) {
-            ast->current = current;
-            if (current->nonterminal != epsilon) { // do not print ε nodes
-                printAST(ast);
+void freeASTOutput(ASTOutput* output) {
+    ASTOutputLn* ln = output->blackboard;
+    while (ln != NULL) {
+        ASTOutputLn* next = ln->next;
+        free(ln->line);
+        free(ln->locs);
+        free(ln);
+        ln = next;
+    }
+    output->blackboard = output->last = NULL;
+    output->lineCount = 0;
+}
+
+// Print the blackboard: each line is drawn from its connectors and its text,
+// through a single buffered writer.
+void writeASTOutput(const ASTOutput* output, FILE* out) {
+    Writer w;
+    initWriter(&w, out);
+    for (const ASTOutputLn* ln = output->blackboard; ln != NULL; ln = ln->next) {
+        int x = 0; // x coordinate of the next byte
+        for (int i = 0; i < ln->locCount; i++) {
+            if (ln->locs[i] >= x && ln->locs[i] < ln->loc) { // the connectors are left of the text
+                writeSpaces(&w, ln->locs[i] - x);
+                writeBytes(&w, "|", 1);
+                x = ln->locs[i] + 1;
             }
         }
-        current = current->sibling;
+        if (ln->loc > x) {
+            writeSpaces(&w, ln->loc - x);
+        }
+        writeBytes(&w, ln->line, ln->len);
+        writeBytes(&w, "\n", 1);
     }
+    flushWriter(&w);
 }
 
-int rdparser(AST* ast, TokenList* tokenlist) {
-    // printf("Starting recursive descent parser...\n");
-    hasError = 0; // reset the error state
-    ast->nodeCount = 0; // reset the node count
-    ast->root = NULL; // initialize the root of the AST
-    ast->current = NULL; // initialize the current node of the AST
-    ast->nodeCount = 0; // initialize the node count of the AST
-    tokenlist->current = tokenlist->first;
-    if (tokenlist->current == NULL) {
-        fprintf(stderr, "ERROR: token list is empty\n");
-        return 0; // return 0 if the token list is empty
+// The nonterminals whose symbol is on the blackboard but not expanded yet,
+// with their x coordinate. The x coordinates increase from the bottom to the
+// top of the stack, so they are the connectors of the next line, in order.
+typedef struct OutputStack {
+    ASTNode** nodes;
+    size_t* flat;    // for a flat AST, the indices of the nodes instead
+    int* locs;
+    int n, cap;
+} OutputStack;
+
+int pushOutput(OutputStack* st, ASTNode* node, size_t flat, int loc) {
+    if (st->n == st->cap) {
+        int cap = st->cap == 0 ? 64 : st->cap * 2;
+        ASTNode** nodes = (ASTNode**)realloc(st->nodes, sizeof(ASTNode*) * cap);
+        st->nodes = nodes != NULL ? nodes : st->nodes;
+        size_t* indices = (size_t*)realloc(st->flat, sizeof(size_t) * cap);
+        st->flat = indices != NULL ? indices : st->flat;
+        int* locs = (int*)realloc(st->locs, sizeof(int) * cap);
+        st->locs = locs != NULL ? locs : st->locs;
+        if (nodes == NULL || indices == NULL || locs == NULL) {
+            return 1;
+        }
+        st->cap = cap;
+    }
+    st->nodes[st->n] = node;
+    st->flat[st->n] = flat;
+    st->locs[st->n++] = loc;
+    return 0;
+}
+
+void freeOutputStack(OutputStack* st) {
+    free(st->nodes);
+    free(st->flat);
+    free(st->locs);
+}
+
+// Fill the blackboard with the expansions of node, at x coordinate loc, and of the
+// nonterminals below it, in a single traversal without recursion. The children of
+// a node are expanded from the last one, so that the connector of each child goes
+// straight down to its expansion, left of the expansions of its right siblings:
+//   S -> E S'
+//        | S' -> + S
+//        |         S -> E S'
+//        |         ...
+//        E -> 3
+// Returns 0 on success, 1 on failure.
+int fillASTOutput(ASTOutput* output, ASTNode* node, int loc) {
+    OutputStack st = {0};
+    int failed = pushOutput(&st, node, 0, loc);
+    while (st.n > 0 && !failed) {
+        st.n--;
+        node = st.nodes[st.n];
+        loc = st.locs[st.n];
+        node->loc = loc; // the subtree may have been moved by reparse()
+        ASTOutputLn* ln = addOutputLn(output, loc, st.locs, st.n);
+        if (ln == NULL) {
+            failed = 1;
+            break;
+        }
+        failed |= appendOutput(ln, node->strval, strlen(node->strval)); // this must be a nonterminal node
+        failed |= appendOutput(ln, " ->", 3);
+        for (ASTNode* child = node->firstChild; child != NULL; child = child->sibling) {
+            failed |= appendOutput(ln, " ", 1);
+            if (child->kind == Terminal && child->token == LITERAL_TOKEN) {
+                char digits[21];
+                failed |= appendOutput(ln, digits, sprintf(digits, "%" PRId64, child->intval));
+            } else if (child->strval != NULL) {
+                failed |= appendOutput(ln, child->strval, strlen(child->strval));
+            } else {
+                failed |= appendOutput(ln, "(null)", 6); // as printf("%s") does
+            }
+            if (child->kind == Nonterminal && child->nonterminal != epsilon) { // ε nodes are not expanded
+                failed |= pushOutput(&st, child, 0, loc + child->dloc);
+            }
+        }
+    }
+    freeOutputStack(&st);
+    return failed;
+}
+
+void printAST(AST* ast, FILE* out) {
+    if (ast->root == NULL) {
+        fprintf(out, "printAST: AST is empty.\n");
+        return;
+    }
+    ASTNode* current = ast->current;
+    if (current == NULL) {
+        fprintf(out, "printAST: Current node is NULL.\n");
+        return;
+    }
+    int loc = current->parent != NULL ? current->parent->loc + current->dloc : current->loc;
+    ASTOutput output = {NULL, 0, NULL};
+    if (fillASTOutput(&output, current, loc) != 0) {
+        fprintf(out, "printAST: memory allocation failed\n");
+    } else {
+        writeASTOutput(&output, out);
+    }
+    freeASTOutput(&output);
+}
+
+// Output formats of the AST (option -f)
+typedef enum ASTFormat {
+    TextFormat, // printAST()
+    JSONFormat, // exportJSON()
+    DOTFormat   // exportDOT(), for Graphviz
+} ASTFormat;
+
+// write a string between double quotes, escaped for JSON and DOT
+void writeQuoted(Writer* w, const char* str) {
+    WRITESTR(w, "\"");
+    for (const char* p = str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            WRITESTR(w, "\\");
+        }
+        writeBytes(w, p, 1);
+    }
+    WRITESTR(w, "\"");
+}
+
+void writeSize(Writer* w, size_t value) {
+    char digits[24];
+    writeBytes(w, digits, sprintf(digits, "%zu", value));
+}
+
+// the text of a node, as printed by printAST()
+void writeSymbol(Writer* w, const ASTNode* node) {
+    if (node->kind == Terminal && node->token == LITERAL_TOKEN) {
+        char digits[21];
+        int n = sprintf(digits, "%" PRId64, node->intval);
+        WRITESTR(w, "\"");
+        writeBytes(w, digits, n);
+        WRITESTR(w, "\"");
+    } else {
+        writeQuoted(w, node->strval != NULL ? node->strval : "(null)");
+    }
+}
+
+// A node of the walk of exportJSON() and exportDOT(): the ancestors of the
+// current node are kept in an explicit stack, so that deep trees do not
+// overflow the call stack.
+typedef struct ExportFrame {
+    size_t id;    // number of the node in preorder
+    size_t start; // start of the node in the text
+} ExportFrame;
+
+typedef struct ExportStack {
+    ExportFrame* frames;
+    size_t n, cap;
+} ExportStack;
+
+int pushExport(ExportStack* st, size_t id, size_t start) {
+    if (st->n == st->cap) {
+        size_t cap = st->cap == 0 ? 64 : st->cap * 2;
+        ExportFrame* tmp = (ExportFrame*)realloc(st->frames, sizeof(ExportFrame) * cap);
+        if (tmp == NULL) {
+            return 1;
+        }
+        st->frames = tmp;
+        st->cap = cap;
     }
-    ASTNode* root = createASTNode(S, 0); ERR4(root)
-    root->strval = strdup("S"); // set the name of the root node
+    st->frames[st->n].id = id;
+    st->frames[st->n++].start = start;
+    return 0;
+}
+
+// Write the AST as a JSON object per node, with its absolute position in the text:
+// {"kind":"nonterminal","symbol":"S","pos":0,"len":5,"children":[...]}
+// {"kind":"terminal","token":"LITERAL_TOKEN","symbol":"1","value":1,"pos":0,"len":1}
+// With lines, "line" and "col" of the start of each node follow "pos".
+// Returns 0 on success, 1 on failure.
+int exportJSON(const AST* ast, LineIndex* lines, FILE* out) {
+    ExportStack st = {0};
+    Writer w;
+    initWriter(&w, out);
+    ASTNode* node = ast->root;
+    int failed = 0;
+    while (node != NULL && !failed) {
+        size_t start = st.n > 0 ? st.frames[st.n - 1].start + node->pos : node->pos; // the root is absolute
+        if (node->parent != NULL && node != node->parent->firstChild) {
+            WRITESTR(&w, ",");
+        }
+        if (node->kind == Nonterminal) {
+            WRITESTR(&w, "{\"kind\":\"nonterminal\",\"symbol\":");
+        } else {
+            WRITESTR(&w, "{\"kind\":\"terminal\",\"token\":\"");
+            writeBytes(&w, tokenNames[node->token].str, tokenNames[node->token].len);
+            WRITESTR(&w, "\",\"symbol\":");
+        }
+        writeSymbol(&w, node);
+        if (node->kind == Terminal && node->token == LITERAL_TOKEN) {
+            WRITESTR(&w, ",\"value\":");
+            writeInt(&w, node->intval);
+        }
+        WRITESTR(&w, ",\"pos\":");
+        writeSize(&w, start);
+        size_t line, column;
+        if (lines != NULL && lineColumn(lines, start, &line, &column) == 0) {
+            WRITESTR(&w, ",\"line\":");
+            writeSize(&w, line);
+            WRITESTR(&w, ",\"col\":");
+            writeSize(&w, column);
+        }
+        WRITESTR(&w, ",\"len\":");
+        writeSize(&w, node->len);
+        if (node->firstChild != NULL) {
+            WRITESTR(&w, ",\"children\":[");
+            failed = pushExport(&st, 0, start);
+            node = node->firstChild;
+            continue;
+        }
+        WRITESTR(&w, "}");
+        while (node != NULL && node->sibling == NULL) { // close the nodes whose last child is done
+            node = node->parent;
+            if (node != NULL) {
+                st.n--;
+                WRITESTR(&w, "]}");
+            }
+        }
+        if (node != NULL) {
+            node = node->sibling;
+        }
+    }
+    WRITESTR(&w, "\n");
+    flushWriter(&w);
+    free(st.frames);
+    return failed;
+}
+
+// Write the AST as a Graphviz digraph: the nodes are numbered in preorder,
+// the nonterminals are ellipses and the terminals are boxes.
+// Returns 0 on success, 1 on failure.
+int exportDOT(const AST* ast, FILE* out) {
+    ExportStack st = {0};
+    Writer w;
+    initWriter(&w, out);
+    WRITESTR(&w, "digraph AST {\n");
+    ASTNode* node = ast->root;
+    size_t id = 0;
+    int failed = 0;
+    while (node != NULL && !failed) {
+        WRITESTR(&w, "  n");
+        writeSize(&w, id);
+        WRITESTR(&w, " [label=");
+        writeSymbol(&w, node);
+        if (node->kind == Terminal) {
+            WRITESTR(&w, ", shape=box");
+        }
+        WRITESTR(&w, "];\n");
+        if (st.n > 0) {
+            WRITESTR(&w, "  n");
+            writeSize(&w, st.frames[st.n - 1].id);
+            WRITESTR(&w, " -> n");
+            writeSize(&w, id);
+            WRITESTR(&w, ";\n");
+        }
+        if (node->firstChild != NULL) {
+            failed = pushExport(&st, id++, 0);
+            node = node->firstChild;
+            continue;
+        }
+        id++;
+        while (node != NULL && node->sibling == NULL) {
+            node = node->parent;
+            if (node != NULL) {
+                st.n--;
+            }
+        }
+        if (node != NULL) {
+            node = node->sibling;
+        }
+    }
+    WRITESTR(&w, "}\n");
+    flushWriter(&w);
+    free(st.frames);
+    return failed;
+}
+
+// print the whole AST in the given format, lines is only used by JSONFormat (may be NULL)
+void exportAST(AST* ast, ASTFormat format, LineIndex* lines, FILE* out) {
+    int failed = 0;
+    switch (format) {
+        case JSONFormat: failed = exportJSON(ast, lines, out); break;
+        case DOTFormat: failed = exportDOT(ast, out); break;
+        default:
+            ast->current = ast->root;
+            printAST(ast, out);
+            break;
+    }
+    if (failed) {
+        fprintf(out, "exportAST: memory allocation failed\n");
+    }
+}
+
+// Parse the text of lx into ast. For reparse(), ps->old and the edit are already set.
+int parseText(Parser* ps, AST* ast, Lexer* lx, FILE* err) {
+    ps->ast = ast;
+    ps->err = err;
+    ps->lx = lx;
+    ps->diags = lx->diags;
+    ps->ntokens = 0;
+    ps->hasError = 0; // reset the error state
+    ps->lexError = 0;
+    ps->afterLexError = 0;
+    ps->tokEnd = 0;
+    ps->reused = 0;
+    ast->nodeCount = 0; // reset the node count
+    ast->root = NULL; // initialize the root of the AST
+    ast->current = NULL; // initialize the current node of the AST
+    ast->nodeCount = 0; // initialize the node count of the AST
+    advance(ps); ERR2 // pull the first lookahead token
+    ASTNode* root = createASTNode(S, 0); ERR4(root) // createASTNode() already names it "S"
     // printf("Root node created: %s %p\n", root->strval, (void*)root);
     addASTNode(ast, root, NULL); // add the root node to the AST
-    parse_S(ast, tokenlist, 0); ERR2
+    root->pos = ps->tokLoc; // the root is relative to the start of the text
+    parse_S(ps, 0); ERR2
+    // the grammar ignores what follows S, but the rest of the file must still be scanned,
+    // so that lexical errors there are reported as before
+    while (ps->tok.type != EOF_TOKEN) {
+        advance(ps); ERR2
+    }
     return 1; // return 1 if parsing is successful
 }
 
-int main(int argc, char* argv[]) {
-    char filename[MAXFILENAME];
-    int useDefault = 0;
-    if (argc == 1) {
-        useDefault = 1;
-        strcpy(filename, SAMPLEFILE); // '\0' is added automatically via strcpy()
-    } else if (argc >= 2) {
-        strcpy(filename, argv[1]);
-        printf("Using file: %s\n", filename);
-    }
-    
-    // Scanner
-    TokenList tokenList;
-    int state = scanner(filename, &tokenList, useDefault);
-    if (state != 0) {
-        fprintf(stderr, "Scanner error!\n");
+int rdparser(Parser* ps, AST* ast, Lexer* lx, FILE* err) {
+    // printf("Starting recursive descent parser...\n");
+    ps->old = NULL;
+    return parseText(ps, ast, lx, err);
+}
+
+// free all the nodes of the AST without recursion:
+// the children of a node are spliced in front of its siblings before the node is freed
+// Returns the number of nodes freed.
+int freeAST(AST* ast) {
+    int freed = 0;
+    ASTNode* node = ast->root;
+    while (node != NULL) {
+        if (node->firstChild != NULL) {
+            node->lastChild->sibling = node->sibling;
+            node->sibling = node->firstChild;
+        }
+        ASTNode* next = node->sibling;
+        if (node->kind == Nonterminal || node->token != LITERAL_TOKEN) {
+            free(node->strval); // free the string if it is allocated
+        }
+        free(node);
+        freed++;
+        node = next;
+    }
+    ast->root = NULL;
+    ast->current = NULL;
+    ast->nodeCount = 0;
+    return freed;
+}
+
+// Replace text[off, off + del) of an opened lexer by ins[0, insLen) in place,
+// and rewind the lexer. The content cache only moves when it has to grow.
+// Returns 0 on success, 1 on failure.
+int editLexer(Lexer* lx, size_t off, size_t del, const char* ins, size_t insLen) {
+    if (off > lx->size || del > lx->size - off) {
         return 1;
-    } else {
-        // printf("Scanner completed successfully.\n");
     }
+    size_t size = lx->size - del + insLen;
+    size_t cap = lx->cap != 0 ? lx->cap : lx->size + 1;
+    if (size + 1 > cap) {
+        while (cap < size + 1) {
+            cap *= 2;
+        }
+        unsigned char* content = (unsigned char*)realloc(lx->ptr, cap);
+        if (content == NULL) {
+            return 1;
+        }
+        lx->ptr = content;
+        lx->cap = cap;
+    }
+    memmove(lx->ptr + off + insLen, lx->ptr + off + del, lx->size - off - del);
+    memcpy(lx->ptr + off, ins, insLen);
+    lx->ptr[size] = EOFF;
+    lx->size = size;
+    lx->loc = 0;
+    return 0;
+}
 
-    // Print the token list
-    // printTokenList(&tokenList);
+// Incremental parsing: ast was parsed from the text of lx before text[off, off + del)
+// was replaced by insLen bytes (see editLexer()). Parse the new text into ast again,
+// reusing every subtree of the old AST whose text and lookahead token are not
+// touched by the edit. Only the nodes on the way from the root to the edit are new.
+// Returns 1 on success, 0 on failure (as rdparser()).
+int reparse(Parser* ps, AST* ast, Lexer* lx, size_t off, size_t del, size_t insLen, FILE* err) {
+    AST old = *ast;
+    ps->old = old.root;
+    ps->cur = NULL;
+    ps->curStart = 0;
+    ps->editOff = off;
+    ps->editDel = del;
+    ps->editIns = insLen;
+    lx->loc = 0;
+    int result = old.root != NULL ? parseText(ps, ast, lx, err) : rdparser(ps, ast, lx, err);
+    ps->created = ast->nodeCount;
+    ps->old = NULL;
+    int oldCount = old.nodeCount;
+    int freed = freeAST(&old); // the nodes whose children were moved are freed as well
+    ast->nodeCount += oldCount - freed;
+    return result;
+}
 
-    // Parser: to generate the AST
-    // printf("\nStarting parser...\n");
-    AST* ast = (AST*)malloc(sizeof(AST));
-    if (ast == NULL) {
-        fprintf(stderr, "ERROR: memory allocation failed for AST\n");
+/*===========================*/
+// Flat AST                  //
+/*===========================*/
+
+// A pointer-free copy of an AST, to be saved once and mapped with mmap()
+// by any number of processes. The nodes are in preorder: the first child of
+// a node is the next node, and each following child is found by skipping
+// the subtree of the previous one, so all links are relative.
+// The columns of the printed tree are not stored either: each child of a node
+// is printed in its own column of the line of the node (see fillFlatOutput()).
+// Layout, in native byte order: FlatASTHeader, then FlatNode[nodeCount].
+// The header holds a hash of the nodes, so that a corrupt file is rejected
+// (and parsed again with -c) rather than printed.
+// The symbols of this grammar have no text but the literals, so there is
+// no string table: the names are derived from the types (see symbolName()).
+#define FLATSUFFIX ".ast"
+#define FLATMAGIC 0x31545341u // "AST1"
+#define FLATVERSION 4
+
+typedef struct FlatASTHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nodeCount;
+    uint64_t hash;      // hashContent() of the parsed text
+    uint64_t size;      // size of the parsed text
+    uint64_t ntokens;   // number of tokens parsed
+    uint64_t bodyHash;  // hashContent() of the nodes
+} FlatASTHeader;
+
+typedef struct FlatNode {
+    uint8_t kind;        // SymbolKind
+    uint8_t type;        // NonterminalType or TokenType
+    uint16_t childCount;
+    uint32_t size;       // number of nodes in the subtree: the next sibling is at this + size
+    int64_t intval;      // for LITERAL_TOKEN
+    uint64_t pos;        // as in ASTNode
+    uint64_t len;
+} FlatNode;
+
+// a flat AST mapped by openFlatAST()
+typedef struct FlatAST {
+    void* map;
+    size_t mapSize;
+    const FlatASTHeader* header;
+    const FlatNode* nodes;
+} FlatAST;
+
+// 64-bit FNV-1a
+uint64_t hashContent(const unsigned char* content, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        h ^= content[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// the name of a symbol as printed by printAST()
+Name symbolName(int kind, int type) {
+    if (kind == Nonterminal) {
+        switch (type) {
+            case S: return (Name)NAME("S");
+            case Sp: return (Name)NAME("S'");
+            case E: return (Name)NAME("E");
+            default: return (Name)NAME("epsilon");
+        }
+    }
+    switch (type) {
+        case PLUS_TOKEN: return (Name)NAME("+");
+        case LEFTPAREN_TOKEN: return (Name)NAME("(");
+        case RIGHTPAREN_TOKEN: return (Name)NAME(")");
+        default: return (Name)NAME("(null)"); // no other token is in an AST
+    }
+}
+
+// Copy ast into a malloc'ed array of nodes in preorder, without recursion.
+// Returns the number of nodes, 0 on failure.
+size_t flattenAST(const AST* ast, FlatNode** flat) {
+    size_t cap = ast->nodeCount > 0 ? ast->nodeCount : 16;
+    size_t depthCap = 64;
+    FlatNode* nodes = (FlatNode*)malloc(sizeof(FlatNode) * cap);
+    size_t* open = (size_t*)malloc(sizeof(size_t) * depthCap); // the ancestors of node
+    size_t n = 0, depth = 0;
+    ASTNode* node = ast->root;
+    while (node != NULL && nodes != NULL && open != NULL) {
+        if (n == cap) {
+            cap *= 2;
+            FlatNode* tmp = (FlatNode*)realloc(nodes, sizeof(FlatNode) * cap);
+            if (tmp == NULL) {
+                break;
+            }
+            nodes = tmp;
+        }
+        FlatNode* f = &nodes[n];
+        f->kind = (uint8_t)node->kind;
+        f->type = (uint8_t)(node->kind == Nonterminal ? (int)node->nonterminal : (int)node->token);
+        f->childCount = 0;
+        f->size = 1;
+        f->intval = node->kind == Terminal && node->token == LITERAL_TOKEN ? node->intval : 0;
+        f->pos = node->pos;
+        f->len = node->len;
+        if (depth > 0) {
+            nodes[open[depth - 1]].childCount++;
+        }
+        n++;
+        if (node->firstChild != NULL) {
+            if (depth == depthCap) {
+                depthCap *= 2;
+                size_t* tmp = (size_t*)realloc(open, sizeof(size_t) * depthCap);
+                if (tmp == NULL) {
+                    break;
+                }
+                open = tmp;
+            }
+            open[depth++] = n - 1;
+            node = node->firstChild;
+            continue;
+        }
+        while (node != NULL && node->sibling == NULL) { // the subtrees of the ancestors without a next sibling are done
+            node = node->parent;
+            if (node != NULL) {
+                depth--;
+                nodes[open[depth]].size = (uint32_t)(n - open[depth]);
+            }
+        }
+        if (node != NULL) {
+            node = node->sibling;
+        }
+    }
+    free(open);
+    if (node != NULL || nodes == NULL || n == 0) { // stopped by a failed allocation
+        free(nodes);
+        return 0;
+    }
+    *flat = nodes;
+    return n;
+}
+
+// Check that the nodes form a single tree in preorder with valid symbols,
+// so that a reader can follow the relative links without bounds checks.
+// Linear time: each node is skipped once as the child of its parent.
+int validFlatNodes(const FlatNode* nodes, uint64_t n) {
+    if (n == 0 || nodes[0].size != n) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        const FlatNode* f = &nodes[i];
+        if (f->size == 0 || f->size > n - i) {
+            return 0;
+        }
+        if (f->kind == Terminal) {
+            if (f->type >= EOF_TOKEN || f->size != 1 || f->childCount != 0) {
+                return 0;
+            }
+        } else if (f->kind != Nonterminal || f->type > epsilon) {
+            return 0;
+        }
+    }
+    for (uint64_t i = 0; i < n; i++) { // the children exactly cover the subtree
+        uint64_t end = i + nodes[i].size;
+        uint64_t j = i + 1;
+        int k = 0;
+        while (j < end) {
+            j += nodes[j].size;
+            k++;
+        }
+        if (j != end || k != nodes[i].childCount) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Save ast, parsed from a text with this hash and size, to path.
+// The file is written under a temporary name and renamed, so that a reader
+// never maps a partial file. Returns 0 on success, 1 on failure.
+int writeFlatAST(const char* path, const AST* ast, uint64_t hash, size_t size, size_t ntokens) {
+    FlatNode* nodes = NULL;
+    size_t n = flattenAST(ast, &nodes);
+    char* tmp = (char*)malloc(strlen(path) + 8);
+    if (n == 0 || tmp == NULL) {
+        free(nodes);
+        free(tmp);
+        return 1;
+    }
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        fchmod(fd, 0644); // mkstemp() creates it private
+    }
+    FILE* fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    int failed = fp == NULL;
+    if (fp == NULL && fd >= 0) {
+        close(fd);
+    }
+    if (!failed) {
+        FlatASTHeader header = {FLATMAGIC, FLATVERSION, n, hash, size, ntokens,
+                                hashContent((const unsigned char*)nodes, sizeof(FlatNode) * n)};
+        int ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(nodes, sizeof(FlatNode), n, fp) == n;
+        ok = fclose(fp) == 0 && ok;
+        failed = !ok || rename(tmp, path) != 0;
+    }
+    if (failed && fd >= 0) {
+        unlink(tmp);
+    }
+    free(nodes);
+    free(tmp);
+    return failed;
+}
+
+void closeFlatAST(FlatAST* fa) {
+    munmap(fa->map, fa->mapSize);
+}
+
+// Map a flat AST and validate it: its body hash, then its structure.
+// Returns 0 on success, 1 if the file cannot be mapped or is not a valid flat AST.
+int openFlatAST(FlatAST* fa, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
         return 1;
     }
-    rdparser(ast, &tokenList);
-    if (hasError) {
-        fprintf(stderr, "Parser error!\n");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FlatASTHeader)) {
+        close(fd);
         return 1;
+    }
+    fa->mapSize = st.st_size;
+    fa->map = mmap(NULL, fa->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (fa->map == MAP_FAILED) {
+        return 1;
+    }
+    fa->header = (const FlatASTHeader*)fa->map;
+    fa->nodes = (const FlatNode*)(fa->header + 1);
+    uint64_t n = fa->header->nodeCount;
+    if (fa->header->magic != FLATMAGIC || fa->header->version != FLATVERSION
+        || n > (fa->mapSize - sizeof(FlatASTHeader)) / sizeof(FlatNode)
+        || sizeof(FlatASTHeader) + n * sizeof(FlatNode) != fa->mapSize
+        || hashContent((const unsigned char*)fa->nodes, n * sizeof(FlatNode)) != fa->header->bodyHash
+        || !validFlatNodes(fa->nodes, n)) {
+        closeFlatAST(fa);
+        return 1;
+    }
+    return 0;
+}
+
+// Fill the blackboard from a flat AST, as fillASTOutput() does. Returns 0 on success, 1 on failure.
+int fillFlatOutput(ASTOutput* output, const FlatAST* fa) {
+    const FlatNode* nodes = fa->nodes;
+    OutputStack st = {0};
+    int failed = pushOutput(&st, NULL, 0, 0);
+    while (st.n > 0 && !failed) {
+        st.n--;
+        size_t i = st.flat[st.n];
+        int loc = st.locs[st.n];
+        ASTOutputLn* ln = addOutputLn(output, loc, st.locs, st.n);
+        if (ln == NULL) {
+            failed = 1;
+            break;
+        }
+        Name name = symbolName(nodes[i].kind, nodes[i].type);
+        failed |= appendOutput(ln, name.str, name.len);
+        failed |= appendOutput(ln, " ->", 3);
+        int col = loc + name.len + 3; // the column of the next child, as the parser places them
+        for (size_t j = i + 1; j < i + nodes[i].size && !failed; j += nodes[j].size) {
+            const FlatNode* child = &nodes[j];
+            failed |= col > INT_MAX - 32; // only a forged file gets this wide
+            failed |= appendOutput(ln, " ", 1);
+            col++;
+            if (child->kind == Nonterminal && child->type != epsilon) {
+                failed |= pushOutput(&st, NULL, j, col);
+            }
+            if (child->kind == Terminal && child->type == LITERAL_TOKEN) {
+                char digits[21];
+                int len = sprintf(digits, "%" PRId64, child->intval);
+                failed |= appendOutput(ln, digits, len);
+                col += len;
+            } else {
+                name = symbolName(child->kind, child->type);
+                failed |= appendOutput(ln, name.str, name.len);
+                col += name.len;
+            }
+        }
+    }
+    freeOutputStack(&st);
+    return failed;
+}
+
+// print a flat AST as printAST() does
+void printFlatAST(const FlatAST* fa, FILE* out) {
+    ASTOutput output = {NULL, 0, NULL};
+    if (fillFlatOutput(&output, fa) != 0) {
+        fprintf(out, "printAST: memory allocation failed\n");
     } else {
-        // printf("Parser completed successfully.\n");
+        writeASTOutput(&output, out);
     }
+    freeASTOutput(&output);
+}
 
-    // print the AST
-    // printf("There are %d nodes in the AST.\n", ast->nodeCount);
-    ast->current = ast->root;
-    printAST(ast);
+// "<filename>.ast", to be freed by the caller
+char* flatPath(const char* filename) {
+    size_t len = strlen(filename);
+    char* path = (char*)malloc(len + sizeof(FLATSUFFIX));
+    if (path != NULL) {
+        memcpy(path, filename, len);
+        memcpy(path + len, FLATSUFFIX, sizeof(FLATSUFFIX));
+    }
+    return path;
+}
 
-    // free the memory allocated for the token list, the AST, and the AST nodes
-    // and all mallocated strings inside ASTNode and Token
-    Token* current = tokenList.first;
-    while (current != NULL) {
-        Token* next = current->next;
-        if (current->strval != NULL && current->type != LITERAL_TOKEN) {
-            free(current->strval); // free the string if it is allocated
+/*===========================*/
+// Parser statistics         //
+/*===========================*/
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// What an AST costs, collected by walking it after the parse (option -s):
+// the parser itself keeps no counter, so it is not slowed down without -s.
+typedef struct ParseStats {
+    size_t nonterminals[epsilon + 1]; // number of nodes of each nonterminal
+    size_t terminals[EOF_TOKEN + 1];  // number of nodes of each token type
+    size_t nodes;                     // all of them
+    size_t stringBytes;               // the strings of the nodes (strval), with their NUL
+    size_t textBytes;                 // the content cache of the lexer, with its EOFF
+    int maxDepth;                     // deepest parse_S(), parse_Sp() or parse_E() call, the root is 1
+    double readTime, parseTime, printTime; // wall time of each phase in seconds
+} ParseStats;
+
+void collectParseStats(const AST* ast, ParseStats* st) {
+    ASTNode* node = ast->root;
+    int depth = 1;
+    while (node != NULL) {
+        st->nodes++;
+        if (node->kind == Nonterminal) {
+            st->nonterminals[node->nonterminal]++;
+            if (node->nonterminal != epsilon && depth > st->maxDepth) { // epsilon is not parsed by a call
+                st->maxDepth = depth;
+            }
+        } else {
+            st->terminals[node->token]++;
         }
-        free(current);
-        current = next;
+        if ((node->kind == Nonterminal || node->token != LITERAL_TOKEN) && node->strval != NULL) {
+            st->stringBytes += strlen(node->strval) + 1;
+        }
+        if (node->firstChild != NULL) {
+            node = node->firstChild;
+            depth++;
+            continue;
+        }
+        while (node != NULL && node->sibling == NULL) {
+            node = node->parent;
+            depth--;
+        }
+        if (node != NULL) {
+            node = node->sibling;
+        }
+    }
+}
+
+void printParseStats(const ParseStats* st, FILE* out) {
+    fprintf(out, "Parser statistics: total %zu nodes, max depth %d\n", st->nodes, st->maxDepth);
+    for (int t = S; t <= epsilon; t++) {
+        fprintf(out, "%s : %zu\n", symbolName(Nonterminal, t).str, st->nonterminals[t]);
+    }
+    for (int t = PLUS_TOKEN; t <= EOF_TOKEN; t++) {
+        if (st->terminals[t] > 0) {
+            fprintf(out, "%s : %zu\n", tokenNames[t].str, st->terminals[t]);
+        }
+    }
+    size_t nodeBytes = st->nodes * sizeof(ASTNode);
+    fprintf(out, "Memory: %zu bytes of nodes (%zu each), %zu bytes of strings, %zu bytes of text, total %zu bytes\n",
+            nodeBytes, sizeof(ASTNode), st->stringBytes, st->textBytes, nodeBytes + st->stringBytes + st->textBytes);
+    fprintf(out, "Time: read %.3f ms, parse %.3f ms, print %.3f ms\n",
+            st->readTime * 1e3, st->parseTime * 1e3, st->printTime * 1e3);
+}
+
+/*===========================*/
+// Driver                    //
+/*===========================*/
+
+// Scan and parse one file (or the default test string), and print its AST to out in the given format.
+// With useCache, the AST is printed from "<filename>.ast" if it was saved from
+// the same text, and saved there otherwise (see writeFlatAST()); only the text format is cached.
+// With recover, the parse goes on after errors, which are all printed at the end.
+// With positions, the errors and the JSON nodes get their line and column.
+// With useStats, the statistics of the parse (see ParseStats) are printed to err after the AST,
+// and the cache is not used.
+// Errors are printed to err. bytes and tokens are set for throughput reports.
+// Returns 0 on success, 1 on failure.
+int parseFile(const char* filename, int useDefault, int useCache, int recover, int positions, int useStats, ASTFormat format, FILE* out, FILE* err, size_t* bytes, size_t* tokens) {
+    *bytes = 0;
+    *tokens = 0;
+    ParseStats stats = {0};
+    double mark = useStats ? now() : 0; // start of the current phase
+
+    // Scanner: only reads the file, tokens are scanned when the parser asks for them
+    Lexer lx;
+    if (openLexer(&lx, filename, useDefault, out) != 0) {
+        fprintf(err, "Scanner error!\n");
+        return 1;
+    }
+    *bytes = lx.size;
+    if (useStats) {
+        stats.readTime = now() - mark;
+        stats.textBytes = lx.size + 1;
     }
-    // printf("Token list freed.\n");
 
-    // free the AST nodes
-    ASTNode* astCurrent = ast->root;
-    while (astCurrent != NULL) {
-        ASTNode* astNext = astCurrent->sibling;
-        if (astCurrent->strval != NULL) {
-            free(astCurrent->strval); // free the string if it is allocated
+    char* path = useCache && !useStats && !useDefault && format == TextFormat ? flatPath(filename) : NULL;
+    uint64_t hash = path != NULL ? hashContent(lx.ptr, lx.size) : 0;
+    FlatAST fa;
+    if (path != NULL && openFlatAST(&fa, path) == 0) {
+        int hit = fa.header->hash == hash && fa.header->size == lx.size;
+        if (hit) {
+            *tokens = fa.header->ntokens;
+            printFlatAST(&fa, out);
+        }
+        closeFlatAST(&fa);
+        if (hit) {
+            free(path);
+            free(lx.ptr);
+            return 0;
         }
-        free(astCurrent);
-        astCurrent = astNext;
     }
-    free(ast);
-    // printf("AST nodes freed.\n");
 
-    // free the content of the file
-    free(ptr); // free the memory cache allocated in scanner
+    Diagnostics diags = {0};
+    if (recover) {
+        lx.diags = &diags;
+    }
+    LineIndex lines; // built only if a position is printed
+    initLineIndex(&lines, lx.ptr, lx.size);
+    if (positions) {
+        lx.lines = &lines;
+    }
 
+    // Parser: to generate the AST
+    AST ast;
+    Parser ps;
+    if (useStats) {
+        mark = now();
+    }
+    rdparser(&ps, &ast, &lx, err);
+    if (useStats) {
+        stats.parseTime = now() - mark;
+    }
+    *tokens = ps.ntokens;
+    if (diags.n > 0) {
+        printDiagnostics(&diags, &lines, err);
+        ps.hasError = 1;
+        ps.lexError |= diags.lexical > 0;
+    }
+    if (ps.lexError) {
+        fprintf(err, "Scanner error!\n");
+    } else if (ps.hasError) {
+        fprintf(err, "Parser error!\n");
+    } else {
+        // print the AST
+        if (useStats) {
+            mark = now();
+        }
+        exportAST(&ast, format, positions ? &lines : NULL, out);
+        if (useStats) {
+            stats.printTime = now() - mark;
+        }
+        if (path != NULL) {
+            writeFlatAST(path, &ast, hash, lx.size, ps.ntokens);
+        }
+    }
+    if (useStats) { // also for a failed parse, the AST is what was built before the error
+        collectParseStats(&ast, &stats);
+        printParseStats(&stats, err);
+    }
+
+    // free the AST nodes and all mallocated strings inside ASTNode
+    freeAST(&ast);
+    freeLineIndex(&lines);
+    free(diags.items);
+    free(path);
+    free(lx.ptr); // free the memory cache allocated in scanner
+    return ps.hasError;
+}
+
+// Parse a file, then apply the edits "offset:deleted:text" one by one, each followed by
+// reparse(), and print the final AST to out. The work done for each edit is reported to err.
+// A text that does not parse between two edits is parsed again from scratch after the next
+// one, as its partial AST has no len and dep to reuse.
+// With positions, the JSON nodes get their line and column in the edited text.
+// Returns 0 on success, 1 on failure.
+int editFile(const char* filename, char** edits, int nedits, int positions, ASTFormat format, FILE* out, FILE* err) {
+    Lexer lx;
+    if (openLexer(&lx, filename, 0, out) != 0) {
+        fprintf(err, "Scanner error!\n");
+        return 1;
+    }
+    AST ast;
+    Parser ps;
+    rdparser(&ps, &ast, &lx, err);
+    for (int i = 0; i < nedits; i++) {
+        size_t off, del;
+        int n = 0;
+        sscanf(edits[i], "%zu:%zu:%n", &off, &del, &n);
+        size_t insLen = n > 0 ? strlen(edits[i] + n) : 0;
+        if (n == 0 || editLexer(&lx, off, del, edits[i] + n, insLen) != 0) {
+            fprintf(err, "Error: invalid edit %s\n", edits[i]);
+            freeAST(&ast);
+            free(lx.ptr);
+            return 1;
+        }
+        double start = now();
+        if (ps.hasError) {
+            freeAST(&ast);
+            rdparser(&ps, &ast, &lx, err);
+            ps.created = ast.nodeCount;
+        } else {
+            reparse(&ps, &ast, &lx, off, del, insLen, err);
+        }
+        fprintf(err, "Edit %s: %d new nodes, %d subtrees reused, %d nodes, %.3f ms\n",
+                edits[i], ps.created, ps.reused, ast.nodeCount, (now() - start) * 1e3);
+    }
+    if (ps.lexError) {
+        fprintf(err, "Scanner error!\n");
+    } else if (ps.hasError) {
+        fprintf(err, "Parser error!\n");
+    } else {
+        LineIndex lines;
+        initLineIndex(&lines, lx.ptr, lx.size);
+        exportAST(&ast, format, positions ? &lines : NULL, out);
+        freeLineIndex(&lines);
+    }
+    freeAST(&ast);
+    free(lx.ptr);
+    return ps.hasError;
+}
+
+// Scan a file (or the default test string) and print its token list instead of parsing it.
+// Returns 0 on success, 1 on failure.
+int printTokensFile(const char* filename, int useDefault, FILE* out, FILE* err) {
+    Lexer lx;
+    memset(&lx, 0, sizeof(Lexer)); // lx.ptr stays NULL if the file cannot be read
+    TokenList tokenList;
+    int state = scanner(&lx, filename, &tokenList, useDefault, out);
+    if (state != 0) {
+        fprintf(err, "Scanner error!\n");
+    } else {
+        printTokenList(&tokenList, out);
+    }
+    freeTokenList(&tokenList);
+    free(lx.ptr);
+    return state;
+}
+
+// Print the AST saved in a flat AST file, without the text it was parsed from.
+// Returns 0 on success, 1 on failure.
+int printFlatFile(const char* path, FILE* out, FILE* err) {
+    FlatAST fa;
+    if (openFlatAST(&fa, path) != 0) {
+        fprintf(err, "Error: %s is not a valid flat AST\n", path);
+        return 1;
+    }
+    printFlatAST(&fa, out);
+    closeFlatAST(&fa);
     return 0;
-}
\ No newline at end of file
+}
+
+/*===========================*/
+// Batch mode                //
+/*===========================*/
+
+// One file of a batch. The output is kept in memory until the whole batch
+// is done, so that it is printed in the order of the files on the command line.
+typedef struct Job {
+    const char* filename;
+    char* out;       // output of the file, from open_memstream()
+    size_t outSize;
+    int result;      // return value of parseFile()
+    size_t bytes;    // size of the file
+    size_t tokens;   // number of tokens
+    double seconds;  // time spent on the file
+} Job;
+
+// Work stealing: each worker owns a range of jobs and takes them from the front.
+// A worker whose range is empty steals the back half of another worker's range.
+typedef struct Worker {
+    pthread_mutex_t lock;
+    int lo, hi;      // jobs [lo, hi) are not started yet
+    pthread_t thread;
+    struct Pool* pool;
+    int id;
+} Worker;
+
+typedef struct Pool {
+    Job* jobs;
+    Worker* workers;
+    int nworkers;
+    int useCache;
+    int recover;
+    int positions;
+    int useStats;
+    ASTFormat format;
+} Pool;
+
+// take the next job of a worker, stealing if needed; returns -1 if there is none left
+int nextJob(Worker* w) {
+    Pool* pool = w->pool;
+    int job = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->lo < w->hi) {
+        job = w->lo++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 1; job < 0 && i < pool->nworkers; i++) {
+        Worker* victim = &pool->workers[(w->id + i) % pool->nworkers];
+        int lo = 0, hi = 0;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->lo < victim->hi) {
+            lo = victim->lo + (victim->hi - victim->lo) / 2; // the victim keeps the front half
+            hi = victim->hi;
+            victim->hi = lo;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (lo < hi) {
+            pthread_mutex_lock(&w->lock);
+            job = lo;
+            w->lo = lo + 1;
+            w->hi = hi;
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return job;
+}
+
+void* runWorker(void* arg) {
+    Worker* w = (Worker*)arg;
+    int i;
+    while ((i = nextJob(w)) >= 0) {
+        Job* job = &w->pool->jobs[i];
+        double start = now();
+        FILE* out = open_memstream(&job->out, &job->outSize);
+        if (out == NULL) {
+            job->result = 1;
+            continue;
+        }
+        job->result = parseFile(job->filename, 0, w->pool->useCache, w->pool->recover, w->pool->positions, w->pool->useStats, w->pool->format, out, out, &job->bytes, &job->tokens);
+        fclose(out);
+        job->seconds = now() - start;
+    }
+    return NULL;
+}
+
+// Parse all files with nworkers threads, print the outputs in order to stdout
+// and the throughput of each file and of the whole batch to stderr.
+// Returns 0 if all files were parsed successfully.
+int runBatch(const char** files, int nfiles, int nworkers, int useCache, int recover, int positions, int useStats, ASTFormat format) {
+    Job* jobs = (Job*)calloc(nfiles, sizeof(Job));
+    if (nworkers > nfiles) {
+        nworkers = nfiles;
+    }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    Worker* workers = (Worker*)calloc(nworkers, sizeof(Worker));
+    if (jobs == NULL || workers == NULL) {
+        printf("Error: memory allocation failed\n");
+        free(jobs);
+        free(workers);
+        return 1;
+    }
+    Pool pool = {jobs, workers, nworkers, useCache, recover, positions, useStats, format};
+    for (int i = 0; i < nfiles; i++) {
+        jobs[i].filename = files[i];
+    }
+    for (int i = 0; i < nworkers; i++) { // contiguous ranges, stealing evens out the rest
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].lo = (int)((long long)nfiles * i / nworkers);
+        workers[i].hi = (int)((long long)nfiles * (i + 1) / nworkers);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    double start = now();
+    int started = 1;
+    for (; started < nworkers; started++) { // worker 0 is this thread
+        if (pthread_create(&workers[started].thread, NULL, runWorker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    runWorker(&workers[0]); // also does the jobs of workers that could not be started
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = now() - start;
+
+    int failed = 0;
+    size_t bytes = 0, tokens = 0;
+    for (int i = 0; i < nfiles; i++) {
+        printf("==> %s <==\n", jobs[i].filename);
+        if (jobs[i].out != NULL) {
+            fwrite(jobs[i].out, 1, jobs[i].outSize, stdout);
+            free(jobs[i].out);
+        }
+        fprintf(stderr, "%s: %zu bytes, %zu tokens, %.3f ms, %.2f MB/s%s\n", jobs[i].filename,
+                jobs[i].bytes, jobs[i].tokens, jobs[i].seconds * 1e3,
+                jobs[i].seconds > 0 ? jobs[i].bytes / jobs[i].seconds / 1e6 : 0.0,
+                jobs[i].result != 0 ? " (failed)" : "");
+        failed += jobs[i].result != 0;
+        bytes += jobs[i].bytes;
+        tokens += jobs[i].tokens;
+    }
+    fprintf(stderr, "Total: %d files (%d failed), %zu bytes, %zu tokens, %.3f s, %d threads\n",
+            nfiles, failed, bytes, tokens, seconds, nworkers);
+    if (seconds > 0) {
+        fprintf(stderr, "Throughput: %.2f MB/s, %.0f tokens/s, %.0f files/s\n",
+                bytes / seconds / 1e6, tokens / seconds, nfiles / seconds);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+    free(workers);
+    free(jobs);
+    return failed != 0;
+}
+
+// Read the file names of a manifest, one per line; empty lines and lines starting with # are skipped.
+// Returns the number of names added to *files (grown with realloc), or -1 on failure.
+int readManifest(const char* manifest, char*** files, int* nfiles, int* cap) {
+    FILE* fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        printf("Error: file %s not found\n", manifest);
+        return -1;
+    }
+    char* line = NULL;
+    size_t lineCap = 0;
+    ssize_t n;
+    int added = 0;
+    while ((n = getline(&line, &lineCap, fp)) >= 0) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+        if (n == 0 || line[0] == '#') {
+            continue;
+        }
+        if (*nfiles == *cap) {
+            int newCap = *cap == 0 ? 64 : *cap * 2;
+            char** tmp = (char**)realloc(*files, sizeof(char*) * newCap);
+            if (tmp == NULL) {
+                break;
+            }
+            *files = tmp;
+            *cap = newCap;
+        }
+        (*files)[(*nfiles)++] = strdup(line);
+        added++;
+    }
+    free(line);
+    fclose(fp);
+    return added;
+}
+
+/*===========================*/
+// Benchmark                 //
+/*===========================*/
+
+// xorshift64*, so that a seed always generates the same expression
+uint64_t nextRandom(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// A random valid expression written by generateExpr()
+typedef struct Generator {
+    Writer w;
+    size_t written;   // number of bytes written so far
+    int depth;        // maximal nesting of parentheses
+    int width;        // maximal number of terms of a sum
+    uint64_t rng;
+} Generator;
+
+void genWrite(Generator* g, const char* str, size_t len) {
+    writeBytes(&g->w, str, len);
+    g->written += len;
+}
+
+// S: 2 to width terms joined by '+' (S -> E S', S' -> + S). A term is ( S ) while
+// the depth allows it and the budget, the number of bytes for S, is large enough,
+// else a literal: the budget is split among the terms, which keeps the sums short.
+void genSum(Generator* g, int depth, size_t budget) {
+    int terms = g->width < 2 ? 1 : 2 + (int)(nextRandom(&g->rng) % (uint64_t)(g->width - 1));
+    size_t each = budget / terms;
+    for (int i = 0; i < terms; i++) {
+        if (i > 0) {
+            genWrite(g, "+", 1);
+        }
+        if (depth < g->depth && each > 8) {
+            genWrite(g, "(", 1);
+            genSum(g, depth + 1, each - 2);
+            genWrite(g, ")", 1);
+        } else {
+            char digits[24];
+            int n = sprintf(digits, "%u", (unsigned)(nextRandom(&g->rng) % 1000));
+            genWrite(g, digits, n);
+        }
+    }
+}
+
+// Write a random expression of about size bytes to out, with parentheses nested up
+// to depth and sums of up to width terms. The expression is smaller than size if
+// depth is too small for it. The same seed gives the same expression.
+void generateExpr(size_t size, int depth, int width, uint64_t seed, FILE* out) {
+    Generator* g = (Generator*)malloc(sizeof(Generator));
+    if (g == NULL) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        return;
+    }
+    initWriter(&g->w, out);
+    g->written = 0;
+    g->depth = depth < 0 ? 0 : depth;
+    g->width = width < 1 ? 1 : width;
+    g->rng = seed != 0 ? seed : 1; // xorshift never leaves 0
+    genSum(g, 0, size);
+    genWrite(g, "\n", 1);
+    flushWriter(&g->w);
+    free(g);
+}
+
+int compareTimes(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// the p-th percentile of n sorted times (nearest rank)
+double percentile(const double* times, int n, int p) {
+    int rank = (n * p + 99) / 100;
+    return times[rank > 0 ? rank - 1 : 0];
+}
+
+// Print the median, 90th percentile and best time of a phase, and the throughput
+// at the median: bytes per second and, if unit is not NULL, items per second.
+void printPhase(const char* phase, double* times, int runs, size_t bytes, size_t items, const char* unit) {
+    qsort(times, runs, sizeof(double), compareTimes);
+    double median = percentile(times, runs, 50);
+    printf("%-6s median %9.3f ms, p90 %9.3f ms, min %9.3f ms | %8.2f MB/s",
+           phase, median * 1e3, percentile(times, runs, 90) * 1e3, times[0] * 1e3,
+           median > 0 ? bytes / median / 1e6 : 0.0);
+    if (unit != NULL) {
+        printf(", %.0f %s/s", median > 0 ? items / median : 0.0, unit);
+    }
+    printf("\n");
+}
+
+// Scan, parse and print a file runs times, then report the scan (input MB/s and tokens/s),
+// the parse, which pulls the tokens from the lexer (input MB/s and nodes/s),
+// and the printing in the given format to memory (output MB/s).
+// Returns 0 on success, 1 on failure.
+int benchFile(const char* filename, int runs, ASTFormat format) {
+    Lexer lx;
+    if (openLexer(&lx, filename, 0, stdout) != 0) {
+        return 1;
+    }
+    double* times = (double*)malloc(sizeof(double) * runs * 3);
+    TokenSink* sink = (TokenSink*)malloc(sizeof(TokenSink)); // the scan phase only counts the tokens
+    if (times == NULL || sink == NULL) {
+        printf("Error: memory allocation failed\n");
+        free(times);
+        free(sink);
+        free(lx.ptr);
+        return 1;
+    }
+    sink->push = countTokens;
+    double* scanTimes = times;
+    double* parseTimes = times + runs;
+    double* printTimes = times + runs * 2;
+    size_t ntokens = 0, outBytes = 0;
+    int nodes = 0;
+    int result = 0;
+    for (int i = 0; i < runs && result == 0; i++) {
+        lx.loc = 0;
+        ntokens = 0;
+        sink->ctx = &ntokens;
+        double start = now();
+        result = scanToSink(&lx, sink);
+        scanTimes[i] = now() - start;
+        if (result != 0) {
+            break;
+        }
+
+        AST ast;
+        Parser ps;
+        lx.loc = 0;
+        start = now();
+        rdparser(&ps, &ast, &lx, stdout);
+        parseTimes[i] = now() - start;
+        nodes = ast.nodeCount;
+        if (ps.hasError) {
+            result = 1;
+        } else {
+            char* buf = NULL;
+            FILE* out = open_memstream(&buf, &outBytes);
+            if (out == NULL) {
+                result = 1;
+            } else {
+                start = now();
+                exportAST(&ast, format, NULL, out);
+                fflush(out);
+                printTimes[i] = now() - start;
+                fclose(out);
+                free(buf);
+            }
+        }
+        freeAST(&ast);
+    }
+    if (result == 0) {
+        printf("%s: %zu bytes, %zu tokens, %d nodes, %d runs\n", filename, lx.size, ntokens, nodes, runs);
+        printPhase("scan", scanTimes, runs, lx.size, ntokens, "tokens");
+        printPhase("parse", parseTimes, runs, lx.size, nodes, "nodes");
+        printPhase("print", printTimes, runs, outBytes, 0, NULL);
+    }
+    free(times);
+    free(sink);
+    free(lx.ptr);
+    return result;
+}
+
+/*===========================*/
+// main()                    //
+/*===========================*/
+
+// Usage: main [-c] [-k] [-l] [-s] [-t] [-f format] [-j threads] [-m manifest] [-e offset:deleted:text]... [file...]
+//        main -r file.ast
+//        main -g size[:depth[:width[:seed]]]
+//        main -b runs [-f format] [file...]
+//   -c    print the AST from "<file>.ast" if the file has not changed, else parse and save it there
+//   -f    print the AST as text (the default), json or dot (Graphviz)
+//   -k    keep going after an error: skip to the next delimiter (lexer) or to
+//         ')', ';' or '}' (parser), and report all the errors at the end
+//   -l    print the line and column of an error, and of each node with -f json
+//   -s    print the node counts, memory, max depth and phase times of the parse after the AST
+//   -t    print the token list instead of parsing (one file only)
+//   -j    number of worker threads in batch mode, 0 for one per online processor
+//   -m    also parse the files listed in the manifest, one per line
+//   -e    edit the file after parsing it and parse it again incrementally,
+//         replacing the deleted bytes at offset by the text (one file only)
+//   -r    print the AST saved in a flat AST file, such as "<file>.ast"
+//   -g    write a random expression of size bytes to stdout, with parentheses nested
+//         up to depth (default 16) and sums of up to width terms (default 4)
+//   -b    benchmark: scan, parse and print each file this many times and report the throughput
+// Without a file, the default test string is parsed.
+// With several files (batch mode), the outputs are printed in order
+// and the throughput is reported to stderr.
+int main(int argc, char* argv[]) {
+    int nthreads = 0;
+    int useCache = 0;
+    int recover = 0;
+    int positions = 0;
+    int useStats = 0;
+    int tokensOnly = 0;
+    ASTFormat format = TextFormat;
+    const char* flatFile = NULL;
+    char** files = NULL; // file names, the ones from argv are not copied
+    int nfiles = 0;
+    int cap = 0;
+    int fromArgv = 0;    // files[0..fromArgv) point into argv
+    const char* manifest = NULL;
+    const char* generate = NULL;
+    int runs = 0;
+    char** edits = (char**)malloc(sizeof(char*) * argc); // at most argc / 2 edits
+    int nedits = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) {
+            useCache = 1;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            recover = 1;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            positions = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            useStats = 1;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            tokensOnly = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "json") == 0) {
+                format = JSONFormat;
+            } else if (strcmp(argv[i], "dot") == 0) {
+                format = DOTFormat;
+            } else if (strcmp(argv[i], "text") == 0) {
+                format = TextFormat;
+            } else {
+                printf("Error: unknown format %s\n", argv[i]);
+                free(files);
+                free(edits);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            flatFile = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            edits[nedits++] = argv[++i];
+        } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            generate = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            if (nfiles == cap) {
+                cap = cap == 0 ? 16 : cap * 2;
+                files = (char**)realloc(files, sizeof(char*) * cap);
+            }
+            files[nfiles++] = argv[i];
+            fromArgv++;
+        }
+    }
+    if (nthreads <= 0) {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads > MAXTHREADS) {
+        nthreads = MAXTHREADS;
+    }
+    if (manifest != NULL && readManifest(manifest, &files, &nfiles, &cap) < 0) {
+        free(files);
+        free(edits);
+        return 1;
+    }
+
+    int result;
+    size_t bytes, tokens;
+    if (flatFile != NULL) {
+        result = printFlatFile(flatFile, stdout, stderr);
+    } else if (generate != NULL) {
+        unsigned long long size = 0, seed = 1;
+        int depth = 16, width = 4;
+        sscanf(generate, "%llu:%d:%d:%llu", &size, &depth, &width, &seed);
+        generateExpr((size_t)size, depth, width, seed, stdout);
+        result = 0;
+    } else if (runs > 0) {
+        if (nfiles == 0) {
+            printf("Error: no file to benchmark\n");
+            result = 1;
+        } else {
+            result = 0;
+            for (int i = 0; i < nfiles; i++) {
+                result |= benchFile(files[i], runs, format);
+            }
+        }
+    } else if (nedits > 0 && (nfiles != 1 || manifest != NULL)) {
+        printf("Error: -e needs exactly one file\n");
+        result = 1;
+    } else if (tokensOnly && (nfiles > 1 || manifest != NULL)) {
+        printf("Error: -t takes one file at most\n");
+        result = 1;
+    } else if (tokensOnly) {
+        if (nfiles == 1) {
+            printf("Using file: %s\n", files[0]);
+        }
+        result = printTokensFile(nfiles == 1 ? files[0] : SAMPLEFILE, nfiles == 0, stdout, stderr);
+    } else if (nfiles == 0 && manifest == NULL) {
+        result = parseFile(SAMPLEFILE, 1, 0, recover, positions, useStats, format, stdout, stderr, &bytes, &tokens);
+    } else if (nfiles == 1 && manifest == NULL) {
+        // JSON and DOT go to a parser or to Graphviz: nothing else on stdout
+        fprintf(format == TextFormat ? stdout : stderr, "Using file: %s\n", files[0]);
+        if (nedits > 0) {
+            result = editFile(files[0], edits, nedits, positions, format, stdout, stderr);
+        } else {
+            result = parseFile(files[0], 0, useCache, recover, positions, useStats, format, stdout, stderr, &bytes, &tokens);
+        }
+    } else {
+        result = runBatch((const char**)files, nfiles, nthreads, useCache, recover, positions, useStats, format);
+    }
+
+    for (int i = fromArgv; i < nfiles; i++) {
+        free(files[i]);
+    }
+    free(files);
+    free(edits);
+    return result;
+}